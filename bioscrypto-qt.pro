@@ -160,6 +160,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/qt/editaddressdialog.h \
     src/qt/bitcoinaddressvalidator.h \
     src/alert.h \
+    src/blockencodings.h \
     src/addrman.h \
     src/base58.h \
     src/bignum.h \
@@ -184,6 +185,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/db.h \
     src/txdb.h \
     src/txmempool.h \
+    src/txverify.h \
     src/walletdb.h \
     src/script.h \
     src/init.h \
@@ -232,6 +234,9 @@ HEADERS += src/qt/bitcoingui.h \
     src/qt/rpcconsole.h \
     src/version.h \
     src/netbase.h \
+    src/netpoll.h \
+    src/bloom.h \
+    src/netstats.h \
     src/clientversion.h \
     src/threadsafety.h \
     src/tinyformat.h \
@@ -258,13 +263,18 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/qt/editaddressdialog.cpp \
     src/qt/bitcoinaddressvalidator.cpp \
     src/alert.cpp \
+    src/blockencodings.cpp \
     src/chainparams.cpp \
     src/version.cpp \
     src/sync.cpp \
     src/txmempool.cpp \
+    src/txverify.cpp \
     src/util.cpp \
     src/hash.cpp \
     src/netbase.cpp \
+    src/netpoll.cpp \
+    src/bloom.cpp \
+    src/netstats.cpp \
     src/key.cpp \
     src/script.cpp \
     src/core.cpp \
@@ -0,0 +1,74 @@
+// Copyright (c) 2016 The BiosCrypto developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Fills an address manager with the addresses the addrman unit tests use,
+// and reports the time spent filling it, in Select, and holding its lock to
+// dump it with and without a snapshot. Offer more addresses than the bucket arrays
+// hold to include the cost of collisions.
+
+#include "addrman.h"
+#include "chainparams.h"
+#include "serialize.h"
+#include "test/addrman_util.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "version.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <stdexcept>
+
+// Normally defined by version.cpp, init.cpp and chainparams.cpp, which
+// pull in the rest of the node
+const std::string CLIENT_BUILD("addrman-bench");
+CClientUIInterface uiInterface;
+const CChainParams& Params() { throw std::runtime_error("Params() is not available in addrman-bench"); }
+
+int main(int argc, char* argv[])
+{
+    unsigned int nAddresses = argc > 1 ? atoi(argv[1]) : 100000;
+    unsigned int nGood = argc > 2 ? atoi(argv[2]) : nAddresses / 100;
+    unsigned int nSelects = argc > 3 ? atoi(argv[3]) : 1000;
+    if (nAddresses == 0 || nGood > nAddresses)
+    {
+        fprintf(stderr, "Usage: addrman-bench [addresses] [good] [selects]\n");
+        return 1;
+    }
+
+    CAddrMan addrman;
+    int64_t nStart = GetTimeMicros();
+    FillAddrMan(addrman, nAddresses, nGood);
+    int64_t nFill = GetTimeMicros() - nStart;
+
+    unsigned int nRoutable = 0;
+    nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < nSelects; i++)
+        if (addrman.Select().IsRoutable())
+            nRoutable++;
+    int64_t nSelect = GetTimeMicros() - nStart;
+
+    // Time cs is held to dump with and without a snapshot
+    nStart = GetTimeMicros();
+    CDataStream ssLive(SER_DISK, CLIENT_VERSION);
+    ssLive << addrman;
+    int64_t nSerialize = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    CAddrMan addrSnapshot;
+    addrman.GetSnapshot(addrSnapshot);
+    int64_t nSnapshot = GetTimeMicros() - nStart;
+    CDataStream ssSnapshot(SER_DISK, CLIENT_VERSION);
+    ssSnapshot << addrSnapshot;
+    if (ssSnapshot.str() != ssLive.str())
+    {
+        fprintf(stderr, "error: snapshot doesn't serialize like the live tables\n");
+        return 1;
+    }
+
+    printf("%d of %u addresses kept, filled in %dms\n", addrman.size(), nAddresses, (int)(nFill / 1000));
+    printf("Select: %.2fus avg, %u of %u routable\n", nSelects ? (double)nSelect / nSelects : 0.0, nRoutable, nSelects);
+    printf("serialize: %dms, snapshot: %dms, %u bytes\n", (int)(nSerialize / 1000), (int)(nSnapshot / 1000), (unsigned int)ssLive.size());
+    return 0;
+}
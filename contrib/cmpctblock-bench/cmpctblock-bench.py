@@ -0,0 +1,154 @@
+#!/usr/bin/python
+#
+# cmpctblock-bench.py:  Measure block propagation between two regtest nodes,
+# with and without compact blocks.
+#
+# Copyright (c) 2016 The BiosCrypto developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+import json
+import base64
+import httplib
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+settings = {}
+
+class BitcoinRPC:
+	OBJID = 1
+
+	def __init__(self, host, port, username, password):
+		authpair = "%s:%s" % (username, password)
+		self.authhdr = "Basic %s" % (base64.b64encode(authpair))
+		self.host = host
+		self.port = port
+	def rpc(self, method, params=None):
+		self.OBJID += 1
+		obj = { 'version' : '1.1',
+			'method' : method,
+			'id' : self.OBJID }
+		if params is None:
+			obj['params'] = []
+		else:
+			obj['params'] = params
+		conn = httplib.HTTPConnection(self.host, self.port, False, 60)
+		conn.request('POST', '/', json.dumps(obj),
+			{ 'Authorization' : self.authhdr,
+			  'Content-type' : 'application/json' })
+		resp_obj = json.loads(conn.getresponse().read())
+		conn.close()
+		if 'error' in resp_obj and resp_obj['error'] != None:
+			raise RuntimeError("%s: %s" % (method, resp_obj['error']))
+		return resp_obj['result']
+
+def start_node(n, compact, connect=None):
+	datadir = os.path.join(settings['tmpdir'], "node%d-%d" % (n, compact))
+	os.makedirs(datadir)
+	args = [ settings['bioscryptod'], '-regtest', '-datadir=' + datadir,
+		 '-port=%d' % (settings['port'] + n), '-rpcport=%d' % (settings['rpcport'] + n),
+		 '-rpcuser=bench', '-rpcpassword=bench', '-listen=1', '-discover=0',
+		 '-dnsseed=0', '-debug=cmpctblock', '-compactblocks=%d' % compact ]
+	if connect is not None:
+		args.append('-connect=127.0.0.1:%d' % (settings['port'] + connect))
+	proc = subprocess.Popen(args)
+	rpc = BitcoinRPC('127.0.0.1', settings['rpcport'] + n, 'bench', 'bench')
+	for i in range(60):
+		try:
+			rpc.rpc('getinfo')
+			return (proc, rpc)
+		except Exception:
+			time.sleep(1)
+	raise RuntimeError("node %d did not start" % n)
+
+# Regtest difficulty accepts about every other hash, so submitting fresh work
+# until one sticks mines a block
+def mine_block(rpc):
+	while True:
+		try:
+			work = rpc.rpc('getwork')
+		except RuntimeError:
+			# still in initial block download, or not connected yet
+			time.sleep(1)
+			continue
+		if rpc.rpc('getwork', [work['data']]):
+			return
+
+def bytes_received(rpc):
+	return sum([peer['bytesrecv'] for peer in rpc.rpc('getpeerinfo')])
+
+def wait_for(cond, timeout=60):
+	start = time.time()
+	while not cond():
+		if time.time() - start > timeout:
+			raise RuntimeError("timed out")
+		time.sleep(0.001)
+
+def run(compact):
+	(proc_a, a) = start_node(0, compact)
+	(proc_b, b) = start_node(1, compact, connect=0)
+	try:
+		# Mature some coinbase outputs to spend
+		for i in range(settings['warmup']):
+			mine_block(a)
+		wait_for(lambda: b.rpc('getbestblockhash') == a.rpc('getbestblockhash'))
+
+		results = []
+		address = a.rpc('getnewaddress')
+		for r in range(settings['rounds']):
+			for i in range(settings['txs']):
+				a.rpc('sendtoaddress', [address, 0.01])
+			wait_for(lambda: len(b.rpc('getrawmempool')) >= settings['txs'])
+
+			nBytes = bytes_received(b)
+			start = time.time()
+			mine_block(a)
+			hash = a.rpc('getbestblockhash')
+			wait_for(lambda: b.rpc('getbestblockhash') == hash)
+			results.append((time.time() - start, bytes_received(b) - nBytes))
+		return results
+	finally:
+		for rpc in (a, b):
+			try:
+				rpc.rpc('stop')
+			except Exception:
+				pass
+		proc_a.wait()
+		proc_b.wait()
+
+def report(name, results):
+	latency = sorted([r[0] for r in results])
+	nBytes = sorted([r[1] for r in results])
+	print "%-14s median %7.1f ms  max %7.1f ms  median %8d bytes received" % (
+		name, latency[len(latency) / 2] * 1000, latency[-1] * 1000, nBytes[len(nBytes) / 2])
+
+if __name__ == '__main__':
+	if len(sys.argv) < 2:
+		print "Usage: cmpctblock-bench.py <bioscryptod> [-txs=<n>] [-rounds=<n>] [-warmup=<n>]"
+		sys.exit(1)
+
+	settings['bioscryptod'] = sys.argv[1]
+	settings['txs'] = 200
+	settings['rounds'] = 10
+	settings['warmup'] = 100
+	settings['port'] = 28444
+	settings['rpcport'] = 28544
+	for arg in sys.argv[2:]:
+		(key, value) = arg.lstrip('-').split('=')
+		settings[key] = int(value)
+
+	settings['tmpdir'] = tempfile.mkdtemp(prefix='cmpctblock-bench')
+	try:
+		full = run(0)
+		compact = run(1)
+	finally:
+		shutil.rmtree(settings['tmpdir'])
+
+	print "%d rounds of %d transactions per block" % (settings['rounds'], settings['txs'])
+	report("full blocks", full)
+	report("compact blocks", compact)
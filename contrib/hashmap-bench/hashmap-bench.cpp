@@ -0,0 +1,125 @@
+// Copyright (c) 2016 The BiosCrypto developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Times the ordered maps the node used to key by uint256 and COutPoint
+// against the salted hash tables that replaced them: inserting, finding
+// keys that are present and absent, and erasing. Each step also reports
+// how many heap allocations it made.
+
+#include "core.h"
+#include "uint256.h"
+#include "util.h"
+
+#include <openssl/rand.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <map>
+#include <new>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+static uint64_t nAllocs = 0;
+
+void* operator new(size_t n)
+{
+    nAllocs++;
+    void* p = malloc(n);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) throw()
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) throw()
+{
+    free(p);
+}
+
+static uint256 RandomHash()
+{
+    uint256 hash;
+    RAND_bytes((unsigned char*)&hash, sizeof(hash));
+    return hash;
+}
+
+// Allocations and time since the last call, per key
+static void Report(const char* pszMap, const char* pszStep, size_t nKeys, uint64_t& nAllocsStart, int64_t& nStart)
+{
+    int64_t nTime = GetTimeMicros() - nStart;
+    printf("%-34s %-6s %8.1f ns %6.2f allocs\n", pszMap, pszStep,
+           nTime * 1000.0 / nKeys, (double)(nAllocs - nAllocsStart) / nKeys);
+    nAllocsStart = nAllocs;
+    nStart = GetTimeMicros();
+}
+
+template<typename Map, typename Key>
+static void Bench(const char* pszMap, const std::vector<Key>& vKeys, const std::vector<Key>& vAbsent, const std::vector<Key>& vOrder)
+{
+    Map map;
+    size_t nFound = 0;
+    uint64_t nAllocsStart = nAllocs;
+    int64_t nStart = GetTimeMicros();
+
+    for (size_t i = 0; i < vKeys.size(); i++)
+        map.insert(std::make_pair(vKeys[i], (int)i));
+    Report(pszMap, "insert", vKeys.size(), nAllocsStart, nStart);
+
+    for (size_t i = 0; i < vOrder.size(); i++)
+        nFound += map.count(vOrder[i]);
+    Report(pszMap, "find", vOrder.size(), nAllocsStart, nStart);
+
+    for (size_t i = 0; i < vAbsent.size(); i++)
+        nFound += map.count(vAbsent[i]);
+    Report(pszMap, "miss", vAbsent.size(), nAllocsStart, nStart);
+
+    for (size_t i = 0; i < vOrder.size(); i++)
+        map.erase(vOrder[i]);
+    Report(pszMap, "erase", vOrder.size(), nAllocsStart, nStart);
+
+    if (nFound != vOrder.size() || !map.empty())
+    {
+        fprintf(stderr, "error: %s found %u of %u keys\n", pszMap, (unsigned int)nFound, (unsigned int)vOrder.size());
+        exit(1);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    size_t nKeys = argc > 1 ? atoi(argv[1]) : 500000;
+    if (nKeys == 0)
+    {
+        fprintf(stderr, "Usage: hashmap-bench [keys]\n");
+        return 1;
+    }
+
+    // Lookups go in a different order than the inserts, as in the node
+    std::vector<uint256> vHashes, vHashesAbsent;
+    std::vector<COutPoint> vOutpoints, vOutpointsAbsent;
+    for (size_t i = 0; i < nKeys; i++)
+    {
+        vHashes.push_back(RandomHash());
+        vHashesAbsent.push_back(RandomHash());
+        vOutpoints.push_back(COutPoint(RandomHash(), i % 4));
+        vOutpointsAbsent.push_back(COutPoint(vOutpoints.back().hash, i % 4 + 4));
+    }
+    std::vector<uint256> vHashesOrder(vHashes);
+    std::random_shuffle(vHashesOrder.begin(), vHashesOrder.end());
+    std::vector<COutPoint> vOutpointsOrder(vOutpoints);
+    std::random_shuffle(vOutpointsOrder.begin(), vOutpointsOrder.end());
+
+    printf("%u keys\n", (unsigned int)nKeys);
+    Bench<std::map<uint256, int> >("map<uint256>", vHashes, vHashesAbsent, vHashesOrder);
+    Bench<boost::unordered_map<uint256, int, SaltedUint256Hasher> >("unordered_map<uint256, Salted>", vHashes, vHashesAbsent, vHashesOrder);
+    Bench<std::map<COutPoint, int> >("map<COutPoint>", vOutpoints, vOutpointsAbsent, vOutpointsOrder);
+    Bench<boost::unordered_map<COutPoint, int, SaltedOutpointHasher> >("unordered_map<COutPoint, Salted>", vOutpoints, vOutpointsAbsent, vOutpointsOrder);
+    return 0;
+}
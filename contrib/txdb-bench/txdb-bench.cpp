@@ -0,0 +1,171 @@
+// Copyright (c) 2014 The BiosCrypto developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Replays a txdb key-access trace recorded with bioscryptod -dbtrace=<file>
+// against a LevelDB opened with the given options, and reports the time
+// spent in reads and batch writes. The database should be a copy of the
+// node's txleveldb from before the trace was recorded; an empty one answers
+// every read from its memtable and says nothing about a real chainstate.
+
+#include <leveldb/cache.h>
+#include <leveldb/db.h>
+#include <leveldb/filter_policy.h>
+#include <leveldb/write_batch.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <string>
+
+static int64_t GetTimeMicros()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void Usage()
+{
+    fprintf(stderr,
+        "Usage: txdb-bench [options] <trace> <database copy>\n"
+        "  -cache=<n>          block cache in megabytes (default: 25)\n"
+        "  -writebuffer=<n>    write buffer in megabytes (default: 4)\n"
+        "  -maxopenfiles=<n>   open file limit (default: 1000)\n"
+        "  -blocksize=<n>      block size in kilobytes (default: 4)\n"
+        "  -compression=<0|1>  snappy compression (default: 1)\n"
+        "  -bloombits=<n>      bloom filter bits per key, 0 = none (default: 10)\n"
+        "  -empty              allow starting from an empty database\n");
+}
+
+int main(int argc, char* argv[])
+{
+    int nCacheMB = 25, nWriteBufferMB = 4, nMaxOpenFiles = 1000, nBlockSizeKB = 4, nBloomBits = 10;
+    bool fCompression = true, fEmpty = false;
+    const char* pszTrace = NULL;
+    const char* pszDir = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        const char* psz = argv[i];
+        if (sscanf(psz, "-cache=%d", &nCacheMB) == 1) continue;
+        if (sscanf(psz, "-writebuffer=%d", &nWriteBufferMB) == 1) continue;
+        if (sscanf(psz, "-maxopenfiles=%d", &nMaxOpenFiles) == 1) continue;
+        if (sscanf(psz, "-blocksize=%d", &nBlockSizeKB) == 1) continue;
+        if (sscanf(psz, "-bloombits=%d", &nBloomBits) == 1) continue;
+        if (strcmp(psz, "-empty") == 0) { fEmpty = true; continue; }
+        int n;
+        if (sscanf(psz, "-compression=%d", &n) == 1) { fCompression = n != 0; continue; }
+        if (psz[0] == '-') { Usage(); return 1; }
+        if (!pszTrace) pszTrace = psz;
+        else if (!pszDir) pszDir = psz;
+        else { Usage(); return 1; }
+    }
+    if (!pszTrace || !pszDir)
+    {
+        Usage();
+        return 1;
+    }
+
+    FILE* file = fopen(pszTrace, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "cannot open %s\n", pszTrace);
+        return 1;
+    }
+
+    leveldb::Options options;
+    options.create_if_missing = fEmpty;
+    options.block_cache = leveldb::NewLRUCache((size_t)nCacheMB * 1048576);
+    options.filter_policy = nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(nBloomBits) : NULL;
+    options.write_buffer_size = (size_t)nWriteBufferMB * 1048576;
+    options.max_open_files = nMaxOpenFiles;
+    options.block_size = (size_t)nBlockSizeKB * 1024;
+    options.compression = fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+
+    leveldb::DB* pdb;
+    leveldb::Status status = leveldb::DB::Open(options, pszDir, &pdb);
+    if (!status.ok())
+    {
+        fprintf(stderr, "cannot open database in %s: %s\n", pszDir, status.ToString().c_str());
+        return 1;
+    }
+
+    uint64_t nGets = 0, nGetsFound = 0, nPuts = 0, nDeletes = 0, nCommits = 0;
+    int64_t nGetMicros = 0, nCommitMicros = 0, nMaxCommitMicros = 0;
+    leveldb::WriteBatch batch;
+    std::string strValue, strScratch;
+    unsigned char pchHeader[2];
+    while (fread(pchHeader, 1, 2, file) == 2)
+    {
+        char chOp = pchHeader[0];
+        char pchKey[255];
+        unsigned char pchSize[4];
+        if (fread(pchKey, 1, pchHeader[1], file) != pchHeader[1] || fread(pchSize, 1, 4, file) != 4)
+            break;
+        leveldb::Slice key(pchKey, pchHeader[1]);
+        uint32_t nValueSize = pchSize[0] | (pchSize[1] << 8) | (pchSize[2] << 16) | ((uint32_t)pchSize[3] << 24);
+
+        if (chOp == 'G')
+        {
+            int64_t nStart = GetTimeMicros();
+            if (pdb->Get(leveldb::ReadOptions(), key, &strScratch).ok())
+                nGetsFound++;
+            nGetMicros += GetTimeMicros() - nStart;
+            nGets++;
+        }
+        else if (chOp == 'P')
+        {
+            // Only the size of the value is recorded; fill it with
+            // something that compresses about as well as real records.
+            strValue.resize(nValueSize);
+            for (uint32_t i = 0; i < nValueSize; i++)
+                strValue[i] = (char)(rand() & (i % 4 ? 0xff : 0x0f));
+            batch.Put(key, strValue);
+            nPuts++;
+        }
+        else if (chOp == 'D')
+        {
+            batch.Delete(key);
+            nDeletes++;
+        }
+        else if (chOp == 'C')
+        {
+            int64_t nStart = GetTimeMicros();
+            status = pdb->Write(leveldb::WriteOptions(), &batch);
+            int64_t nMicros = GetTimeMicros() - nStart;
+            if (!status.ok())
+            {
+                fprintf(stderr, "write failed: %s\n", status.ToString().c_str());
+                return 1;
+            }
+            batch.Clear();
+            nCommitMicros += nMicros;
+            if (nMicros > nMaxCommitMicros)
+                nMaxCommitMicros = nMicros;
+            nCommits++;
+        }
+        else
+        {
+            fprintf(stderr, "bad trace record '%c'\n", chOp);
+            return 1;
+        }
+    }
+    fclose(file);
+
+    printf("gets      %10llu  %10.3f ms total  %8.2f us avg  %llu found\n", (unsigned long long)nGets,
+           nGetMicros / 1000.0, nGets ? (double)nGetMicros / nGets : 0.0, (unsigned long long)nGetsFound);
+    printf("puts      %10llu\n", (unsigned long long)nPuts);
+    printf("deletes   %10llu\n", (unsigned long long)nDeletes);
+    printf("commits   %10llu  %10.3f ms total  %8.2f us avg  %8.3f ms max\n", (unsigned long long)nCommits,
+           nCommitMicros / 1000.0, nCommits ? (double)nCommitMicros / nCommits : 0.0, nMaxCommitMicros / 1000.0);
+    std::string strStats;
+    if (pdb->GetProperty("leveldb.stats", &strStats))
+        printf("%s", strStats.c_str());
+
+    delete pdb;
+    delete options.filter_policy;
+    delete options.block_cache;
+    return 0;
+}
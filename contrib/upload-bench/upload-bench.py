@@ -0,0 +1,184 @@
+#!/usr/bin/python
+#
+# upload-bench.py:  Measure new block relay latency between two regtest nodes
+# while a third node serves historical blocks to freshly syncing nodes.
+#
+# Copyright (c) 2016 The BiosCrypto developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+import json
+import base64
+import httplib
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+settings = {}
+
+class BitcoinRPC:
+	OBJID = 1
+
+	def __init__(self, host, port, username, password):
+		authpair = "%s:%s" % (username, password)
+		self.authhdr = "Basic %s" % (base64.b64encode(authpair))
+		self.host = host
+		self.port = port
+	def rpc(self, method, params=None):
+		self.OBJID += 1
+		obj = { 'version' : '1.1',
+			'method' : method,
+			'id' : self.OBJID }
+		if params is None:
+			obj['params'] = []
+		else:
+			obj['params'] = params
+		conn = httplib.HTTPConnection(self.host, self.port, False, 60)
+		conn.request('POST', '/', json.dumps(obj),
+			{ 'Authorization' : self.authhdr,
+			  'Content-type' : 'application/json' })
+		resp_obj = json.loads(conn.getresponse().read())
+		conn.close()
+		if 'error' in resp_obj and resp_obj['error'] != None:
+			raise RuntimeError("%s: %s" % (method, resp_obj['error']))
+		return resp_obj['result']
+
+def start_node(name, n, connect=None, extra=[]):
+	datadir = os.path.join(settings['tmpdir'], name)
+	if os.path.exists(datadir):
+		shutil.rmtree(datadir)
+	os.makedirs(datadir)
+	args = [ settings['bioscryptod'], '-regtest', '-datadir=' + datadir,
+		 '-port=%d' % (settings['port'] + n), '-rpcport=%d' % (settings['rpcport'] + n),
+		 '-rpcuser=bench', '-rpcpassword=bench', '-listen=1', '-discover=0',
+		 '-dnsseed=0' ] + extra
+	if connect is not None:
+		args.append('-connect=127.0.0.1:%d' % (settings['port'] + connect))
+	proc = subprocess.Popen(args)
+	rpc = BitcoinRPC('127.0.0.1', settings['rpcport'] + n, 'bench', 'bench')
+	for i in range(60):
+		try:
+			rpc.rpc('getinfo')
+			return (proc, rpc)
+		except Exception:
+			time.sleep(1)
+	raise RuntimeError("node %s did not start" % name)
+
+def stop_node(node):
+	(proc, rpc) = node
+	try:
+		rpc.rpc('stop')
+	except Exception:
+		pass
+	proc.wait()
+
+# Regtest difficulty accepts about every other hash, so submitting fresh work
+# until one sticks mines a block
+def mine_block(rpc):
+	while True:
+		try:
+			work = rpc.rpc('getwork')
+		except RuntimeError:
+			# still in initial block download, or not connected yet
+			time.sleep(1)
+			continue
+		if rpc.rpc('getwork', [work['data']]):
+			return
+
+def wait_for(cond, timeout=60):
+	start = time.time()
+	while not cond():
+		if time.time() - start > timeout:
+			raise RuntimeError("timed out")
+		time.sleep(0.001)
+
+# Time from a accepting a newly mined block until b has it. Mining itself
+# is left out: regtest retargets every block, so it soon takes seconds.
+def relay_time(a, b):
+	mine_block(a)
+	start = time.time()
+	hash = a.rpc('getbestblockhash')
+	wait_for(lambda: b.rpc('getbestblockhash') == hash)
+	return time.time() - start
+
+def measure(a, b):
+	return [relay_time(a, b) for r in range(settings['rounds'])]
+
+# Loaders sync the whole chain from a, and start over once they have it
+def poll_loaders(loaders, height):
+	for i in range(len(loaders)):
+		try:
+			done = loaders[i][1].rpc('getblockcount') >= height
+		except Exception:
+			done = False
+		if done:
+			stop_node(loaders[i])
+			loaders[i] = start_node("loader%d" % i, 2 + i, connect=0)
+
+def report(name, results):
+	latency = sorted(results)
+	print "%-22s median %7.1f ms  90%% %7.1f ms  max %7.1f ms" % (
+		name, latency[len(latency) / 2] * 1000, latency[len(latency) * 9 / 10] * 1000, latency[-1] * 1000)
+
+if __name__ == '__main__':
+	if len(sys.argv) < 2:
+		print "Usage: upload-bench.py <bioscryptod> [-blocks=<n>] [-txs=<n>] [-loaders=<n>] [-rounds=<n>] [-maxuploadtarget=<MiB>]"
+		sys.exit(1)
+
+	settings['bioscryptod'] = sys.argv[1]
+	settings['blocks'] = 1000
+	settings['txs'] = 20
+	settings['loaders'] = 4
+	settings['rounds'] = 20
+	settings['maxuploadtarget'] = 0
+	settings['port'] = 28644
+	settings['rpcport'] = 28744
+	for arg in sys.argv[2:]:
+		(key, value) = arg.lstrip('-').split('=')
+		settings[key] = int(value)
+
+	settings['tmpdir'] = tempfile.mkdtemp(prefix='upload-bench')
+	nodes = []
+	try:
+		extra = []
+		if settings['maxuploadtarget']:
+			extra.append('-maxuploadtarget=%d' % settings['maxuploadtarget'])
+		a = start_node("source", 0, extra=extra)
+		nodes.append(a)
+		# getwork wants a peer, so the relay node is there from the start
+		b = start_node("relay", 1, connect=0)
+		nodes.append(b)
+		# A chain with some transactions in every block, for the loaders to
+		# fetch, once there are coins to send: blocks up to 100 pay no reward,
+		# and rewards take 90 more blocks to mature
+		for i in range(settings['blocks']):
+			if settings['txs'] and a[1].rpc('getbalance') >= settings['txs'] * 0.02:
+				address = a[1].rpc('getnewaddress')
+				for j in range(settings['txs']):
+					a[1].rpc('sendtoaddress', [address, 0.01])
+			mine_block(a[1])
+		wait_for(lambda: b[1].rpc('getblockcount') == a[1].rpc('getblockcount'), 600)
+		idle = measure(a[1], b[1])
+
+		loaders = [start_node("loader%d" % i, 2 + i, connect=0) for i in range(settings['loaders'])]
+		try:
+			time.sleep(2)
+			loaded = []
+			for r in range(settings['rounds']):
+				poll_loaders(loaders, settings['blocks'])
+				loaded.append(relay_time(a[1], b[1]))
+		finally:
+			for loader in loaders:
+				stop_node(loader)
+	finally:
+		for node in nodes:
+			stop_node(node)
+		shutil.rmtree(settings['tmpdir'])
+
+	print "%d blocks of %d transactions served to %d syncing nodes" % (settings['blocks'], settings['txs'], settings['loaders'])
+	report("relay, idle", idle)
+	report("relay, serving history", loaded)
@@ -13,6 +13,7 @@
 #include <map>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
 #include <openssl/rand.h>
 
 
@@ -38,7 +39,7 @@ private:
     // in tried set? (memory only)
     bool fInTried;
 
-    // position in vRandom
+    // position in vRandom; -1 for a free slot of CAddrMan::vInfo
     int nRandomPos;
 
     friend class CAddrMan;
@@ -158,6 +159,23 @@ public:
 // the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+/** Hasher for CAddrMan's address index, see SaltedUint256Hasher. Peers
+ *  choose the addresses they send us, so they could otherwise pick ones
+ *  that pile up in one chain of the table. */
+class SaltedNetAddrHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    SaltedNetAddrHasher() { GetSaltedHashKey(k0, k1); }
+
+    size_t operator()(const CNetAddr& addr) const
+    {
+        return addr.GetSaltedHash(k0, k1);
+    }
+};
+
 /** Stochastical (IP) address manager */
 class CAddrMan
 {
@@ -168,14 +186,15 @@ private:
     // secret key to randomize bucket select with
     uint256 nKey;
 
-    // last used nId
-    int nIdCount;
+    // table with information about all nIds, indexed by nId. Entries are
+    // stored in place, so pointers into it only last until the next Create.
+    std::vector<CAddrInfo> vInfo;
 
-    // table with information about all nIds
-    std::map<int, CAddrInfo> mapInfo;
+    // nIds of deleted entries, reused before vInfo grows
+    std::vector<int> vFreeIds;
 
     // find an nId based on its network address
-    std::map<CNetAddr, int> mapAddr;
+    boost::unordered_map<CNetAddr, int, SaltedNetAddrHasher> mapAddr;
 
     // randomly-ordered vector of all nIds
     std::vector<int> vRandom;
@@ -194,6 +213,20 @@ private:
 
 protected:
 
+    // Whether nId names an entry in vInfo.
+    bool IsValidId(int nId) const
+    {
+        return nId >= 0 && nId < (int)vInfo.size() && vInfo[nId].nRandomPos != -1;
+    }
+
+    // Number of slots in vInfo, and how many of them wait in vFreeIds (for tests).
+    void GetIdUsage(size_t& nSlots, size_t& nFree) const
+    {
+        LOCK(cs);
+        nSlots = vInfo.size();
+        nFree = vFreeIds.size();
+    }
+
     // Find an entry.
     CAddrInfo* Find(const CNetAddr& addr, int *pnId = NULL);
 
@@ -207,7 +240,7 @@ protected:
     // Move an entry from the "new" table(s) to the "tried" table
     void MakeTried(CAddrInfo& info, int nId);
 
-    // Delete an entry. It must not be in tried, and have refcount 0.
+    // Delete an entry, freeing its nId. It must not be in tried, and have refcount 0.
     void Delete(int nId);
 
     // Clear a position in a "new" table. This is the only place where entries are actually deleted.
@@ -281,11 +314,11 @@ public:
 
         int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT ^ (1 << 30);
         s << nUBuckets;
-        std::map<int, int> mapUnkIds;
+        std::vector<int> vUnkIds(vInfo.size(), -1);
         int nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-            mapUnkIds[(*it).first] = nIds;
-            const CAddrInfo &info = (*it).second;
+        for (unsigned int nId = 0; nId < vInfo.size(); nId++) {
+            vUnkIds[nId] = nIds;
+            const CAddrInfo &info = vInfo[nId];
             if (info.nRefCount) {
                 assert(nIds != nNew); // this means nNew was wrong, oh ow
                 s << info;
@@ -293,8 +326,8 @@ public:
             }
         }
         nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-            const CAddrInfo &info = (*it).second;
+        for (unsigned int nId = 0; nId < vInfo.size(); nId++) {
+            const CAddrInfo &info = vInfo[nId];
             if (info.fInTried) {
                 assert(nIds != nTried); // this means nTried was wrong, oh ow
                 s << info;
@@ -310,7 +343,7 @@ public:
             s << nSize;
             for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
                 if (vvNew[bucket][i] != -1) {
-                    int nIndex = mapUnkIds[vvNew[bucket][i]];
+                    int nIndex = vUnkIds[vvNew[bucket][i]];
                     s << nIndex;
                 }
             }
@@ -339,8 +372,11 @@ public:
         }
 
         // Deserialize entries from the new table.
+        vInfo.reserve(nNew + nTried);
+        mapAddr.rehash(nNew + nTried);
+        vInfo.resize(nNew);
         for (int n = 0; n < nNew; n++) {
-            CAddrInfo &info = mapInfo[n];
+            CAddrInfo &info = vInfo[n];
             s >> info;
             mapAddr[info] = n;
             info.nRandomPos = vRandom.size();
@@ -356,7 +392,6 @@ public:
                 }
             }
         }
-        nIdCount = nNew;
 
         // Deserialize entries from the tried table.
         int nLost = 0;
@@ -366,13 +401,13 @@ public:
             int nKBucket = info.GetTriedBucket(nKey);
             int nKBucketPos = info.GetBucketPosition(nKey, false, nKBucket);
             if (vvTried[nKBucket][nKBucketPos] == -1) {
+                int nId = vInfo.size();
                 info.nRandomPos = vRandom.size();
                 info.fInTried = true;
-                vRandom.push_back(nIdCount);
-                mapInfo[nIdCount] = info;
-                mapAddr[info] = nIdCount;
-                vvTried[nKBucket][nKBucketPos] = nIdCount;
-                nIdCount++;
+                vRandom.push_back(nId);
+                vInfo.push_back(info);
+                mapAddr[info] = nId;
+                vvTried[nKBucket][nKBucketPos] = nId;
             } else {
                 nLost++;
             }
@@ -387,7 +422,7 @@ public:
                 int nIndex = 0;
                 s >> nIndex;
                 if (nIndex >= 0 && nIndex < nNew) {
-                    CAddrInfo &info = mapInfo[nIndex];
+                    CAddrInfo &info = vInfo[nIndex];
                     int nUBucketPos = info.GetBucketPosition(nKey, true, bucket);
                     if (nVersion == 1 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew[bucket][nUBucketPos] == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) {
                         info.nRefCount++;
@@ -399,13 +434,10 @@ public:
 
         // Prune new entries with refcount 0 (as a result of collisions).
         int nLostUnk = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); ) {
-            if (it->second.fInTried == false && it->second.nRefCount == 0) {
-                std::map<int, CAddrInfo>::const_iterator itCopy = it++;
-                Delete(itCopy->first);
+        for (int n = 0; n < (int)vInfo.size(); n++) {
+            if (IsValidId(n) && vInfo[n].fInTried == false && vInfo[n].nRefCount == 0) {
+                Delete(n);
                 nLostUnk++;
-            } else {
-                it++;
             }
         }
         if (nLost + nLostUnk > 0) {
@@ -422,6 +454,9 @@ public:
 
     void Clear()
     {
+        std::vector<CAddrInfo>().swap(vInfo);
+        std::vector<int>().swap(vFreeIds);
+        mapAddr.clear();
         std::vector<int>().swap(vRandom);
         nKey = GetRandHash();
         for (size_t bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
@@ -435,7 +470,6 @@ public:
             }
         }
 
-        nIdCount = 0;
         nTried = 0;
         nNew = 0;
     }
@@ -450,6 +484,22 @@ public:
         nKey.SetNull();
     }
 
+    /**
+     * Copy the tables that are serialized into addrmanCopy, so peers.dat can
+     * be written from the copy without holding cs for the whole time. The
+     * address index isn't copied, so the copy is only fit for serializing.
+     */
+    void GetSnapshot(CAddrMan& addrmanCopy) const
+    {
+        LOCK(cs);
+        addrmanCopy.nKey = nKey;
+        addrmanCopy.vInfo = vInfo;
+        addrmanCopy.nTried = nTried;
+        addrmanCopy.nNew = nNew;
+        memcpy(addrmanCopy.vvNew, vvNew, sizeof(vvNew));
+        memcpy(addrmanCopy.vvTried, vvTried, sizeof(vvTried));
+    }
+
     // Return the number of (unique) addresses in all tables.
     int size()
     {
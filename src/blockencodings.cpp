@@ -0,0 +1,158 @@
+// Copyright (c) 2016 The BiosCrypto developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "txmempool.h"
+
+#include <limits>
+
+using namespace std;
+
+// No transaction serializes to fewer bytes than this
+static const unsigned int MIN_TRANSACTION_SIZE = 60;
+// Position of a short id matched by more than one transaction
+static const unsigned int COLLIDED = (unsigned int)-1;
+
+CCompactBlock::CCompactBlock(const CBlock& block)
+{
+    header.nVersion = block.nVersion;
+    header.hashPrevBlock = block.hashPrevBlock;
+    header.hashMerkleRoot = block.hashMerkleRoot;
+    header.nTime = block.nTime;
+    header.nBits = block.nBits;
+    header.nNonce = block.nNonce;
+    header.vchBlockSig = block.vchBlockSig;
+    nNonce = GetRand(std::numeric_limits<uint64_t>::max());
+
+    // The coinbase and coinstake are new to everyone
+    unsigned int nPrefill = block.IsProofOfStake() ? 2 : 1;
+    uint64_t k0, k1;
+    GetShortIdKey(k0, k1);
+    shortids.v.reserve(block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (i < nPrefill)
+            vPrefilled.push_back(CPrefilledTransaction(i, block.vtx[i]));
+        else
+            shortids.v.push_back(GetShortId(k0, k1, block.vtx[i].GetHash()));
+    }
+}
+
+void CCompactBlock::GetShortIdKey(uint64_t& k0, uint64_t& k1) const
+{
+    uint256 hashBlock = header.GetHash();
+    uint256 hash = Hash(BEGIN(hashBlock), END(hashBlock), BEGIN(nNonce), END(nNonce));
+    k0 = hash.GetLow64();
+    k1 = (hash >> 64).GetLow64();
+}
+
+CBlockTransactions::CBlockTransactions(const CBlock& block, const CBlockTransactionsRequest& req)
+{
+    hashBlock = req.hashBlock;
+    vtx.reserve(req.vIndexes.size());
+    BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+        vtx.push_back(block.vtx[nIndex]);
+}
+
+bool CPartialBlock::InitData(const CCompactBlock& cmpctblock, CTxMemPool& pool,
+                             const vector<boost::shared_ptr<const CTransaction> >& vExtra)
+{
+    unsigned int nTx = cmpctblock.GetTransactionCount();
+    if (nTx == 0 || nTx > MAX_BLOCK_SIZE / MIN_TRANSACTION_SIZE)
+        return error("CPartialBlock::InitData() : bad transaction count %u", nTx);
+
+    header = cmpctblock.header;
+    hashBlock = header.GetHash();
+    vtx.assign(nTx, CTransaction());
+    vHave.assign(nTx, false);
+
+    int nLastIndex = -1;
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilled)
+    {
+        if ((int)prefilled.nIndex <= nLastIndex || prefilled.nIndex >= nTx)
+            return error("CPartialBlock::InitData() : bad prefilled index %u", prefilled.nIndex);
+        vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+        nLastIndex = prefilled.nIndex;
+    }
+    nPrefilled = cmpctblock.vPrefilled.size();
+
+    // Short ids fill the remaining positions in order. An id seen twice
+    // can't be placed, both positions are left to "getblocktxn".
+    mapShortIds.clear();
+    mapShortIds.reserve(cmpctblock.shortids.v.size());
+    unsigned int nIndex = 0;
+    BOOST_FOREACH(uint64_t nShortId, cmpctblock.shortids.v)
+    {
+        while (vHave[nIndex])
+            nIndex++;
+        if (!mapShortIds.insert(make_pair(nShortId, nIndex)).second)
+            mapShortIds[nShortId] = COLLIDED;
+        nIndex++;
+    }
+
+    cmpctblock.GetShortIdKey(k0, k1);
+    nMissing = cmpctblock.shortids.v.size();
+
+    {
+        LOCK(pool.cs);
+        for (CTxMemPool::TxMap::const_iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end() && nMissing > 0; ++mi)
+            PlaceTransaction(mi->first, mi->second.GetTx(), nFromPool);
+    }
+    for (unsigned int i = 0; i < vExtra.size() && nMissing > 0; i++)
+        PlaceTransaction(vExtra[i]->GetHash(), *vExtra[i], nFromExtra);
+    mapShortIds.clear();
+
+    return true;
+}
+
+void CPartialBlock::PlaceTransaction(const uint256& hashTx, const CTransaction& tx, unsigned int& nCount)
+{
+    boost::unordered_map<uint64_t, unsigned int>::iterator mi = mapShortIds.find(CCompactBlock::GetShortId(k0, k1, hashTx));
+    if (mi == mapShortIds.end() || mi->second == COLLIDED)
+        return;
+    if (!vHave[mi->second])
+    {
+        vtx[mi->second] = tx;
+        vHave[mi->second] = true;
+        nCount++;
+        nMissing--;
+    }
+    else if (vtx[mi->second].GetHash() != hashTx)
+    {
+        // Two candidates for one short id, let the peer settle it
+        vHave[mi->second] = false;
+        nMissing++;
+        mi->second = COLLIDED;
+    }
+}
+
+void CPartialBlock::GetMissing(vector<unsigned int>& vIndexes) const
+{
+    vIndexes.clear();
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vIndexes.push_back(i);
+}
+
+bool CPartialBlock::FillBlock(CBlock& block, const vector<CTransaction>& vMissing) const
+{
+    block = header;
+    block.vtx = vtx;
+    unsigned int nNext = 0;
+    for (unsigned int i = 0; i < vHave.size(); i++)
+    {
+        if (vHave[i])
+            continue;
+        if (nNext >= vMissing.size())
+            return error("CPartialBlock::FillBlock() : too few transactions for %s", hashBlock.ToString());
+        block.vtx[i] = vMissing[nNext++];
+    }
+    if (nNext != vMissing.size())
+        return error("CPartialBlock::FillBlock() : too many transactions for %s", hashBlock.ToString());
+
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+        return error("CPartialBlock::FillBlock() : merkle root mismatch for %s", hashBlock.ToString());
+    return true;
+}
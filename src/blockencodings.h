@@ -0,0 +1,193 @@
+// Copyright (c) 2016 The BiosCrypto developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "main.h"
+
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+/** Version of the compact block encoding announced in "sendcmpct" */
+static const uint64_t COMPACT_BLOCK_ENCODING_VERSION = 1;
+/** Only blocks this close to the tip are served as compact blocks or by
+ *  "getblocktxn"; the requester is unlikely to have older transactions */
+static const int MAX_CMPCTBLOCK_DEPTH = 10;
+/** Seconds a peer has to answer "getblocktxn" before its block is fetched whole */
+static const int64_t CMPCTBLOCK_TIMEOUT = 10;
+
+/** A transaction sent whole inside a compact block, with its block position */
+class CPrefilledTransaction
+{
+public:
+    unsigned int nIndex;
+    CTransaction tx;
+
+    CPrefilledTransaction() : nIndex(0) { }
+    CPrefilledTransaction(unsigned int nIndexIn, const CTransaction& txIn) : nIndex(nIndexIn), tx(txIn) { }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(VARINT(nIndex));
+        READWRITE(tx);
+    )
+};
+
+/** List of 48-bit short transaction ids, serialized as 6 bytes each */
+class CShortTxIds
+{
+public:
+    std::vector<uint64_t> v;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return GetSizeOfCompactSize(v.size()) + 6 * v.size();
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WriteCompactSize(s, v.size());
+        BOOST_FOREACH(uint64_t nShortId, v)
+        {
+            uint32_t nLow = (uint32_t)nShortId;
+            uint16_t nHigh = (uint16_t)(nShortId >> 32);
+            ::Serialize(s, nLow, nType, nVersion);
+            ::Serialize(s, nHigh, nType, nVersion);
+        }
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned int nSize = ReadCompactSize(s);
+        v.clear();
+        v.reserve(std::min(nSize, 100000U));
+        for (unsigned int i = 0; i < nSize; i++)
+        {
+            uint32_t nLow;
+            uint16_t nHigh;
+            ::Unserialize(s, nLow, nType, nVersion);
+            ::Unserialize(s, nHigh, nType, nVersion);
+            v.push_back(((uint64_t)nHigh << 32) | nLow);
+        }
+    }
+};
+
+/**
+ * "cmpctblock" message: a block as its header and signature, the
+ * transactions the receiver cannot have (coinbase and coinstake) and a
+ * short id for every other transaction. The receiver rebuilds the block
+ * from its memory pool and asks for whatever is left with "getblocktxn".
+ *
+ * Short ids are SipHash-2-4 of the txid keyed from the header and a random
+ * nonce, truncated to 48 bits, so they collide differently for every block
+ * and every sender.
+ */
+class CCompactBlock
+{
+public:
+    CBlock header; // vtx is empty
+    uint64_t nNonce;
+    CShortTxIds shortids;
+    std::vector<CPrefilledTransaction> vPrefilled;
+
+    CCompactBlock() : nNonce(0) { }
+    explicit CCompactBlock(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header.nVersion);
+        READWRITE(header.hashPrevBlock);
+        READWRITE(header.hashMerkleRoot);
+        READWRITE(header.nTime);
+        READWRITE(header.nBits);
+        READWRITE(header.nNonce);
+        READWRITE(header.vchBlockSig);
+        READWRITE(nNonce);
+        READWRITE(shortids);
+        READWRITE(vPrefilled);
+    )
+
+    uint256 GetBlockHash() const { return header.GetHash(); }
+    unsigned int GetTransactionCount() const { return shortids.v.size() + vPrefilled.size(); }
+
+    /** SipHash key of this block's short ids */
+    void GetShortIdKey(uint64_t& k0, uint64_t& k1) const;
+    static uint64_t GetShortId(uint64_t k0, uint64_t k1, const uint256& txid)
+    {
+        return SipHashUint256(k0, k1, txid) & 0xffffffffffffULL;
+    }
+};
+
+/** "getblocktxn" message: positions of the transactions a compact block
+ *  receiver is missing */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 hashBlock;
+    std::vector<unsigned int> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vIndexes);
+    )
+};
+
+/** "blocktxn" message: the transactions asked for by "getblocktxn", in order */
+class CBlockTransactions
+{
+public:
+    uint256 hashBlock;
+    std::vector<CTransaction> vtx;
+
+    CBlockTransactions() { }
+    CBlockTransactions(const CBlock& block, const CBlockTransactionsRequest& req);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vtx);
+    )
+};
+
+/** A block being rebuilt from a compact block */
+class CPartialBlock
+{
+private:
+    CBlock header;
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vHave;
+
+    // Used while InitData matches transactions
+    boost::unordered_map<uint64_t, unsigned int> mapShortIds;
+    uint64_t k0, k1;
+    unsigned int nMissing;
+
+    void PlaceTransaction(const uint256& hashTx, const CTransaction& tx, unsigned int& nCount);
+
+public:
+    uint256 hashBlock;
+    unsigned int nPrefilled;
+    unsigned int nFromPool;
+    unsigned int nFromExtra;
+    int64_t nTimeStart; // microseconds, for the reconstruction log
+
+    CPartialBlock() : k0(0), k1(0), nMissing(0), nPrefilled(0), nFromPool(0), nFromExtra(0), nTimeStart(0) { }
+
+    /** Place the prefilled transactions and those of pool and vExtra whose
+     *  short id matches. Returns false if cmpctblock is malformed. */
+    bool InitData(const CCompactBlock& cmpctblock, CTxMemPool& pool,
+                  const std::vector<boost::shared_ptr<const CTransaction> >& vExtra);
+    bool IsTxAvailable(unsigned int nIndex) const { return nIndex < vHave.size() && vHave[nIndex]; }
+    void GetMissing(std::vector<unsigned int>& vIndexes) const;
+    /** Complete the block with vMissing, the transactions GetMissing listed.
+     *  Returns false if they don't fit, or if a short id matched the wrong
+     *  transaction and the merkle root disagrees. */
+    bool FillBlock(CBlock& block, const std::vector<CTransaction>& vMissing) const;
+};
+
+#endif
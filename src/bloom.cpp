@@ -0,0 +1,102 @@
+// Copyright (c) 2016 The BiosCrypto developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bloom.h"
+
+#include "netbase.h"
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+#include <openssl/rand.h>
+
+using namespace std;
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double nFPRate)
+{
+    // The optimal number of hash functions for nFPRate, and the cells that
+    // give that rate with the three generations the filter may hold
+    double dLogFPRate = log(nFPRate);
+    nHashFuncs = max(1, min((int)(dLogFPRate / log(0.5) + 0.5), 50));
+    nEntriesPerGeneration = max(1U, (nElements + 1) / 2);
+    unsigned int nMaxElements = nEntriesPerGeneration * 3;
+    unsigned int nFilterBits = (unsigned int)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(dLogFPRate / nHashFuncs)));
+    vData.resize(((nFilterBits + 63) / 64) * 2);
+    reset();
+}
+
+uint256 CRollingBloomFilter::ServiceKey(const CService& addr)
+{
+    // Address and port fit in a uint256 as they are
+    vector<unsigned char> vch = addr.GetKey();
+    uint256 key = 0;
+    memcpy(key.begin(), &vch[0], min(vch.size(), (size_t)key.size()));
+    return key;
+}
+
+void CRollingBloomFilter::GetPosition(uint64_t nHash, int n, unsigned int& nPos, int& nBit) const
+{
+    // Derive the n-th hash function from two halves of one SipHash
+    uint32_t h = (uint32_t)nHash + n * (uint32_t)(nHash >> 32);
+    nBit = h & 63;
+    // Map h onto the word pairs, then to the first of its pair
+    nPos = (unsigned int)(((uint64_t)h * vData.size()) >> 32) & ~1U;
+}
+
+void CRollingBloomFilter::insert(const uint256& hash, uint32_t nExtra)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration)
+    {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+        // Clear the cells last set by the generation that number now goes to
+        uint64_t nMask1 = 0 - (uint64_t)(nGeneration & 1);
+        uint64_t nMask2 = 0 - (uint64_t)(nGeneration >> 1);
+        for (unsigned int p = 0; p < vData.size(); p += 2)
+        {
+            uint64_t p1 = vData[p], p2 = vData[p + 1];
+            uint64_t nKeep = (p1 ^ nMask1) | (p2 ^ nMask2);
+            vData[p] = p1 & nKeep;
+            vData[p + 1] = p2 & nKeep;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    uint64_t nHash = SipHashUint256Extra(k0, k1, hash, nExtra);
+    for (int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int nPos;
+        int nBit;
+        GetPosition(nHash, n, nPos, nBit);
+        vData[nPos] = (vData[nPos] & ~((uint64_t)1 << nBit)) | ((uint64_t)(nGeneration & 1)) << nBit;
+        vData[nPos + 1] = (vData[nPos + 1] & ~((uint64_t)1 << nBit)) | ((uint64_t)(nGeneration >> 1)) << nBit;
+    }
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash, uint32_t nExtra) const
+{
+    uint64_t nHash = SipHashUint256Extra(k0, k1, hash, nExtra);
+    for (int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int nPos;
+        int nBit;
+        GetPosition(nHash, n, nPos, nBit);
+        // A cell of any generation counts; zero means never set or wiped
+        if (!(((vData[nPos] | vData[nPos + 1]) >> nBit) & 1))
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::reset()
+{
+    RAND_bytes((unsigned char*)&k0, sizeof(k0));
+    RAND_bytes((unsigned char*)&k1, sizeof(k1));
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    fill(vData.begin(), vData.end(), 0);
+}
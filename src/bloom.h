@@ -0,0 +1,57 @@
+// Copyright (c) 2016 The BiosCrypto developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOOM_H
+#define BITCOIN_BLOOM_H
+
+#include "protocol.h"
+#include "uint256.h"
+
+#include <vector>
+
+/**
+ * A set of the most recently inserted items in fixed memory, which may
+ * report items as present that never were (at about nFPRate) but never
+ * forgets any of the last nElements.
+ *
+ * Items are inserted in generations of nElements / 2. Every filter cell
+ * holds two bits naming the generation (1, 2 or 3) that last set it, so
+ * starting a new generation wipes the cells of the one before the last,
+ * instead of keeping the items to take them out one by one as mruset does.
+ * Keys are hashed with SipHash under a key of the filter's own, so other
+ * peers can't pick items that collide in it.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const uint256& hash, uint32_t nExtra = 0);
+    bool contains(const uint256& hash, uint32_t nExtra = 0) const;
+
+    void insert(const CInv& inv) { insert(inv.hash, inv.type); }
+    bool contains(const CInv& inv) const { return contains(inv.hash, inv.type); }
+
+    void insert(const CService& addr) { insert(ServiceKey(addr)); }
+    bool contains(const CService& addr) const { return contains(ServiceKey(addr)); }
+
+    /** Forget everything, and change the hash key */
+    void reset();
+
+    /** Bytes of filter data, which don't change with use */
+    size_t GetMemoryUsage() const { return vData.size() * sizeof(uint64_t); }
+
+private:
+    unsigned int nEntriesPerGeneration;
+    unsigned int nEntriesThisGeneration;
+    int nGeneration;
+    int nHashFuncs;
+    uint64_t k0, k1;
+    // Pairs of words: bit n of each holds one bit of a cell's generation
+    std::vector<uint64_t> vData;
+
+    static uint256 ServiceKey(const CService& addr);
+    void GetPosition(uint64_t nHash, int n, unsigned int& nPos, int& nBit) const;
+};
+
+#endif // BITCOIN_BLOOM_H
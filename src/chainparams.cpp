@@ -90,6 +90,7 @@ public:
         nTargetTimespan = 10 * nTargetSpacing;
         nLastPoWBlock = 3100;
         nStartPoSBlock = 2800;
+        nHistoricalBlockAge = 7 * 24 * 60 * 60;
     }
 
     virtual const CBlock& GenesisBlock() const { return genesis; }
@@ -171,6 +172,8 @@ public:
         hashGenesisBlock = genesis.GetHash();
         nDefaultPort = 26244;
         strDataDir = "regtest";
+        // A freshly mined chain has history to serve right away
+        nHistoricalBlockAge = 60;
 
         assert(hashGenesisBlock == uint256("0x2fec6cc4a488fdcd250657555c69634070989874de455aa0ceeebc2494a49860"));
 
@@ -72,6 +72,10 @@ public:
     int64_t TargetTimespan() const { return nTargetTimespan; }
     int LastPoWBlock() const { return nLastPoWBlock; }
     int StartPoSBlock() const { return nStartPoSBlock; }
+    /** Blocks more than this many seconds older than the best block are
+     *  served after all other traffic to a peer, and within
+     *  -maxuploadtarget's share for historical blocks */
+    int64_t HistoricalBlockAge() const { return nHistoricalBlockAge; }
 protected:
     CChainParams() {};
 
@@ -91,6 +95,7 @@ protected:
     int64_t nTargetTimespan;
     int nLastPoWBlock;
     int nStartPoSBlock;
+    int64_t nHistoricalBlockAge;
 };
 
 /**
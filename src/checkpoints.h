@@ -5,6 +5,7 @@
 #define  BITCOIN_CHECKPOINT_H
 
 #include <map>
+#include <boost/unordered_map.hpp>
 #include "net.h"
 #include "util.h"
 
@@ -41,7 +42,7 @@ namespace Checkpoints
     int GetTotalBlocksEstimate();
 
     // Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex);
+    CBlockIndex* GetLastCheckpoint(const boost::unordered_map<uint256, CBlockIndex*, SaltedUint256Hasher>& mapBlockIndex);
 
     extern uint256 hashSyncCheckpoint;
     extern CSyncCheckpoint checkpointMessage;
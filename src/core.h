@@ -48,15 +48,30 @@ public:
     }
 };
 
+/** Hasher for hash tables keyed by COutPoint, see SaltedUint256Hasher */
+class SaltedOutpointHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    SaltedOutpointHasher() { GetSaltedHashKey(k0, k1); }
+
+    size_t operator()(const COutPoint& outpoint) const
+    {
+        return SipHashUint256Extra(k0, k1, outpoint.hash, outpoint.n);
+    }
+};
+
 /** An inpoint - a combination of a transaction and an index n into its vin */
 class CInPoint
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
     unsigned int n;
 
     CInPoint() { SetNull(); }
-    CInPoint(CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
+    CInPoint(const CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
     void SetNull() { ptx = NULL; n = (unsigned int) -1; }
     bool IsNull() const { return (ptx == NULL && n == (unsigned int) -1); }
 };
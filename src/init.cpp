@@ -7,6 +7,8 @@
 #include "main.h"
 #include "chainparams.h"
 #include "txdb.h"
+#include "txmempool.h"
+#include "txverify.h"
 #include "rpcserver.h"
 #include "net.h"
 #include "util.h"
@@ -78,7 +80,12 @@ volatile bool fRequestShutdown = false;
 
 void StartShutdown()
 {
-    fRequestShutdown = true;
+    {
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        fRequestShutdown = true;
+    }
+    // Release getblocktemplate long polls
+    cvBlockChange.notify_all();
 }
 bool ShutdownRequested()
 {
@@ -94,6 +101,8 @@ void Shutdown()
 
     RenameThread("bioscrypto-shutoff");
     mempool.AddTransactionsUpdated(1);
+    // The signal handlers set fRequestShutdown without waking long polls
+    StartShutdown();
     StopRPCThreads();
 #ifdef ENABLE_WALLET
     ShutdownRPCMining();
@@ -101,12 +110,16 @@ void Shutdown()
         bitdb.Flush(false);
 #endif
     StopNode();
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        DumpMempool();
     {
         LOCK(cs_main);
 #ifdef ENABLE_WALLET
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
 #endif
+        if (pindexBest && GetBoolArg("-blockindexsnapshot", true))
+            CTxDB("r").WriteBlockIndexSnapshot();
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -169,6 +182,12 @@ std::string HelpMessage()
     strUsage += "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n";
     strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n";
     strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
+    strUsage += "  -dbwritebuffer=<n>     " + _("Set transaction index write buffer size in megabytes (default: 4)") + "\n";
+    strUsage += "  -dbmaxopenfiles=<n>    " + _("Keep at most <n> transaction index files open (default: 1000)") + "\n";
+    strUsage += "  -dbblocksize=<n>       " + _("Set transaction index block size in kilobytes (default: 4)") + "\n";
+    strUsage += "  -dbcompression         " + _("Compress transaction index blocks (default: 1)") + "\n";
+    strUsage += "  -dbbloombits=<n>       " + _("Bloom filter bits per key for the transaction index, 0 to disable (default: 10)") + "\n";
+    strUsage += "  -dbtrace=<file>        " + _("Record transaction index key accesses to <file> for benchmarking") + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through SOCKS5 proxy") + "\n";
     strUsage += "  -tor=<ip:port>         " + _("Use proxy to reach tor hidden services (default: same as -proxy)") + "\n";
@@ -191,6 +210,10 @@ std::string HelpMessage()
     strUsage += "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n";
+    strUsage += "  -maxuploadtarget=<n>   " + _("Try to keep outbound traffic under the given target, in MiB per 24h; historical blocks stop being served first (default: 0 = no limit)") + "\n";
+    strUsage += "  -compactblocks         " + _("Relay blocks as short transaction ids to peers that support it (default: 1)") + "\n";
+    strUsage += "  -headersfirst          " + _("Download block headers first and fetch blocks from several peers at once (default: 1)") + "\n";
+    strUsage += "  -msghandlerthreads=<n> " + _("Number of threads handling peer messages, each peer always on the same one (default: 1, max: 16)") + "\n";
 #ifdef USE_UPNP
 #if USE_UPNP
     strUsage += "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n";
@@ -211,7 +234,7 @@ std::string HelpMessage()
     strUsage +=                               _("If <category> is not supplied, output all debugging information.") + "\n";
     strUsage +=                               _("<category> can be:");
     strUsage +=                                 " addrman, alert, db, lock, rand, rpc, selectcoins, mempool, net,"; // Don't translate these and qt below
-    strUsage +=                                 " coinage, coinstake, creation, stakemodifier";
+    strUsage +=                                 " coinage, coinstake, creation, stakemodifier, cmpctblock";
     if (fHaveGUI)
     {
         strUsage += ", qt.\n";
@@ -246,8 +269,18 @@ std::string HelpMessage()
     strUsage += "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n";
     strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 500, 0 = all)") + "\n";
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
+    strUsage += "  -checkthreads=<n>      " + _("Number of threads used to verify blocks at startup (default: number of cores)") + "\n";
+    strUsage += "  -checkblocksbackground " + _("Verify blocks in the background once the node has started (default: 0)") + "\n";
+    strUsage += "  -blockindexsnapshot    " + _("Write the block index to blkindex.dat on shutdown for faster startup (default: 1)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
     strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -maxorphantx=<n>       " + strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS) + "\n";
+    strUsage += "  -maxorphantxsize=<n>   " + strprintf(_("Keep at most <n> kilobytes of unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TX_SIZE) + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+    strUsage += "  -mempoolexpiry=<n>     " + strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY) + "\n";
+    strUsage += "  -persistmempool        " + strprintf(_("Save the mempool on shutdown and load it on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL) + "\n";
+    strUsage += "  -mempoolsaveinterval=<n> " + _("Also save the mempool every <n> minutes (default: 0)") + "\n";
+    strUsage += "  -txverifythreads=<n>   " + _("Number of threads used to verify relayed transactions, 0 = in the message handler (default: number of cores)") + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
     strUsage += "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n";
@@ -331,6 +364,8 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     nNodeLifespan = GetArg("-addrlifespan", 7);
     fUseFastIndex = GetBoolArg("-fastindex", true);
+    fHeadersFirst = GetBoolArg("-headersfirst", true);
+    CNode::SetMaxOutboundTarget(GetArg("-maxuploadtarget", 0) * 1024 * 1024);
     nMinerSleep = GetArg("-minersleep", 500);
 
     CheckpointsMode = Checkpoints::STRICT;
@@ -680,7 +715,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -838,7 +873,23 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("mapAddressBook.size() = %u\n",  pwalletMain ? pwalletMain->mapAddressBook.size() : 0);
 #endif
 
+    int nTxVerifyThreads = GetArg("-txverifythreads", boost::thread::hardware_concurrency());
+    txVerifyQueue.Start(threadGroup, std::max(0, std::min(nTxVerifyThreads, MAX_TX_VERIFY_THREADS)));
+
     StartNode(threadGroup);
+
+    if (GetBoolArg("-checkblocksbackground", false))
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "verify", &ThreadVerifyBlockIndex));
+
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+    {
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "loadmempool", &ThreadLoadMempool));
+
+        int64_t nSaveInterval = GetArg("-mempoolsaveinterval", 0);
+        if (nSaveInterval > 0)
+            threadGroup.create_thread(boost::bind(&LoopForever<boost::function<void()> >, "dumpmempool",
+                                                  boost::function<void()>(&DumpMempool), nSaveInterval * 60 * 1000));
+    }
 #ifdef ENABLE_WALLET
     // InitRPCMining is needed here so getwork/getblocktemplate in the GUI debug console works properly.
     InitRPCMining();
@@ -4,10 +4,12 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/atomic.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
 #include "alert.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "db.h"
@@ -16,6 +18,7 @@
 #include "net.h"
 #include "txdb.h"
 #include "txmempool.h"
+#include "txverify.h"
 #include "ui_interface.h"
 
 using namespace std;
@@ -36,8 +39,15 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
-set<pair<COutPoint, unsigned int> > setStakeSeen;
+// What getblocktemplate long polls wait for, guarded by csBestBlock;
+// cvBlockChange is notified whenever it changes, so they need not poll
+CWaitableCriticalSection csBestBlock;
+CConditionVariable cvBlockChange;
+uint256 hashBestBlockNotified = 0;
+unsigned int nTxUpdatesNotified = 0;
+
+BlockMap mapBlockIndex;
+StakeSet setStakeSeen;
 
 unsigned int nStakeMinAge = 8 * 60 * 60; // 8 hours
 unsigned int nModifierInterval = 10 * 60; // time to elapse before new modifier is computed
@@ -51,10 +61,12 @@ uint256 nBestInvalidTrust = 0;
 
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CChain chainActive;
 int64_t nTimeBestReceived = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fHaveGUI = false;
+bool fHeadersFirst = true;
 
 struct COrphanBlock {
     uint256 hashBlock;
@@ -62,12 +74,85 @@ struct COrphanBlock {
     std::pair<COutPoint, unsigned int> stake;
     vector<unsigned char> vchBlock;
 };
-map<uint256, COrphanBlock*> mapOrphanBlocks;
+boost::unordered_map<uint256, COrphanBlock*, SaltedUint256Hasher> mapOrphanBlocks;
 multimap<uint256, COrphanBlock*> mapOrphanBlocksByPrev;
-set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
+StakeSet setStakeSeenOrphan;
+
+// Headers-first sync: headers of blocks we don't have yet. An entry is
+// dropped once its block is added to mapBlockIndex.
+struct CHeaderEntry {
+    uint256 hashPrev;
+    int nHeight;
+    uint256 nChainTrust;
+    unsigned int nBits;
+    unsigned int nTime;
+    bool fProofOfStake;
+    NodeId nodeFrom; // peer it came from first
+};
+boost::unordered_map<uint256, CHeaderEntry, SaltedUint256Hasher> mapHeaderIndex;
+uint256 hashBestHeader = 0;
+int nBestHeaderHeight = -1;
+uint256 nBestHeaderTrust = 0;
+// The best header chain past our last block, vHeaderChain[0] at nHeaderChainStart
+deque<uint256> vHeaderChain;
+int nHeaderChainStart = 0;
+
+struct CBlockInFlight {
+    NodeId node;
+    int64_t nTime; // microseconds, when requested
+};
+boost::unordered_map<uint256, CBlockInFlight, SaltedUint256Hasher> mapBlocksInFlight;
+
+// How a peer's block downloads went, to give the faster peers more of the window
+struct CPeerBlockDownload {
+    int nInFlight;
+    int nMaxInFlight;
+    int64_t nBlocksReceived;
+    int64_t nAvgLatency; // microseconds from request to block, moving average
+    int nStalls;
+    uint256 hashLastHeader; // last header the peer sent, it has the blocks up to it
+
+    CPeerBlockDownload() : nInFlight(0), nMaxInFlight(MAX_BLOCKS_IN_FLIGHT_PER_PEER / 2),
+                           nBlocksReceived(0), nAvgLatency(0), nStalls(0), hashLastHeader(0) { }
+};
+map<NodeId, CPeerBlockDownload> mapPeerBlockDownload;
+
+// Time message handlers waited for cs_main, by command
+map<string, CMainLockWaitStats> mapMainLockWait;
+CCriticalSection cs_mapMainLockWait;
+
+void static RecordMainLockWait(const string& strCommand, int64_t nWaitMicros)
+{
+    LOCK(cs_mapMainLockWait);
+    CMainLockWaitStats& stats = mapMainLockWait[strCommand];
+    stats.nCount++;
+    stats.nWaitMicros += nWaitMicros;
+    stats.nMaxWaitMicros = max(stats.nMaxWaitMicros, nWaitMicros);
+}
+
+void GetMainLockWaitStats(map<string, CMainLockWaitStats>& mapStats)
+{
+    LOCK(cs_mapMainLockWait);
+    mapStats = mapMainLockWait;
+}
 
-map<uint256, CTransaction> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+// LOCK(cs_main) in a message handler, counting the wait under strCommand
+#define LOCK_MAIN_FOR(strCommand) \
+    int64_t nMainLockWaitStart = GetTimeMicros(); \
+    LOCK(cs_main); \
+    RecordMainLockWait(strCommand, GetTimeMicros() - nMainLockWaitStart)
+
+struct COrphanTx {
+    boost::shared_ptr<const CTransaction> ptx;
+    NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
+};
+boost::unordered_map<uint256, COrphanTx, SaltedUint256Hasher> mapOrphanTransactions;
+boost::unordered_map<COutPoint, set<uint256>, SaltedOutpointHasher> mapOrphanTransactionsByPrev;
+map<NodeId, set<pair<int64_t, uint256> > > mapOrphanTransactionsByPeer; // oldest first
+uint64_t nOrphanTxSize = 0; // sum of orphans' serialized sizes
+int64_t nNextOrphanSweep = 0;
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -141,16 +226,51 @@ void ResendWalletTransactions(bool fForce) {
 // Registration of network node signals.
 //
 
+void static EraseOrphansFor(NodeId peer);
+
+// Forget the blocks a disconnected peer was asked for, so others are asked,
+// and the orphans it sent, which no one else will resolve for it
+void static FinalizeNode(NodeId nodeid)
+{
+    LOCK(cs_main);
+    EraseOrphansFor(nodeid);
+    boost::unordered_map<uint256, CBlockInFlight, SaltedUint256Hasher>::iterator it = mapBlocksInFlight.begin();
+    while (it != mapBlocksInFlight.end())
+    {
+        if (it->second.node == nodeid)
+            mapBlocksInFlight.erase(it++);
+        else
+            ++it;
+    }
+    mapPeerBlockDownload.erase(nodeid);
+}
+
+bool GetBlockDownloadStats(NodeId nodeid, CBlockDownloadStats& stats)
+{
+    LOCK(cs_main);
+    map<NodeId, CPeerBlockDownload>::const_iterator mi = mapPeerBlockDownload.find(nodeid);
+    if (mi == mapPeerBlockDownload.end())
+        return false;
+    stats.nBlocksInFlight = mi->second.nInFlight;
+    stats.nMaxBlocksInFlight = mi->second.nMaxInFlight;
+    stats.nBlocksReceived = mi->second.nBlocksReceived;
+    stats.nAvgLatency = mi->second.nAvgLatency;
+    stats.nStalls = mi->second.nStalls;
+    return true;
+}
+
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
     nodeSignals.SendMessages.connect(&SendMessages);
+    nodeSignals.FinalizeNode.connect(&FinalizeNode);
 }
 
 void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.ProcessMessages.disconnect(&ProcessMessages);
     nodeSignals.SendMessages.disconnect(&SendMessages);
+    nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
 }
 
 
@@ -160,7 +280,7 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx)
+bool AddOrphanTx(const CTransaction& tx, NodeId peer)
 {
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
@@ -171,8 +291,7 @@ bool AddOrphanTx(const CTransaction& tx)
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
+    // The pool as a whole is bounded by -maxorphantx and -maxorphantxsize.
 
     size_t nSize = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
 
@@ -182,48 +301,175 @@ bool AddOrphanTx(const CTransaction& tx)
         return false;
     }
 
-    mapOrphanTransactions[hash] = tx;
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.ptx.reset(new CTransaction(tx));
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nTxSize = nSize;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
+    mapOrphanTransactionsByPeer[peer].insert(make_pair(orphan.nTimeExpire, hash));
+    nOrphanTxSize += nSize;
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u)\n", hash.ToString(),
-        mapOrphanTransactions.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u, %u bytes)\n", hash.ToString(),
+        mapOrphanTransactions.size(), nOrphanTxSize);
     return true;
 }
 
 void static EraseOrphanTx(uint256 hash)
 {
-    map<uint256, CTransaction>::iterator it = mapOrphanTransactions.find(hash);
+    boost::unordered_map<uint256, COrphanTx, SaltedUint256Hasher>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
         return;
-    BOOST_FOREACH(const CTxIn& txin, it->second.vin)
+    BOOST_FOREACH(const CTxIn& txin, it->second.ptx->vin)
     {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+        boost::unordered_map<COutPoint, set<uint256>, SaltedOutpointHasher>::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
         itPrev->second.erase(hash);
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    map<NodeId, set<pair<int64_t, uint256> > >::iterator itPeer = mapOrphanTransactionsByPeer.find(it->second.fromPeer);
+    if (itPeer != mapOrphanTransactionsByPeer.end())
+    {
+        itPeer->second.erase(make_pair(it->second.nTimeExpire, hash));
+        if (itPeer->second.empty())
+            mapOrphanTransactionsByPeer.erase(itPeer);
+    }
+    nOrphanTxSize -= it->second.nTxSize;
     mapOrphanTransactions.erase(it);
 }
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+void static EraseOrphansFor(NodeId peer)
+{
+    map<NodeId, set<pair<int64_t, uint256> > >::iterator itPeer = mapOrphanTransactionsByPeer.find(peer);
+    if (itPeer == mapOrphanTransactionsByPeer.end())
+        return;
+    // EraseOrphanTx drops the peer's entry along with its last orphan
+    vector<uint256> vErase;
+    for (set<pair<int64_t, uint256> >::iterator mi = itPeer->second.begin(); mi != itPeer->second.end(); ++mi)
+        vErase.push_back(mi->second);
+    BOOST_FOREACH(const uint256& hash, vErase)
+        EraseOrphanTx(hash);
+    LogPrint("mempool", "Erased %u orphan tx from peer %d\n", vErase.size(), peer);
+}
+
+// Orphans are offered to compact block reconstruction as well: a block may
+// well include a transaction whose parent we saw only in the same block
+void static GetOrphanTransactions(vector<boost::shared_ptr<const CTransaction> >& vtx)
+{
+    vtx.reserve(mapOrphanTransactions.size());
+    for (boost::unordered_map<uint256, COrphanTx, SaltedUint256Hasher>::const_iterator it = mapOrphanTransactions.begin(); it != mapOrphanTransactions.end(); ++it)
+        vtx.push_back(it->second.ptx);
+}
+
+// Drops expired orphans, then trims any peer holding more than a quarter of
+// the budget and finally evicts from the largest holders until the pool fits.
+// Flooding from one peer so only displaces that peer's own orphans.
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, uint64_t nMaxBytes)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+    int64_t nNow = GetTime();
+    if (nNextOrphanSweep <= nNow)
     {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, CTransaction>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+        unsigned int nExpired = 0;
+        vector<uint256> vExpired;
+        for (map<NodeId, set<pair<int64_t, uint256> > >::iterator it = mapOrphanTransactionsByPeer.begin(); it != mapOrphanTransactionsByPeer.end(); ++it)
+        {
+            for (set<pair<int64_t, uint256> >::iterator mi = it->second.begin(); mi != it->second.end() && mi->first <= nNow; ++mi)
+                vExpired.push_back(mi->second);
+        }
+        BOOST_FOREACH(const uint256& hash, vExpired)
+        {
+            EraseOrphanTx(hash);
+            ++nExpired;
+        }
+        nNextOrphanSweep = nNow + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nExpired > 0)
+            LogPrint("mempool", "Erased %u expired orphan tx\n", nExpired);
+    }
+
+    unsigned int nMaxPerPeer = std::max(1U, nMaxOrphans / 4);
+    vector<uint256> vOverQuota;
+    for (map<NodeId, set<pair<int64_t, uint256> > >::iterator it = mapOrphanTransactionsByPeer.begin(); it != mapOrphanTransactionsByPeer.end(); ++it)
+    {
+        unsigned int nExcess = it->second.size() > nMaxPerPeer ? it->second.size() - nMaxPerPeer : 0;
+        for (set<pair<int64_t, uint256> >::iterator mi = it->second.begin(); nExcess > 0; ++mi, --nExcess)
+            vOverQuota.push_back(mi->second);
+    }
+    BOOST_FOREACH(const uint256& hash, vOverQuota)
+    {
+        EraseOrphanTx(hash);
+        ++nEvicted;
+    }
+
+    while (!mapOrphanTransactions.empty() && (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTxSize > nMaxBytes))
+    {
+        // Evict the oldest orphan of the peer holding the most
+        map<NodeId, set<pair<int64_t, uint256> > >::iterator itLargest = mapOrphanTransactionsByPeer.begin();
+        for (map<NodeId, set<pair<int64_t, uint256> > >::iterator it = mapOrphanTransactionsByPeer.begin(); it != mapOrphanTransactionsByPeer.end(); ++it)
+            if (it->second.size() > itLargest->second.size())
+                itLargest = it;
+        EraseOrphanTx(itLargest->second.begin()->second);
         ++nEvicted;
     }
     return nEvicted;
 }
 
+// Queues the orphans that spend outputs of a transaction just accepted,
+// to be retried by ProcessOrphanWork
+void static QueueOrphanWork(CNode* pfrom, const CTransaction& tx, const uint256& hash)
+{
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        boost::unordered_map<COutPoint, set<uint256>, SaltedOutpointHasher>::const_iterator itByPrev = mapOrphanTransactionsByPrev.find(COutPoint(hash, i));
+        if (itByPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        BOOST_FOREACH(const uint256& orphanHash, itByPrev->second)
+            pfrom->setOrphanWork.insert(orphanHash);
+    }
+}
+
+// Retries queued orphans until one of them is either accepted or rejected,
+// so a chain of orphans released by one parent is worked through between
+// other messages instead of in one long critical section.
+// requires LOCK(cs_vRecvMsg)
+void static ProcessOrphanWork(CNode* pfrom)
+{
+    LOCK_MAIN_FOR("tx");
+
+    while (!pfrom->setOrphanWork.empty())
+    {
+        uint256 orphanHash = *pfrom->setOrphanWork.begin();
+        pfrom->setOrphanWork.erase(pfrom->setOrphanWork.begin());
+
+        boost::unordered_map<uint256, COrphanTx, SaltedUint256Hasher>::iterator it = mapOrphanTransactions.find(orphanHash);
+        if (it == mapOrphanTransactions.end())
+            continue;
+        boost::shared_ptr<const CTransaction> ptx = it->second.ptx;
+        const CTransaction& orphanTx = *ptx;
+
+        bool fMissingInputs2 = false;
+        if (AcceptToMemoryPool(mempool, orphanTx, true, &fMissingInputs2))
+        {
+            LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+            RelayTransaction(orphanTx, orphanHash);
+            QueueOrphanWork(pfrom, orphanTx, orphanHash);
+            EraseOrphanTx(orphanHash);
+            break;
+        }
+        else if (!fMissingInputs2)
+        {
+            // invalid or too-little-fee orphan
+            EraseOrphanTx(orphanHash);
+            LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+            break;
+        }
+        // Still missing other inputs: stays in the pool
+    }
+}
+
 
 
 
@@ -509,7 +755,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     vMerkleBranch = pblock->GetMerkleBranch(nIndex);
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -598,8 +844,8 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBlockSize, enum GetMinFe
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs)
+bool AcceptToMemoryPool(CTxMemPool& pool, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, int64_t nAcceptTime)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -641,6 +887,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
     }
     }
 
+    CTxMemPoolEntry entry;
     {
         CTxDB txdb("r");
 
@@ -649,7 +896,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
             return false;
 
         MapPrevTx mapInputs;
-        map<uint256, CTxIndex> mapUnused;
+        TxIndexMap mapUnused;
         bool fInvalid = false;
         if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
         {
@@ -686,6 +933,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
                          hash.ToString(),
                          nFees, txMinFee);
 
+        // Once the pool has had to evict, new transactions must pay at least
+        // the fee rate of what was evicted; the requirement decays over time
+        int64_t nMempoolMinFee = pool.GetRollingMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000) * nSize / 1000;
+        if (fLimitFree && nMempoolMinFee > 0 && nFees < nMempoolMinFee)
+            return error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                         hash.ToString(),
+                         nFees, nMempoolMinFee);
+
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make others' transactions take longer to confirm.
@@ -729,13 +984,48 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
         {
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
+
+        // Priority is sum(valuein * age) / txsize. It is computed once here
+        // and aged by the entry's height when a block template is built, so
+        // CreateNewBlock never has to read parent transactions from disk.
+        // Inputs spending memory pool transactions contribute no priority.
+        double dPriority = 0;
+        int64_t nValueInChain = 0;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            const CTxIndex& txindex = mapInputs[txin.prevout.hash].first;
+            if (txindex.pos.IsNull())
+                continue;
+            int64_t nValueIn = mapInputs[txin.prevout.hash].second.vout[txin.prevout.n].nValue;
+            nValueInChain += nValueIn;
+            dPriority += (double)nValueIn * txindex.GetDepthInMainChain();
+        }
+        dPriority /= nSize;
+
+        entry = CTxMemPoolEntry(tx, nFees, nSigOps, dPriority, nValueInChain, nAcceptTime ? nAcceptTime : GetTime(), chainActive.Height());
     }
 
     // Store transaction in memory
-    pool.addUnchecked(hash, tx);
+    pool.addUnchecked(hash, entry);
+
+    // Make room; this may evict the new transaction itself
+    LimitMempoolSize(pool);
+    if (!pool.exists(hash))
+    {
+        LogPrint("mempool", "AcceptToMemoryPool : mempool full, %s not kept\n", hash.ToString());
+        return false;
+    }
 
     SyncWithWallets(tx, NULL);
 
+    // Read before taking csBestBlock, which the miner takes inside mempool.cs
+    unsigned int nTransactionsUpdated = pool.GetTransactionsUpdated();
+    {
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        nTxUpdatesNotified = nTransactionsUpdated;
+    }
+    cvBlockChange.notify_all();
+
     LogPrint("mempool", "AcceptToMemoryPool : accepted %s (poolsz %u)\n",
            hash.ToString(),
            pool.mapTx.size());
@@ -745,6 +1035,135 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
 
 
 
+void LimitMempoolSize(CTxMemPool& pool)
+{
+    unsigned int nExpired = pool.Expire(GetTime() - GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+    if (nExpired != 0)
+        LogPrint("mempool", "Expired %u transactions from the memory pool\n", nExpired);
+
+    pool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+}
+
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+// Set once mempool.dat has been read back, so an interrupted load never
+// overwrites the file with a partial pool. Written by the loadmempool
+// thread, read by whichever thread dumps.
+static boost::atomic<bool> fMempoolLoaded(false);
+
+bool DumpMempool()
+{
+    if (!fMempoolLoaded)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+
+    // Parents first, so reloading never meets a child before its inputs
+    vector<pair<uint64_t, const CTxMemPoolEntry*> > vSorted;
+    vector<pair<CTransaction, int64_t> > vEntries;
+    {
+        LOCK(mempool.cs);
+        vSorted.reserve(mempool.mapTx.size());
+        for (CTxMemPool::TxMap::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            vSorted.push_back(make_pair(mi->second.GetCountWithAncestors(), &mi->second));
+        sort(vSorted.begin(), vSorted.end());
+        vEntries.reserve(vSorted.size());
+        for (unsigned int i = 0; i < vSorted.size(); i++)
+            vEntries.push_back(make_pair(vSorted[i].second->GetTx(), vSorted[i].second->GetTime()));
+    }
+
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpMempool() : open failed");
+
+    try {
+        fileout << MEMPOOL_DUMP_VERSION;
+        fileout << (uint64_t)vEntries.size();
+        for (unsigned int i = 0; i < vEntries.size(); i++)
+            fileout << vEntries[i].first << vEntries[i].second;
+    }
+    catch (std::exception &e) {
+        return error("DumpMempool() : I/O error: %s", e.what());
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, GetDataDir() / "mempool.dat"))
+        return error("DumpMempool() : Rename-into-place failed");
+
+    LogPrintf("Dumped %u mempool transactions to disk  %dms\n", vEntries.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+void ThreadLoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+    unsigned int nAccepted = 0, nFailed = 0, nExpired = 0;
+
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    FILE *file = fopen(pathMempool.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+    {
+        // Nothing saved yet; later dumps are fine
+        fMempoolLoaded = true;
+        return;
+    }
+
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    int64_t nNow = GetTime();
+    try {
+        uint64_t nVersion;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+        {
+            LogPrintf("ThreadLoadMempool() : unknown mempool.dat version %d, ignoring it\n", nVersion);
+            fMempoolLoaded = true;
+            return;
+        }
+
+        uint64_t nCount;
+        filein >> nCount;
+        while (nCount--)
+        {
+            boost::this_thread::interruption_point();
+
+            CTransaction tx;
+            int64_t nTime;
+            filein >> tx >> nTime;
+            if (nTime + nExpiryTimeout <= nNow)
+            {
+                nExpired++;
+                continue;
+            }
+
+            // Revalidated against the current tip like any relayed transaction
+            bool fAccepted;
+            {
+                LOCK(cs_main);
+                fAccepted = AcceptToMemoryPool(mempool, tx, true, NULL, nTime);
+            }
+            if (fAccepted)
+                nAccepted++;
+            else
+                nFailed++;
+        }
+    }
+    catch (boost::thread_interrupted)
+    {
+        throw;
+    }
+    catch (std::exception &e) {
+        LogPrintf("ThreadLoadMempool() : failed to deserialize mempool.dat: %s\n", e.what());
+    }
+
+    fMempoolLoaded = true;
+    LogPrintf("Loaded mempool.dat: %u accepted, %u rejected, %u expired  %dms\n",
+              nAccepted, nFailed, nExpired, GetTimeMillis() - nStart);
+}
+
 int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
 {
     if (hashBlock == 0 || nIndex == -1)
@@ -752,11 +1171,11 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
-    if (!pindex || !pindex->IsInMainChain())
+    if (!pindex || !chainActive.Contains(pindex))
         return 0;
 
     // Make sure the merkle branch connects to this block
@@ -768,7 +1187,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     }
 
     pindexRet = pindex;
-    return pindexBest->nHeight - pindex->nHeight + 1;
+    return chainActive.Height() - pindex->nHeight + 1;
 }
 
 int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
@@ -823,18 +1242,24 @@ bool CWalletTx::AcceptWalletTransaction()
 
 int CTxIndex::GetDepthInMainChain() const
 {
+    // Look the block up by its position first; reading its header from disk
+    // is only needed for blocks stored out of height order
+    CBlockIndex* pindexPos = chainActive.FindByDiskPos(pos.nFile, pos.nBlockPos);
+    if (pindexPos)
+        return 1 + chainActive.Height() - pindexPos->nHeight;
+
     // Read block header
     CBlock block;
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
-    if (!pindex || !pindex->IsInMainChain())
+    if (!pindex || !chainActive.Contains(pindex))
         return 0;
-    return 1 + nBestHeight - pindex->nHeight;
+    return 1 + chainActive.Height() - pindex->nHeight;
 }
 
 // Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
@@ -873,22 +1298,75 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
-CBlockIndex* FindBlockByHeight(int nHeight)
+void CChain::SetTip(CBlockIndex* pindex)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    if (pindex == NULL) {
+        vChain.clear();
+        return;
+    }
+    vChain.resize(pindex->nHeight + 1);
+    while (pindex && vChain[pindex->nHeight] != pindex) {
+        vChain[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
+}
+
+CBlockLocator CChain::GetLocator(const CBlockIndex* pindex) const
+{
+    int nStep = 1;
+    std::vector<uint256> vHave;
+    vHave.reserve(32);
+
+    if (!pindex)
+        pindex = Tip();
+    while (pindex) {
+        vHave.push_back(pindex->GetBlockHash());
+        // Stop when we have added the genesis block.
+        if (pindex->nHeight == 0)
+            break;
+        // Exponentially larger steps back, plus the genesis block.
+        int nHeight = std::max(pindex->nHeight - nStep, 0);
+        if (Contains(pindex)) {
+            // Use O(1) chain index if possible.
+            pindex = (*this)[nHeight];
+        } else {
+            // Otherwise, walk back to the requested height.
+            while (pindex->nHeight > nHeight)
+                pindex = pindex->pprev;
+        }
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+
+    return CBlockLocator(vHave);
+}
+
+CBlockIndex* CChain::FindFork(CBlockIndex* pindex) const
+{
+    if (pindex == NULL)
+        return NULL;
+    while (pindex->nHeight > Height())
+        pindex = pindex->pprev;
+    while (pindex && !Contains(pindex))
+        pindex = pindex->pprev;
+    return pindex;
+}
+
+CBlockIndex* CChain::FindByDiskPos(unsigned int nFile, unsigned int nBlockPos) const
+{
+    int nLow = 0, nHigh = Height();
+    while (nLow <= nHigh)
+    {
+        int nMid = (nLow + nHigh) / 2;
+        const CBlockIndex* pindex = vChain[nMid];
+        if (pindex->nFile == nFile && pindex->nBlockPos == nBlockPos)
+            return vChain[nMid];
+        if (pindex->nFile < nFile || (pindex->nFile == nFile && pindex->nBlockPos < nBlockPos))
+            nLow = nMid + 1;
+        else
+            nHigh = nMid - 1;
+    }
+    return NULL;
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -907,13 +1385,13 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
 
 uint256 static GetOrphanRoot(const uint256& hash)
 {
-    map<uint256, COrphanBlock*>::iterator it = mapOrphanBlocks.find(hash);
+    boost::unordered_map<uint256, COrphanBlock*, SaltedUint256Hasher>::iterator it = mapOrphanBlocks.find(hash);
     if (it == mapOrphanBlocks.end())
         return hash;
 
     // Work back to the first block in the orphan chain
     do {
-        map<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocks.find(it->second->hashPrev);
+        boost::unordered_map<uint256, COrphanBlock*, SaltedUint256Hasher>::iterator it2 = mapOrphanBlocks.find(it->second->hashPrev);
         if (it2 == mapOrphanBlocks.end())
             return it->first;
         it = it2;
@@ -988,28 +1466,18 @@ const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfSta
     return pindex;
 }
 
-unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake)
+// Retarget from the last block of a kind, nActualSpacing after the one before it
+unsigned int static GetNextTarget(unsigned int nBitsPrev, int64_t nActualSpacing, bool fProofOfStake)
 {
     CBigNum bnTargetLimit = fProofOfStake ? Params().ProofOfStakeLimit() : Params().ProofOfWorkLimit();
 
-    if (pindexLast == NULL)
-        return bnTargetLimit.GetCompact(); // genesis block
-
-    const CBlockIndex* pindexPrev = GetLastBlockIndex(pindexLast, fProofOfStake);
-    if (pindexPrev->pprev == NULL)
-        return bnTargetLimit.GetCompact(); // first block
-    const CBlockIndex* pindexPrevPrev = GetLastBlockIndex(pindexPrev->pprev, fProofOfStake);
-    if (pindexPrevPrev->pprev == NULL)
-        return bnTargetLimit.GetCompact(); // second block
-
-    int64_t nActualSpacing = pindexPrev->GetBlockTime() - pindexPrevPrev->GetBlockTime();
     if (nActualSpacing < 0)
         nActualSpacing = Params().TargetSpacing();
 
     // ppcoin: target change every block
     // ppcoin: retarget with exponential moving toward target spacing
     CBigNum bnNew;
-    bnNew.SetCompact(pindexPrev->nBits);
+    bnNew.SetCompact(nBitsPrev);
     int64_t nInterval = Params().TargetTimespan() / Params().TargetSpacing();
     bnNew *= ((nInterval - 1) * Params().TargetSpacing() + nActualSpacing + nActualSpacing);
     bnNew /= ((nInterval + 1) * Params().TargetSpacing());
@@ -1020,6 +1488,23 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
     return bnNew.GetCompact();
 }
 
+unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake)
+{
+    CBigNum bnTargetLimit = fProofOfStake ? Params().ProofOfStakeLimit() : Params().ProofOfWorkLimit();
+
+    if (pindexLast == NULL)
+        return bnTargetLimit.GetCompact(); // genesis block
+
+    const CBlockIndex* pindexPrev = GetLastBlockIndex(pindexLast, fProofOfStake);
+    if (pindexPrev->pprev == NULL)
+        return bnTargetLimit.GetCompact(); // first block
+    const CBlockIndex* pindexPrevPrev = GetLastBlockIndex(pindexPrev->pprev, fProofOfStake);
+    if (pindexPrevPrev->pprev == NULL)
+        return bnTargetLimit.GetCompact(); // second block
+
+    return GetNextTarget(pindexPrev->nBits, pindexPrev->GetBlockTime() - pindexPrevPrev->GetBlockTime(), fProofOfStake);
+}
+
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
     CBigNum bnTarget;
@@ -1126,8 +1611,8 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
 }
 
 
-bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTestPool,
-                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid)
+bool CTransaction::FetchInputs(CTxDB& txdb, const TxIndexMap& mapTestPool,
+                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid) const
 {
     // FetchInputs can return false either because we just haven't seen some inputs
     // (in which case the transaction should be stored as an orphan)
@@ -1224,8 +1709,8 @@ int64_t CTransaction::GetValueIn(const MapPrevTx& inputs) const
 
 }
 
-bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags)
+bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, TxIndexMap& mapTestPool, const CDiskTxPos& posThisTx,
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags) const
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1381,7 +1866,7 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
-    map<uint256, CTxIndex> mapQueuedChanges;
+    TxIndexMap mapQueuedChanges;
     int64_t nFees = 0;
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
@@ -1482,7 +1967,7 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         return true;
 
     // Write queued txindex changes
-    for (map<uint256, CTxIndex>::iterator mi = mapQueuedChanges.begin(); mi != mapQueuedChanges.end(); ++mi)
+    for (TxIndexMap::iterator mi = mapQueuedChanges.begin(); mi != mapQueuedChanges.end(); ++mi)
     {
         if (!txdb.UpdateTxIndex((*mi).first, (*mi).second))
             return error("ConnectBlock() : UpdateTxIndex failed");
@@ -1510,18 +1995,9 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     LogPrintf("REORGANIZE\n");
 
     // Find the fork
-    CBlockIndex* pfork = pindexBest;
-    CBlockIndex* plonger = pindexNew;
-    while (pfork != plonger)
-    {
-        while (plonger->nHeight > pfork->nHeight)
-            if (!(plonger = plonger->pprev))
-                return error("Reorganize() : plonger->pprev is null");
-        if (pfork == plonger)
-            break;
-        if (!(pfork = pfork->pprev))
-            return error("Reorganize() : pfork->pprev is null");
-    }
+    CBlockIndex* pfork = chainActive.FindFork(pindexNew);
+    if (!pfork)
+        return error("Reorganize() : no fork with the best chain");
 
     // List of what to disconnect
     vector<CBlockIndex*> vDisconnect;
@@ -1707,11 +2183,16 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    chainActive.SetTip(pindexNew);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
+    {
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        hashBestBlockNotified = hash;
+    }
+    cvBlockChange.notify_all();
 
     uint256 nBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->nChainTrust - pindexBest->pprev->nChainTrust) : pindexBest->nChainTrust;
 
@@ -1807,8 +2288,9 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
     if (!pindexNew)
         return error("AddToBlockIndex() : new CBlockIndex failed");
+    mapHeaderIndex.erase(hash);
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -1833,7 +2315,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
@@ -1957,7 +2439,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2044,10 +2526,31 @@ bool CBlock::AcceptBlock()
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (hashBestChain == hash)
     {
+        // Peers that asked for it get the block right away as a compact block
+        CInv inv(MSG_BLOCK, hash);
+        CSharedMessage msgCmpctBlock;
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
-            if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+        {
+            if (nBestHeight <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                continue;
+            if (!pnode->fAnnounceCompact)
+            {
+                pnode->PushInventory(inv);
+                continue;
+            }
+            {
+                LOCK(pnode->cs_inventory);
+                if (pnode->setInventoryKnown.contains(inv))
+                    continue;
+                pnode->setInventoryKnown.insert(inv);
+            }
+            if (!msgCmpctBlock)
+                msgCmpctBlock = MakeSharedMessage("cmpctblock", CCompactBlock(*this));
+            pnode->PushSharedMessage(msgCmpctBlock);
+        }
+        // Announce it now rather than on the next message handler round
+        RequestMessageHandlerRound();
     }
 
     // ppcoin: check pending sync-checkpoint
@@ -2087,66 +2590,442 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
     pnode->pindexLastGetBlocksBegin = pindexBegin;
     pnode->hashLastGetBlocksEnd = hashEnd;
 
-    pnode->PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
+    pnode->PushMessage("getblocks", chainActive.GetLocator(pindexBegin), hashEnd);
 }
 
-bool static ReserealizeBlockSignature(CBlock* pblock)
+void PushGetHeaders(CNode* pnode)
 {
-    if (pblock->IsProofOfWork()) {
-        pblock->vchBlockSig.clear();
-        return true;
-    }
-
-    return CKey::ReserealizeSignature(pblock->vchBlockSig);
+    // Start from the parent of the best header, so that a peer on the same
+    // branch sends at least the best header back and is known to have it
+    CBlockLocator locator = chainActive.GetLocator();
+    boost::unordered_map<uint256, CHeaderEntry, SaltedUint256Hasher>::const_iterator hi = mapHeaderIndex.find(hashBestHeader);
+    if (hi != mapHeaderIndex.end() && mapHeaderIndex.count(hi->second.hashPrev))
+        locator.PushFront(hi->second.hashPrev);
+    pnode->PushMessage("getheaders", locator, uint256(0));
 }
 
-bool static IsCanonicalBlockSignature(CBlock* pblock)
+// Rebuild vHeaderChain by walking back from the best header to a block we have
+void static UpdateHeaderChain()
 {
-    if (pblock->IsProofOfWork()) {
-        return pblock->vchBlockSig.empty();
+    vHeaderChain.clear();
+    uint256 hash = hashBestHeader;
+    boost::unordered_map<uint256, CHeaderEntry, SaltedUint256Hasher>::iterator mi;
+    while ((mi = mapHeaderIndex.find(hash)) != mapHeaderIndex.end())
+    {
+        vHeaderChain.push_front(hash);
+        nHeaderChainStart = mi->second.nHeight;
+        hash = mi->second.hashPrev;
     }
-
-    return IsDERSignature(pblock->vchBlockSig, false);
 }
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+// GetNextTargetRequired for a header whose parent may itself be a header
+// without its block yet: the header tree is walked back to a block we have
+unsigned int static GetNextHeaderTarget(uint256 hashPrev, bool fProofOfStake)
 {
-    AssertLockHeld(cs_main);
-
-    // Check for duplicate
-    uint256 hash = pblock->GetHash();
-    if (mapBlockIndex.count(hash))
-        return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString());
-    if (mapOrphanBlocks.count(hash))
-        return error("ProcessBlock() : already have block (orphan) %s", hash.ToString());
-
-    // ppcoin: check proof-of-stake
-    // Limited duplicity on stake: prevents block flood attack
-    // Duplicate stake allowed only when there is orphan child block
-    if (pblock->IsProofOfStake() && setStakeSeen.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
-        return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
+    // nBits and time of the last two ancestors of the kind still in the tree
+    vector<pair<unsigned int, int64_t> > vLast;
+    boost::unordered_map<uint256, CHeaderEntry, SaltedUint256Hasher>::const_iterator hi;
+    while (vLast.size() < 2 && (hi = mapHeaderIndex.find(hashPrev)) != mapHeaderIndex.end())
+    {
+        if (hi->second.fProofOfStake == fProofOfStake)
+            vLast.push_back(make_pair(hi->second.nBits, (int64_t)hi->second.nTime));
+        hashPrev = hi->second.hashPrev;
+    }
+    if (vLast.size() == 2)
+        return GetNextTarget(vLast[0].first, vLast[0].second - vLast[1].second, fProofOfStake);
+
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrev);
+    const CBlockIndex* pindex = mi == mapBlockIndex.end() ? NULL : mi->second;
+    if (vLast.empty())
+        return GetNextTargetRequired(pindex, fProofOfStake);
+
+    const CBlockIndex* pindexPrevPrev = GetLastBlockIndex(pindex, fProofOfStake);
+    if (pindexPrevPrev == NULL || pindexPrevPrev->pprev == NULL)
+        return (fProofOfStake ? Params().ProofOfStakeLimit() : Params().ProofOfWorkLimit()).GetCompact();
+    return GetNextTarget(vLast[0].first, vLast[0].second - pindexPrevPrev->GetBlockTime(), fProofOfStake);
+}
 
-    CBlockIndex* pcheckpoint = Checkpoints::GetLastSyncCheckpoint();
-    if (pcheckpoint && pblock->hashPrevBlock != hashBestChain && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+// Drop the headers that are not on the best header chain
+void static PruneHeaderIndex()
+{
+    set<uint256> setKeep(vHeaderChain.begin(), vHeaderChain.end());
+    unsigned int nPruned = 0;
+    boost::unordered_map<uint256, CHeaderEntry, SaltedUint256Hasher>::iterator it = mapHeaderIndex.begin();
+    while (it != mapHeaderIndex.end())
     {
-        // Extra checks to prevent "fill up memory by spamming with bogus blocks"
-        int64_t deltaTime = pblock->GetBlockTime() - pcheckpoint->nTime;
-        if (deltaTime < 0)
+        if (setKeep.count(it->first))
+            ++it;
+        else
         {
-            if (pfrom)
-                pfrom->Misbehaving(1);
-            return error("ProcessBlock() : block with timestamp before last checkpoint");
+            mapHeaderIndex.erase(it++);
+            nPruned++;
         }
     }
+    LogPrint("net", "PruneHeaderIndex() : dropped %u headers off the best header chain, %u left\n", nPruned, mapHeaderIndex.size());
+}
 
-    // Block signature can be malleated in such a way that it increases block size up to maximum allowed by protocol
-    // For now we just strip garbage from newly received blocks
-    if (!IsCanonicalBlockSignature(pblock)) {
-        if (!ReserealizeBlockSignature(pblock))
-            LogPrintf("WARNING: ProcessBlock() : ReserealizeBlockSignature FAILED\n");
+// Check a header as far as possible without its block and add it to
+// mapHeaderIndex. Headers don't say whether their block is proof-of-work
+// or proof-of-stake: one that meets the work target it must carry is taken
+// for proof-of-work, any other must carry the stake target, so no header
+// can choose its own trust. The stake itself can't be verified before the
+// coinstake arrives; a bogus stake branch is dropped by InvalidHeaderChain
+// once its block fails or isn't delivered.
+bool static AcceptBlockHeader(const CBlock& header, NodeId nodeFrom, int& nHeight)
+{
+    uint256 hash = header.GetHash();
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+    {
+        nHeight = mi->second->nHeight;
+        return true;
+    }
+    boost::unordered_map<uint256, CHeaderEntry, SaltedUint256Hasher>::iterator hi = mapHeaderIndex.find(hash);
+    if (hi != mapHeaderIndex.end())
+    {
+        nHeight = hi->second.nHeight;
+        return true;
+    }
+
+    CHeaderEntry entry;
+    entry.hashPrev = header.hashPrevBlock;
+    entry.nBits = header.nBits;
+    entry.nTime = header.nTime;
+    entry.nodeFrom = nodeFrom;
+    int64_t nTimePrev;
+    mi = mapBlockIndex.find(header.hashPrevBlock);
+    if (mi != mapBlockIndex.end())
+    {
+        entry.nHeight = mi->second->nHeight + 1;
+        entry.nChainTrust = mi->second->nChainTrust;
+        nTimePrev = mi->second->GetPastTimeLimit();
+    }
+    else if ((hi = mapHeaderIndex.find(header.hashPrevBlock)) != mapHeaderIndex.end())
+    {
+        entry.nHeight = hi->second.nHeight + 1;
+        entry.nChainTrust = hi->second.nChainTrust;
+        nTimePrev = hi->second.nTime;
+    }
+    else
+        return error("AcceptBlockHeader() : header %s does not connect", hash.ToString());
+
+    if (!header.vtx.empty())
+        return header.DoS(100, error("AcceptBlockHeader() : header %s carries transactions", hash.ToString()));
+
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+        return error("AcceptBlockHeader() : header %s timestamp too far in the future", hash.ToString());
+    if (header.GetBlockTime() <= nTimePrev)
+        return error("AcceptBlockHeader() : header %s timestamp too early", hash.ToString());
+
+    CBigNum bnTarget;
+    bnTarget.SetCompact(header.nBits);
+    bool fProofOfWork = entry.nHeight <= Params().LastPoWBlock() && bnTarget > 0 && hash <= bnTarget.getuint256() &&
+                        header.nBits == GetNextHeaderTarget(header.hashPrevBlock, false);
+    if (!fProofOfWork)
+    {
+        if (entry.nHeight < Params().StartPoSBlock())
+            return header.DoS(50, error("AcceptBlockHeader() : header %s proof-of-work failed", hash.ToString()));
+        if (header.nBits != GetNextHeaderTarget(header.hashPrevBlock, true))
+            return header.DoS(100, error("AcceptBlockHeader() : header %s has incorrect nBits", hash.ToString()));
+    }
+    entry.fProofOfStake = !fProofOfWork;
+
+    if (!Checkpoints::CheckHardened(entry.nHeight, hash))
+        return header.DoS(100, error("AcceptBlockHeader() : header %s rejected by checkpoint at height %d", hash.ToString(), entry.nHeight));
+
+    if (mapHeaderIndex.size() >= MAX_HEADER_INDEX_SIZE)
+    {
+        PruneHeaderIndex();
+        if (mapHeaderIndex.size() >= MAX_HEADER_INDEX_SIZE)
+            return error("AcceptBlockHeader() : header index full, ignoring header %s", hash.ToString());
+    }
+
+    // Same as CBlockIndex::GetBlockTrust
+    entry.nChainTrust += ((CBigNum(1) << 256) / (bnTarget + 1)).getuint256();
+    mapHeaderIndex[hash] = entry;
+    nHeight = entry.nHeight;
+
+    if (entry.nChainTrust > nBestHeaderTrust && entry.nChainTrust > nBestChainTrust)
+    {
+        bool fExtends = !vHeaderChain.empty() && header.hashPrevBlock == hashBestHeader;
+        hashBestHeader = hash;
+        nBestHeaderHeight = entry.nHeight;
+        nBestHeaderTrust = entry.nChainTrust;
+        if (fExtends)
+            vHeaderChain.push_back(hash);
+        else
+            UpdateHeaderChain();
+    }
+    return true;
+}
+
+// The block of a header failed, or the peer that sent the header didn't
+// deliver it: drop the header and every header built on it, charge that
+// peer nDoS, and ask the peers that are ahead of us for their headers again
+void static InvalidHeaderChain(const uint256& hash, int nDoS)
+{
+    boost::unordered_map<uint256, CHeaderEntry, SaltedUint256Hasher>::iterator hi = mapHeaderIndex.find(hash);
+    if (hi == mapHeaderIndex.end())
+        return;
+    NodeId nodeFrom = hi->second.nodeFrom;
+
+    multimap<uint256, uint256> mapNext;
+    for (hi = mapHeaderIndex.begin(); hi != mapHeaderIndex.end(); ++hi)
+        mapNext.insert(make_pair(hi->second.hashPrev, hi->first));
+    vector<uint256> vDrop(1, hash);
+    for (unsigned int i = 0; i < vDrop.size(); i++)
+    {
+        uint256 hashPrev = vDrop[i];
+        for (multimap<uint256, uint256>::iterator mi = mapNext.lower_bound(hashPrev); mi != mapNext.upper_bound(hashPrev); ++mi)
+            vDrop.push_back(mi->second);
+    }
+    BOOST_FOREACH(const uint256& hashDrop, vDrop)
+        mapHeaderIndex.erase(hashDrop);
+    LogPrintf("InvalidHeaderChain() : dropped %u headers from %s on, sent by peer=%d\n", vDrop.size(), hash.ToString(), nodeFrom);
+
+    if (!mapHeaderIndex.count(hashBestHeader))
+    {
+        hashBestHeader = 0;
+        nBestHeaderHeight = -1;
+        nBestHeaderTrust = 0;
+        for (hi = mapHeaderIndex.begin(); hi != mapHeaderIndex.end(); ++hi)
+        {
+            if (hi->second.nChainTrust > nBestHeaderTrust && hi->second.nChainTrust > nBestChainTrust)
+            {
+                hashBestHeader = hi->first;
+                nBestHeaderHeight = hi->second.nHeight;
+                nBestHeaderTrust = hi->second.nChainTrust;
+            }
+        }
+        UpdateHeaderChain();
+    }
+
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (pnode->id == nodeFrom && nDoS > 0)
+            pnode->Misbehaving(nDoS);
+        if (pnode->nStartingHeight > nBestHeight)
+            pnode->fHeadersPending = true;
+    }
+}
+
+// Position in vHeaderChain of the last header on it that the peer sent,
+// -1 if none. The peer has the blocks of vHeaderChain up to there; the
+// rest of the chain it never announced and isn't asked for.
+int static GetHeaderChainAnnounced(const CPeerBlockDownload& peer)
+{
+    uint256 hash = peer.hashLastHeader;
+    boost::unordered_map<uint256, CHeaderEntry, SaltedUint256Hasher>::const_iterator hi;
+    while ((hi = mapHeaderIndex.find(hash)) != mapHeaderIndex.end())
+    {
+        int i = hi->second.nHeight - nHeaderChainStart;
+        if (i < 0)
+            break;
+        if (i < (int)vHeaderChain.size() && vHeaderChain[i] == hash)
+            return i;
+        hash = hi->second.hashPrev;
+    }
+    return -1;
+}
+
+// A block arrived from nodeFrom, or was made here if -1
+void static MarkBlockReceived(const uint256& hash, NodeId nodeFrom)
+{
+    boost::unordered_map<uint256, CBlockInFlight, SaltedUint256Hasher>::iterator it = mapBlocksInFlight.find(hash);
+    if (it == mapBlocksInFlight.end())
+        return;
+    map<NodeId, CPeerBlockDownload>::iterator mi = mapPeerBlockDownload.find(it->second.node);
+    if (mi != mapPeerBlockDownload.end())
+    {
+        CPeerBlockDownload& peer = mi->second;
+        peer.nInFlight--;
+        // Every delivery earns the peer a bigger share of the window; a
+        // block that came from elsewhere in the meantime says nothing
+        if (nodeFrom == it->second.node)
+        {
+            int64_t nLatency = GetTimeMicros() - it->second.nTime;
+            peer.nAvgLatency = peer.nBlocksReceived == 0 ? nLatency : (peer.nAvgLatency * 7 + nLatency) / 8;
+            peer.nBlocksReceived++;
+            if (peer.nMaxInFlight < MAX_BLOCKS_IN_FLIGHT_PER_PEER)
+                peer.nMaxInFlight++;
+        }
+    }
+    mapBlocksInFlight.erase(it);
+}
+
+// Take a request away from a peer that didn't deliver in time, and halve
+// the number of blocks it may have in flight if it had announced the block
+void static PenalizeBlockInFlight(boost::unordered_map<uint256, CBlockInFlight, SaltedUint256Hasher>::iterator it, bool fHalve)
+{
+    map<NodeId, CPeerBlockDownload>::iterator mi = mapPeerBlockDownload.find(it->second.node);
+    if (mi == mapPeerBlockDownload.end())
+        return;
+    CPeerBlockDownload& peer = mi->second;
+    peer.nInFlight--;
+    if (fHalve)
+    {
+        peer.nMaxInFlight = max(1, peer.nMaxInFlight / 2);
+        peer.nStalls++;
+    }
+}
+
+// Ask pto for the next blocks of the best header chain it announced, so
+// that the download window ahead of our best block is spread over all peers
+// that have it. Blocks arriving ahead of their parents wait as orphans, so
+// they are connected in height order.
+void static RequestHeaderChainBlocks(CNode* pto)
+{
+    while (!vHeaderChain.empty() && mapBlockIndex.count(vHeaderChain.front()))
+    {
+        vHeaderChain.pop_front();
+        nHeaderChainStart++;
+    }
+    if (vHeaderChain.empty() || pto->fClient)
+        return;
+
+    // Requests not answered in time go to whoever asks next. A peer that
+    // can't deliver a block it sent the header of may have made it up, so
+    // that branch is dropped rather than waited on, and the peer charged.
+    int64_t nNow = GetTimeMicros();
+    vector<uint256> vUndelivered;
+    boost::unordered_map<uint256, CBlockInFlight, SaltedUint256Hasher>::iterator it = mapBlocksInFlight.begin();
+    while (it != mapBlocksInFlight.end())
+    {
+        if (it->second.nTime < nNow - BLOCK_DOWNLOAD_TIMEOUT * 1000000)
+        {
+            LogPrint("net", "block %s from peer=%d timed out\n", it->first.ToString(), it->second.node);
+            bool fAnnounced = false;
+            boost::unordered_map<uint256, CHeaderEntry, SaltedUint256Hasher>::const_iterator hi = mapHeaderIndex.find(it->first);
+            map<NodeId, CPeerBlockDownload>::const_iterator mi = mapPeerBlockDownload.find(it->second.node);
+            if (hi != mapHeaderIndex.end() && mi != mapPeerBlockDownload.end())
+            {
+                fAnnounced = hi->second.nHeight - nHeaderChainStart <= GetHeaderChainAnnounced(mi->second);
+                if (hi->second.nodeFrom == it->second.node)
+                    vUndelivered.push_back(it->first);
+            }
+            PenalizeBlockInFlight(it, fAnnounced);
+            mapBlocksInFlight.erase(it++);
+        }
+        else
+            ++it;
+    }
+    BOOST_FOREACH(const uint256& hash, vUndelivered)
+        InvalidHeaderChain(hash, HEADERS_UNDELIVERED_DOS);
+    if (vHeaderChain.empty())
+        return;
+
+    CPeerBlockDownload& state = mapPeerBlockDownload[pto->id];
+    int nAnnounced = GetHeaderChainAnnounced(state);
+    if (nAnnounced < 0)
+        return;
+    vector<CInv> vGetData;
+
+    // The blocks at the front of the window are the next to connect, and a
+    // slow peer holding one of them stalls validation however fast the
+    // others are. If pto has been quicker, ask it as well.
+    NodeId nodeStaller = -1;
+    for (int i = 0; i <= nAnnounced && i < MAX_BLOCKS_IN_FLIGHT_PER_PEER && state.nInFlight < state.nMaxInFlight; i++)
+    {
+        it = mapBlocksInFlight.find(vHeaderChain[i]);
+        if (it == mapBlocksInFlight.end() || it->second.node == pto->id)
+            continue;
+        int64_t nElapsed = nNow - it->second.nTime;
+        if (nElapsed < BLOCK_STALLING_TIMEOUT * 1000000 || state.nBlocksReceived == 0 || state.nAvgLatency >= nElapsed)
+            continue;
+        LogPrint("net", "block %s stalled at peer=%d for %dms, asking peer=%d\n",
+                 it->first.ToString(), it->second.node, nElapsed / 1000, pto->id);
+        // Halve the staller's share once, not for every block it holds up
+        PenalizeBlockInFlight(it, it->second.node != nodeStaller);
+        nodeStaller = it->second.node;
+        it->second.node = pto->id;
+        it->second.nTime = nNow;
+        state.nInFlight++;
+        CInv inv(MSG_BLOCK, it->first);
+        mapAlreadyAskedFor[inv] = nNow;
+        vGetData.push_back(inv);
+    }
+
+    for (int i = 0; i <= nAnnounced && i < (int)BLOCK_DOWNLOAD_WINDOW && state.nInFlight < state.nMaxInFlight; i++)
+    {
+        const uint256& hash = vHeaderChain[i];
+        if (mapBlocksInFlight.count(hash) || mapOrphanBlocks.count(hash) || mapBlockIndex.count(hash))
+            continue;
+        CBlockInFlight& inflight = mapBlocksInFlight[hash];
+        inflight.node = pto->id;
+        inflight.nTime = nNow;
+        state.nInFlight++;
+        CInv inv(MSG_BLOCK, hash);
+        mapAlreadyAskedFor[inv] = nNow;
+        vGetData.push_back(inv);
+    }
+    if (!vGetData.empty())
+    {
+        LogPrint("net", "requesting %u blocks from height %d from peer=%d\n", vGetData.size(), nHeaderChainStart, pto->id);
+        pto->PushMessage("getdata", vGetData);
+    }
+}
+
+bool static ReserealizeBlockSignature(CBlock* pblock)
+{
+    if (pblock->IsProofOfWork()) {
+        pblock->vchBlockSig.clear();
+        return true;
+    }
+
+    return CKey::ReserealizeSignature(pblock->vchBlockSig);
+}
+
+bool static IsCanonicalBlockSignature(CBlock* pblock)
+{
+    if (pblock->IsProofOfWork()) {
+        return pblock->vchBlockSig.empty();
+    }
+
+    return IsDERSignature(pblock->vchBlockSig, false);
+}
+
+bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+{
+    AssertLockHeld(cs_main);
+
+    // Check for duplicate
+    uint256 hash = pblock->GetHash();
+    MarkBlockReceived(hash, pfrom ? pfrom->id : -1);
+    if (mapBlockIndex.count(hash))
+        return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString());
+    if (mapOrphanBlocks.count(hash))
+        return error("ProcessBlock() : already have block (orphan) %s", hash.ToString());
+
+    // ppcoin: check proof-of-stake
+    // Limited duplicity on stake: prevents block flood attack
+    // Duplicate stake allowed only when there is orphan child block
+    if (pblock->IsProofOfStake() && setStakeSeen.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+        return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
+
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastSyncCheckpoint();
+    if (pcheckpoint && pblock->hashPrevBlock != hashBestChain && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+    {
+        // Extra checks to prevent "fill up memory by spamming with bogus blocks"
+        int64_t deltaTime = pblock->GetBlockTime() - pcheckpoint->nTime;
+        if (deltaTime < 0)
+        {
+            if (pfrom)
+                pfrom->Misbehaving(1);
+            return error("ProcessBlock() : block with timestamp before last checkpoint");
+        }
+    }
+
+    // Block signature can be malleated in such a way that it increases block size up to maximum allowed by protocol
+    // For now we just strip garbage from newly received blocks
+    if (!IsCanonicalBlockSignature(pblock)) {
+        if (!ReserealizeBlockSignature(pblock))
+            LogPrintf("WARNING: ProcessBlock() : ReserealizeBlockSignature FAILED\n");
     }
 
     // Preliminary checks
+    // The header stays: its block may just have come with the wrong
+    // transactions, and is fetched again
     if (!pblock->CheckBlock())
         return error("ProcessBlock() : CheckBlock FAILED");
 
@@ -2184,8 +3063,14 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             if (pblock->IsProofOfStake())
                 setStakeSeenOrphan.insert(pblock->GetProofOfStake());
 
-            // Ask this guy to fill in what we're missing
-            PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
+            // Ask this guy to fill in what we're missing, unless the
+            // header chain already tells us
+            if (mapHeaderIndex.count(hash))
+                return true;
+            if (fHeadersFirst)
+                PushGetHeaders(pfrom);
+            else
+                PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
             // ppcoin: getblocks may not obtain the ancestor block rejected
             // earlier by duplicate-stake check so we ask for it again directly
             if (!IsInitialBlockDownload())
@@ -2196,7 +3081,10 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 
     // Store to disk
     if (!pblock->AcceptBlock())
+    {
+        InvalidHeaderChain(hash, pblock->nDoS);
         return error("ProcessBlock() : AcceptBlock FAILED");
+    }
 
     // Recursively process any orphan blocks that depended on this one
     vector<uint256> vWorkQueue;
@@ -2216,6 +3104,8 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             block.BuildMerkleTree();
             if (block.AcceptBlock())
                 vWorkQueue.push_back(mi->second->hashBlock);
+            else
+                InvalidHeaderChain(mi->second->hashBlock, block.nDoS);
             mapOrphanBlocks.erase(mi->second->hashBlock);
             setStakeSeenOrphan.erase(block.GetProofOfStake());
             delete mi->second;
@@ -2439,7 +3329,7 @@ void PrintBlockTree()
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2711,14 +3601,48 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 
 
 
+// Most peers ask for the newest block at about the same time, so its
+// messages are read and serialized once; protected by cs_main
+static uint256 hashCachedBlock;
+static CSharedMessage msgCachedBlock;
+static CSharedMessage msgCachedCmpctBlock;
+
+// requires LOCK(cs_main)
+static CSharedMessage GetBlockMessage(CBlockIndex* pindex, bool fCompact)
+{
+    if (pindex->GetBlockHash() == hashCachedBlock)
+    {
+        if (fCompact && msgCachedCmpctBlock)
+            return msgCachedCmpctBlock;
+        if (!fCompact && msgCachedBlock)
+            return msgCachedBlock;
+    }
+
+    CBlock block;
+    block.ReadFromDisk(pindex);
+    CSharedMessage msg = fCompact ? MakeSharedMessage("cmpctblock", CCompactBlock(block))
+                                  : MakeSharedMessage("block", block);
+    if (pindex == pindexBest)
+    {
+        if (pindex->GetBlockHash() != hashCachedBlock)
+        {
+            hashCachedBlock = pindex->GetBlockHash();
+            msgCachedBlock.reset();
+            msgCachedCmpctBlock.reset();
+        }
+        (fCompact ? msgCachedCmpctBlock : msgCachedBlock) = msg;
+    }
+    return msg;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
+    // Transactions come from mapRelay and the memory pool, which have
+    // their own locks; only blocks need cs_main
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -2729,25 +3653,38 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
+                LOCK_MAIN_FOR("getdata");
+
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    // Older blocks go whole, the peer is unlikely to have their transactions
+                    bool fCompact = inv.type == MSG_CMPCT_BLOCK && mi->second->nHeight > nBestHeight - MAX_CMPCTBLOCK_DEPTH;
+                    CSharedMessage msg = GetBlockMessage(mi->second, fCompact);
+
+                    // Syncing peers mustn't hold up relay to everyone else
+                    bool fHistorical = mi->second->GetBlockTime() < pindexBest->GetBlockTime() - Params().HistoricalBlockAge();
+                    if (fHistorical && !CNode::ServeHistoricalBlock(pfrom->addr, msg->size()))
+                    {
+                        LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->id);
+                        pfrom->fDisconnect = true;
+                        break;
+                    }
+                    pfrom->PushSharedMessage(msg, fHistorical);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
                     {
                         // Bypass PushInventory, this must send even if redundant,
                         // and we want it right after the last block so they don't
-                        // wait for other stuff first.
+                        // wait for other stuff first. After a historical block
+                        // that means queueing it behind the block as well.
                         vector<CInv> vInv;
                         vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
-                        pfrom->PushMessage("inv", vInv);
+                        pfrom->PushSharedMessage(MakeSharedMessage("inv", vInv), fHistorical);
                         pfrom->hashContinue = 0;
                     }
                 }
@@ -2758,9 +3695,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSharedMessage>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSharedMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -2782,7 +3719,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             g_signals.Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK /* || inv.type == MSG_FILTERED_BLOCK */)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -2801,6 +3738,132 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+// Checks the header of a compact block on top of pindexPrev before any work
+// is spent rebuilding it: its target and proof, and for proof-of-stake the
+// kernel and block signature, from the prefilled coinbase and coinstake.
+// Requires cs_main.
+bool static CheckCompactBlockHeader(const CCompactBlock& cmpctblock, CBlockIndex* pindexPrev)
+{
+    const CBlock& header = cmpctblock.header;
+    uint256 hash = header.GetHash();
+    int nHeight = pindexPrev->nHeight + 1;
+
+    if (header.nVersion != 7)
+        return header.DoS(100, error("CheckCompactBlockHeader() : bad version %d", header.nVersion));
+
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()) || header.GetBlockTime() <= pindexPrev->GetPastTimeLimit())
+        return error("CheckCompactBlockHeader() : block %s timestamp out of range", hash.ToString());
+
+    CBlock block(header);
+    for (unsigned int i = 0; i < cmpctblock.vPrefilled.size() && i < 2; i++)
+        if (cmpctblock.vPrefilled[i].nIndex == i)
+            block.vtx.push_back(cmpctblock.vPrefilled[i].tx);
+    if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
+        return header.DoS(100, error("CheckCompactBlockHeader() : block %s has no prefilled coinbase", hash.ToString()));
+
+    bool fProofOfStake = block.IsProofOfStake();
+    if (fProofOfStake ? nHeight < Params().StartPoSBlock() : nHeight > Params().LastPoWBlock())
+        return header.DoS(100, error("CheckCompactBlockHeader() : %s block %s at height %d",
+            fProofOfStake ? "proof-of-stake" : "proof-of-work", hash.ToString(), nHeight));
+
+    if (header.nBits != GetNextTargetRequired(pindexPrev, fProofOfStake))
+        return header.DoS(100, error("CheckCompactBlockHeader() : block %s has incorrect nBits", hash.ToString()));
+
+    if (!fProofOfStake)
+    {
+        if (!CheckProofOfWork(hash, header.nBits))
+            return header.DoS(50, error("CheckCompactBlockHeader() : block %s proof-of-work failed", hash.ToString()));
+        return true;
+    }
+
+    // A stake we can't check yet is no reason to punish the peer
+    uint256 hashProof, targetProofOfStake;
+    if (!CheckProofOfStake(pindexPrev, block.vtx[1], header.nBits, hashProof, targetProofOfStake))
+        return error("CheckCompactBlockHeader() : block %s proof-of-stake failed", hash.ToString());
+    if (!block.CheckBlockSignature())
+        return header.DoS(100, error("CheckCompactBlockHeader() : block %s has a bad signature", hash.ToString()));
+    return true;
+}
+
+// Completes a block rebuilt from pfrom's compact block with the transactions
+// it was missing. If that fails, most likely because a short id matched the
+// wrong transaction, the whole block is fetched instead. Requires cs_main.
+void static ProcessCompactBlock(CNode* pfrom, const CPartialBlock& partial, const vector<CTransaction>& vMissing)
+{
+    CInv inv(MSG_BLOCK, partial.hashBlock);
+    CBlock block;
+    if (!partial.FillBlock(block, vMissing))
+    {
+        pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+        return;
+    }
+
+    LogPrint("cmpctblock", "reconstructed block %s from %s: %u prefilled, %u from mempool, %u from orphans, %u requested, %.2fms\n",
+        partial.hashBlock.ToString(), pfrom->addr.ToString(), partial.nPrefilled, partial.nFromPool, partial.nFromExtra,
+        vMissing.size(), (GetTimeMicros() - partial.nTimeStart) * 0.001);
+
+    if (ProcessBlock(pfrom, &block))
+        mapAlreadyAskedFor.erase(inv);
+    if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+}
+
+// Accepts a transaction relayed by pfrom into the memory pool, or keeps it
+// as an orphan if its inputs are missing
+void static ProcessRelayedTransaction(CNode* pfrom, const CTransaction& tx)
+{
+    CInv inv(MSG_TX, tx.GetHash());
+
+    LOCK_MAIN_FOR("tx");
+
+    bool fMissingInputs = false;
+
+    mapAlreadyAskedFor.erase(inv);
+
+    if (AcceptToMemoryPool(mempool, tx, true, &fMissingInputs))
+    {
+        RelayTransaction(tx, inv.hash);
+        EraseOrphanTx(inv.hash);
+
+        // Orphans that depended on this one are retried between
+        // messages by ProcessOrphanWork
+        QueueOrphanWork(pfrom, tx, inv.hash);
+    }
+    else if (fMissingInputs)
+    {
+        AddOrphanTx(tx, pfrom->id);
+
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+        uint64_t nMaxOrphanTxSize = (uint64_t)std::max((int64_t)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TX_SIZE)) * 1000;
+        unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanTxSize);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    }
+    if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
+}
+
+// Finishes the transactions from pfrom whose verification is done, in the
+// order they arrived
+// requires LOCK(cs_vRecvMsg)
+void static ProcessVerifiedTransactions(CNode* pfrom)
+{
+    while (!pfrom->vTxVerify.empty() && txVerifyQueue.IsDone(*pfrom->vTxVerify.front()))
+    {
+        boost::shared_ptr<CTxVerifyJob> job = pfrom->vTxVerify.front();
+        pfrom->vTxVerify.pop_front();
+
+        const CTransaction& tx = *job->ptx;
+        if (job->fCheckFailed)
+        {
+            LOCK_MAIN_FOR("tx");
+            mapAlreadyAskedFor.erase(CInv(MSG_TX, tx.GetHash()));
+            if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
+            continue;
+        }
+        ProcessRelayedTransaction(pfrom, tx);
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -2915,8 +3978,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         LogPrintf("receive version message: version %d, blocks=%d, us=%s, them=%s, peer=%s\n", pfrom->nVersion, pfrom->nStartingHeight, addrMe.ToString(), addrFrom.ToString(), pfrom->addr.ToString());
 
         // ppcoin: ask for pending sync-checkpoint if any
-        if (!IsInitialBlockDownload())
-            Checkpoints::AskForPendingSyncCheckpoint(pfrom);
+        {
+            LOCK_MAIN_FOR(strCommand);
+            if (!IsInitialBlockDownload())
+                Checkpoints::AskForPendingSyncCheckpoint(pfrom);
+        }
 
         if (GetBoolArg("-synctime", true))
             AddTimeData(pfrom->addr, nTime);
@@ -2934,6 +4000,24 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     else if (strCommand == "verack")
     {
         pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+
+        // Offer compact blocks; outbound peers, which we picked, are asked
+        // to push new blocks to us without waiting for our getdata
+        if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION && GetBoolArg("-compactblocks", true))
+            pfrom->PushMessage("sendcmpct", !pfrom->fInbound, COMPACT_BLOCK_ENCODING_VERSION);
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounce = false;
+        uint64_t nEncodingVersion = 0;
+        vRecv >> fAnnounce >> nEncodingVersion;
+        if (nEncodingVersion == COMPACT_BLOCK_ENCODING_VERSION && GetBoolArg("-compactblocks", true))
+        {
+            pfrom->fSupportsCompact = true;
+            pfrom->fAnnounceCompact = fAnnounce;
+        }
     }
 
 
@@ -3022,7 +4106,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
 
-        LOCK(cs_main);
+        BOOST_FOREACH(const CInv& inv, vInv)
+            pfrom->AddInventoryKnown(inv);
+
+        LOCK_MAIN_FOR(strCommand);
         CTxDB txdb("r");
 
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
@@ -3030,7 +4117,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             const CInv &inv = vInv[nInv];
 
             boost::this_thread::interruption_point();
-            pfrom->AddInventoryKnown(inv);
 
             bool fAlreadyHave = AlreadyHave(txdb, inv);
             LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
@@ -3039,7 +4125,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 if (!fImporting)
                     pfrom->AskFor(inv);
             } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
-                PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(inv.hash));
+                if (fHeadersFirst)
+                    PushGetHeaders(pfrom);
+                else
+                    PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(inv.hash));
             } else if (nInv == nLastBlock) {
                 // In case we are on a very long side-chain, it is possible that we already have
                 // the last block in an inv bundle sent in response to getblocks. Try to detect
@@ -3082,17 +4171,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
-        LOCK(cs_main);
+        LOCK_MAIN_FOR(strCommand);
 
         // Find the last block the caller has in the main chain
         CBlockIndex* pindex = locator.GetBlockIndex();
 
         // Send the rest of the chain
         if (pindex)
-            pindex = pindex->pnext;
+            pindex = chainActive.Next(pindex);
         int nLimit = 500;
         LogPrint("net", "getblocks %d to %s limit %d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), nLimit);
-        for (; pindex; pindex = pindex->pnext)
+        for (; pindex; pindex = chainActive.Next(pindex))
         {
             if (pindex->GetBlockHash() == hashStop)
             {
@@ -3115,6 +4204,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CSyncCheckpoint checkpoint;
         vRecv >> checkpoint;
 
+        LOCK_MAIN_FOR(strCommand);
+
         if (checkpoint.ProcessSyncCheckpoint(pfrom))
         {
             // Relay
@@ -3131,13 +4222,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
-        LOCK(cs_main);
+        LOCK_MAIN_FOR(strCommand);
 
         CBlockIndex* pindex = NULL;
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3147,13 +4238,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             // Find the last block the caller has in the main chain
             pindex = locator.GetBlockIndex();
             if (pindex)
-                pindex = pindex->pnext;
+                pindex = chainActive.Next(pindex);
         }
 
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString());
-        for (; pindex; pindex = pindex->pnext)
+        for (; pindex; pindex = chainActive.Next(pindex))
         {
             vHeaders.push_back(pindex->GetBlockHeader());
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
@@ -3163,90 +4254,186 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "headers" && fHeadersFirst)
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %u", vHeaders.size());
+        }
+
+        LOCK_MAIN_FOR(strCommand);
+
+        int nHeight = -1;
+        BOOST_FOREACH(const CBlock& header, vHeaders)
+        {
+            if (!AcceptBlockHeader(header, pfrom->id, nHeight))
+            {
+                if (header.nDoS) pfrom->Misbehaving(header.nDoS);
+                return error("headers : rejected header from peer=%d", pfrom->id);
+            }
+        }
+        if (!vHeaders.empty())
+            mapPeerBlockDownload[pfrom->id].hashLastHeader = vHeaders.back().GetHash();
+        LogPrint("net", "received %u headers up to height %d from peer=%d, best header %d\n", vHeaders.size(), nHeight, pfrom->id, nBestHeaderHeight);
+
+        // A full batch means the peer has more. Stop asking once the
+        // headers are far ahead of the blocks, SendMessages resumes.
+        if (vHeaders.size() == MAX_HEADERS_RESULTS)
+        {
+            if (nBestHeaderHeight < nBestHeight + MAX_HEADERS_AHEAD)
+                PushGetHeaders(pfrom);
+            else
+                pfrom->fHeadersPending = true;
+        }
+    }
+
+
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
+        // Signatures are checked by the verification threads first, the
+        // result picked up by ProcessVerifiedTransactions
+        if (txVerifyQueue.GetThreadCount() > 0)
+            pfrom->vTxVerify.push_back(txVerifyQueue.Push(tx));
+        else
+            ProcessRelayedTransaction(pfrom, tx);
+    }
 
-        bool fMissingInputs = false;
 
-        mapAlreadyAskedFor.erase(inv);
+    else if (strCommand == "block")
+    {
+        CBlock block;
+        vRecv >> block;
+        uint256 hashBlock = block.GetHash();
+
+        LogPrint("net", "received block %s\n", hashBlock.ToString());
+
+        CInv inv(MSG_BLOCK, hashBlock);
+        pfrom->AddInventoryKnown(inv);
 
-        if (AcceptToMemoryPool(mempool, tx, true, &fMissingInputs))
+        LOCK_MAIN_FOR(strCommand);
+
+        if (ProcessBlock(pfrom, &block))
+            mapAlreadyAskedFor.erase(inv);
+        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+    }
+
+
+    else if (strCommand == "cmpctblock")
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.GetBlockHash();
+
+        LogPrint("net", "received compact block %s\n", hashBlock.ToString());
+
+        CInv inv(MSG_BLOCK, hashBlock);
+        pfrom->AddInventoryKnown(inv);
+
+        LOCK_MAIN_FOR(strCommand);
+
+        if (mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock))
+            return true;
+
+        // Rebuilding only pays off on top of a block we know, orphans are
+        // fetched whole and go the usual way
+        BlockMap::iterator mi = mapBlockIndex.find(cmpctblock.header.hashPrevBlock);
+        if (mi == mapBlockIndex.end())
         {
-            RelayTransaction(tx, inv.hash);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
+            pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+            return true;
+        }
 
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        // Matching against the pool is only worth it for a block that could
+        // be valid; otherwise the whole block decides
+        if (!CheckCompactBlockHeader(cmpctblock, mi->second))
+        {
+            if (cmpctblock.header.nDoS)
             {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanTxHash = *mi;
-                    CTransaction& orphanTx = mapOrphanTransactions[orphanTxHash];
-                    bool fMissingInputs2 = false;
-
-                    if (AcceptToMemoryPool(mempool, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanTxHash.ToString());
-                        RelayTransaction(orphanTx, orphanTxHash);
-                        vWorkQueue.push_back(orphanTxHash);
-                        vEraseQueue.push_back(orphanTxHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        // invalid or too-little-fee orphan
-                        vEraseQueue.push_back(orphanTxHash);
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanTxHash.ToString());
-                    }
-                }
+                pfrom->Misbehaving(cmpctblock.header.nDoS);
+                return false;
             }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+            return true;
         }
-        else if (fMissingInputs)
+
+        boost::shared_ptr<CPartialBlock> partial(new CPartialBlock());
+        partial->nTimeStart = GetTimeMicros();
+        vector<boost::shared_ptr<const CTransaction> > vOrphans;
+        GetOrphanTransactions(vOrphans);
+        if (!partial->InitData(cmpctblock, mempool, vOrphans))
         {
-            AddOrphanTx(tx);
+            pfrom->Misbehaving(100);
+            return error("invalid compact block %s from %s", hashBlock.ToString(), pfrom->addr.ToString());
+        }
 
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+        CBlockTransactionsRequest req;
+        req.hashBlock = hashBlock;
+        partial->GetMissing(req.vIndexes);
+        if (req.vIndexes.empty())
+        {
+            ProcessCompactBlock(pfrom, *partial, vector<CTransaction>());
+        }
+        else
+        {
+            pfrom->pPartialBlock = partial;
+            pfrom->PushMessage("getblocktxn", req);
         }
-        if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
     }
 
 
-    else if (strCommand == "block")
+    else if (strCommand == "getblocktxn")
     {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK_MAIN_FOR(strCommand);
+
+        BlockMap::iterator mi = mapBlockIndex.find(req.hashBlock);
+        if (mi == mapBlockIndex.end() || mi->second->nHeight <= nBestHeight - MAX_CMPCTBLOCK_DEPTH)
+        {
+            LogPrint("net", "ignoring getblocktxn for %s from %s\n", req.hashBlock.ToString(), pfrom->addr.ToString());
+            return true;
+        }
+
         CBlock block;
-        vRecv >> block;
-        uint256 hashBlock = block.GetHash();
+        if (!block.ReadFromDisk(mi->second))
+            return error("getblocktxn : ReadFromDisk failed for %s", req.hashBlock.ToString());
+        BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                pfrom->Misbehaving(100);
+                return error("getblocktxn : index %u out of range from %s", nIndex, pfrom->addr.ToString());
+            }
+        }
+        pfrom->PushMessage("blocktxn", CBlockTransactions(block, req));
+    }
 
-        LogPrint("net", "received block %s\n", hashBlock.ToString());
 
-        CInv inv(MSG_BLOCK, hashBlock);
-        pfrom->AddInventoryKnown(inv);
+    else if (strCommand == "blocktxn")
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
 
-        LOCK(cs_main);
+        LOCK_MAIN_FOR(strCommand);
 
-        if (ProcessBlock(pfrom, &block))
-            mapAlreadyAskedFor.erase(inv);
-        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+        boost::shared_ptr<CPartialBlock> partial = pfrom->pPartialBlock;
+        if (!partial || partial->hashBlock != resp.hashBlock)
+        {
+            LogPrint("net", "ignoring unexpected blocktxn for %s from %s\n", resp.hashBlock.ToString(), pfrom->addr.ToString());
+            return true;
+        }
+        pfrom->pPartialBlock.reset();
+        ProcessCompactBlock(pfrom, *partial, resp.vtx);
     }
 
 
@@ -3259,7 +4446,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     {
         // Don't return addresses older than nCutOff timestamp
         int64_t nCutOff = GetTime() - (nNodeLifespan * 24 * 60 * 60);
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_inventory);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             if(addr.nTime > nCutOff)
@@ -3269,7 +4459,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "mempool")
     {
-        LOCK(cs_main);
+        LOCK_MAIN_FOR(strCommand);
 
         std::vector<uint256> vtxid;
         mempool.queryHashes(vtxid);
@@ -3410,6 +4600,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     return true;
 }
 
+static void RecordMessageProcessed(CNode* pfrom, const CMessageHeader& hdr, int64_t nProcessStart)
+{
+    int nCommand = GetNetCommandIndex(hdr.pchCommand);
+    unsigned int nBytes = CMessageHeader::HEADER_SIZE + hdr.nMessageSize;
+    int64_t nMicros = GetTimeMicros() - nProcessStart;
+    pfrom->netStats.RecordRecv(nCommand, nBytes, nMicros);
+    netStatsTotal.RecordRecv(nCommand, nBytes, nMicros);
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -3432,6 +4631,18 @@ bool ProcessMessages(CNode* pfrom)
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
 
+    if (!pfrom->vTxVerify.empty())
+        ProcessVerifiedTransactions(pfrom);
+
+    if (!pfrom->setOrphanWork.empty())
+        ProcessOrphanWork(pfrom);
+
+    // and of the transactions this peer relayed
+    if (!pfrom->setOrphanWork.empty()) return fOk;
+
+    // Don't take on more while too many transactions await verification
+    if (pfrom->vTxVerify.size() >= MAX_PEER_TX_VERIFY) return fOk;
+
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
         // Don't bother if send buffer is too full to respond anyway
@@ -3472,20 +4683,18 @@ bool ProcessMessages(CNode* pfrom)
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
 
-        // Checksum
+        // Checksum, computed by the socket thread as the data arrived
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        if (nChecksum != hdr.nChecksum)
+        if (msg.nChecksum != hdr.nChecksum)
         {
             LogPrintf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
-               strCommand, nMessageSize, nChecksum, hdr.nChecksum);
+               strCommand, nMessageSize, msg.nChecksum, hdr.nChecksum);
             continue;
         }
 
         // Process message
         bool fRet = false;
+        int64_t nProcessStart = GetTimeMicros();
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
@@ -3516,6 +4725,7 @@ bool ProcessMessages(CNode* pfrom)
         } catch (...) {
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
+        RecordMessageProcessed(pfrom, hdr, nProcessStart);
 
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand, nMessageSize);
@@ -3525,7 +4735,11 @@ bool ProcessMessages(CNode* pfrom)
 
     // In case the connection got shut down, its receive buffer was wiped
     if (!pfrom->fDisconnect)
+    {
+        for (std::deque<CNetMessage>::iterator itMsg = pfrom->vRecvMsg.begin(); itMsg != it; itMsg++)
+            itMsg->ReleaseBuffer();
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
 
     return fOk;
 }
@@ -3571,7 +4785,17 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Start block sync
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
-            PushGetBlocks(pto, pindexBest, uint256(0));
+            if (fHeadersFirst)
+                PushGetHeaders(pto);
+            else
+                PushGetBlocks(pto, pindexBest, uint256(0));
+        }
+
+        // Resume headers-first sync once the blocks have caught up
+        if (pto->fHeadersPending && nBestHeaderHeight < nBestHeight + MAX_HEADERS_AHEAD / 2)
+        {
+            pto->fHeadersPending = false;
+            PushGetHeaders(pto);
         }
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -3591,7 +4815,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 // Periodically clear setAddrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
-                    pnode->setAddrKnown.clear();
+                {
+                    LOCK(pnode->cs_inventory);
+                    pnode->setAddrKnown.reset();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -3606,24 +4833,22 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (fSendTrickle)
         {
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                LOCK(pto->cs_inventory);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    if (!pto->setAddrKnown.contains(addr))
                     {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
+                        pto->setAddrKnown.insert(addr);
+                        vAddr.push_back(addr);
                     }
                 }
+                pto->vAddrToSend.clear();
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
+            // receiver rejects addr messages larger than 1000
+            for (unsigned int i = 0; i < vAddr.size(); i += 1000)
+                pto->PushMessage("addr", vector<CAddress>(vAddr.begin() + i, vAddr.begin() + min(i + 1000, (unsigned int)vAddr.size())));
         }
 
 
@@ -3638,7 +4863,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->setInventoryKnown.contains(inv))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -3659,9 +4884,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                // Queued twice, it is known by now
+                if (!pto->setInventoryKnown.contains(inv))
                 {
+                    pto->setInventoryKnown.insert(inv);
                     vInv.push_back(inv);
                     if (vInv.size() >= 1000)
                     {
@@ -3679,9 +4905,26 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: getdata
         //
+        if (fHeadersFirst)
+            RequestHeaderChainBlocks(pto);
         vector<CInv> vGetData;
         int64_t nNow = GetTime() * 1000000;
         CTxDB txdb("r");
+
+        // The peer never sent the rest of its compact block: fetch the
+        // block whole, unless it has arrived some other way meanwhile
+        if (pto->pPartialBlock && GetTimeMicros() - pto->pPartialBlock->nTimeStart > CMPCTBLOCK_TIMEOUT * 1000000)
+        {
+            CInv inv(MSG_BLOCK, pto->pPartialBlock->hashBlock);
+            pto->pPartialBlock.reset();
+            if (!AlreadyHave(txdb, inv))
+            {
+                LogPrint("cmpctblock", "compact block %s from %s timed out, fetching it whole\n", inv.hash.ToString(), pto->addr.ToString());
+                pto->PushMessage("getdata", vector<CInv>(1, inv));
+            }
+        }
+        unsigned int nBlocks = 0;
+        int nBlockPos = -1;
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
         {
             const CInv& inv = (*pto->mapAskFor.begin()).second;
@@ -3689,16 +4932,26 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 if (fDebug)
                     LogPrint("net", "sending getdata: %s\n", inv.ToString());
+                if (inv.type == MSG_BLOCK)
+                {
+                    nBlocks++;
+                    nBlockPos = vGetData.size();
+                }
                 vGetData.push_back(inv);
                 if (vGetData.size() >= 1000)
                 {
                     pto->PushMessage("getdata", vGetData);
                     vGetData.clear();
+                    nBlockPos = -1;
                 }
                 mapAlreadyAskedFor[inv] = nNow;
             }
             pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
+        // A lone new block, rather than a batch answering getblocks, is
+        // fetched as a compact block once we are in sync
+        if (nBlocks == 1 && nBlockPos >= 0 && pto->fSupportsCompact && !pto->pPartialBlock && !IsInitialBlockDownload())
+            vGetData[nBlockPos].type = MSG_CMPCT_BLOCK;
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
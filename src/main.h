@@ -8,7 +8,6 @@
 #include "core.h"
 #include "bignum.h"
 #include "sync.h"
-#include "txmempool.h"
 #include "net.h"
 #include "hashblock.h"
 //#include "script.h"
@@ -16,14 +15,36 @@
 
 #include <list>
 
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+
 class CBlock;
 class CBlockIndex;
 class CInv;
 class CKeyItem;
 class CNode;
 class CReserveKey;
+class CTxMemPool;
+class CTxIndex;
 class CWallet;
 
+typedef boost::unordered_map<uint256, CBlockIndex*, SaltedUint256Hasher> BlockMap;
+typedef boost::unordered_map<uint256, CTxIndex, SaltedUint256Hasher> TxIndexMap;
+
+/** Hasher for the (kernel outpoint, stake time) pairs of setStakeSeen */
+class SaltedStakeHasher
+{
+private:
+    SaltedOutpointHasher hasher;
+
+public:
+    size_t operator()(const std::pair<COutPoint, unsigned int>& stake) const
+    {
+        return hasher(stake.first) ^ stake.second;
+    }
+};
+typedef boost::unordered_set<std::pair<COutPoint, unsigned int>, SaltedStakeHasher> StakeSet;
+
 /** The maximum allowed size for a serialized block, in bytes (network rule) */
 static const unsigned int MAX_BLOCK_SIZE = 1000000;
 /** The maximum size for mined blocks */
@@ -36,10 +57,43 @@ static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 static const unsigned int MAX_P2SH_SIGOPS = 15;
 /** The maximum number of sigops we're willing to relay/mine in a single tx */
 static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
-/** The maximum number of orphan transactions kept in memory */
-static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** Default for -maxorphantxsize, maximum kilobytes of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_TX_SIZE = 5000;
+/** Seconds an orphan transaction is kept waiting for its parents */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum seconds between sweeps for expired orphan transactions */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
 /** Default for -maxorphanblocks, maximum number of orphan blocks kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 750;
+/** The maximum number of headers in a 'headers' protocol message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Headers-first sync: stop asking for headers this far ahead of the best block */
+static const int MAX_HEADERS_AHEAD = 20000;
+/** Headers-first sync: headers of blocks we don't have kept at most; those
+ *  off the best header chain are dropped first */
+static const unsigned int MAX_HEADER_INDEX_SIZE = 2 * MAX_HEADERS_AHEAD;
+/** Headers-first sync: blocks past the best block that may be requested at once,
+ *  kept below DEFAULT_MAX_ORPHAN_BLOCKS since they arrive as orphans */
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 512;
+/** Headers-first sync: blocks requested from one peer at once, at most; a
+ *  peer starts at half of it and earns more by delivering */
+static const int MAX_BLOCKS_IN_FLIGHT_PER_PEER = 16;
+/** Headers-first sync: seconds before an unanswered block request goes to another peer */
+static const int64_t BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Headers-first sync: misbehavior charged to a peer that doesn't deliver the
+ *  blocks of headers it sent, within BLOCK_DOWNLOAD_TIMEOUT */
+static const int HEADERS_UNDELIVERED_DOS = 20;
+/** Headers-first sync: seconds a peer may hold up the next blocks to connect
+ *  before a faster peer is asked for them as well */
+static const int64_t BLOCK_STALLING_TIMEOUT = 2;
+/** Default for -maxmempool, maximum memory pool size in megabytes */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for memory pool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -persistmempool, save the memory pool on shutdown and load it on startup */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
@@ -59,8 +113,12 @@ inline int64_t FutureDrift(int64_t nTime) { return nTime + 10 * 60; }
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
-extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
+extern CWaitableCriticalSection csBestBlock;
+extern CConditionVariable cvBlockChange;
+extern uint256 hashBestBlockNotified;
+extern unsigned int nTxUpdatesNotified;
+extern BlockMap mapBlockIndex;
+extern StakeSet setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern unsigned int nStakeMinAge;
 extern unsigned int nNodeLifespan;
@@ -78,11 +136,12 @@ extern int64_t nTimeBestReceived;
 extern bool fImporting;
 extern bool fReindex;
 struct COrphanBlock;
-extern std::map<uint256, COrphanBlock*> mapOrphanBlocks;
+extern boost::unordered_map<uint256, COrphanBlock*, SaltedUint256Hasher> mapOrphanBlocks;
 extern bool fHaveGUI;
 
 // Settings
 extern bool fUseFastIndex;
+extern bool fHeadersFirst;
 extern unsigned int nDerivationMethodIndex;
 
 extern bool fMinimizeCoinAge;
@@ -112,6 +171,30 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals);
 void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
+/** Ask pnode for the headers following our best header */
+void PushGetHeaders(CNode* pnode);
+
+/** Block download statistics of a peer, for getpeerinfo */
+struct CBlockDownloadStats
+{
+    int nBlocksInFlight;
+    int nMaxBlocksInFlight;
+    int64_t nBlocksReceived;
+    int64_t nAvgLatency; // microseconds from request to block
+    int nStalls;
+};
+bool GetBlockDownloadStats(NodeId nodeid, CBlockDownloadStats& stats);
+
+/** Time the message handlers spent waiting for cs_main for one message command */
+struct CMainLockWaitStats
+{
+    uint64_t nCount;
+    int64_t nWaitMicros;
+    int64_t nMaxWaitMicros;
+
+    CMainLockWaitStats() : nCount(0), nWaitMicros(0), nMaxWaitMicros(0) { }
+};
+void GetMainLockWaitStats(std::map<std::string, CMainLockWaitStats>& mapStats);
 
 bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
@@ -119,7 +202,6 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
 FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
-CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
@@ -137,7 +219,13 @@ void ThreadStakeMiner(CWallet *pwallet);
 
 
 /** (try to) add transaction to memory pool **/
-bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, bool* pfMissingInputs);
+bool AcceptToMemoryPool(CTxMemPool& pool, const CTransaction &tx, bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime = 0);
+/** Expire old memory pool transactions, then evict by fee rate down to -maxmempool */
+void LimitMempoolSize(CTxMemPool& pool);
+/** Write the memory pool to mempool.dat, once it has been loaded from there */
+bool DumpMempool();
+/** Revalidate the transactions in mempool.dat into the memory pool */
+void ThreadLoadMempool();
 
 
 
@@ -369,8 +457,8 @@ public:
      @param[out] fInvalid	returns true if transaction is invalid
      @return	Returns true if all inputs are in txdb or mapTestPool
      */
-    bool FetchInputs(CTxDB& txdb, const std::map<uint256, CTxIndex>& mapTestPool,
-                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid);
+    bool FetchInputs(CTxDB& txdb, const TxIndexMap& mapTestPool,
+                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid) const;
 
     /** Sanity check previous transactions, then, if all checks succeed,
         mark them as spent by this transaction.
@@ -384,8 +472,8 @@ public:
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
-                       std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS);
+                       TxIndexMap& mapTestPool, const CDiskTxPos& posThisTx,
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS) const;
     bool CheckTransaction() const;
     bool GetCoinAge(CTxDB& txdb, uint64_t& nCoinAge) const;  // ppcoin: get transaction coin age
 
@@ -516,13 +604,67 @@ public:
         vSpent.resize(nOutputs);
     }
 
-    IMPLEMENT_SERIALIZE
-    (
-        if (!(nType & SER_GETHASH))
-            READWRITE(nVersion);
-        READWRITE(pos);
-        READWRITE(vSpent);
-    )
+    // Compact encoding: varint positions, the output count, a bitmap of spent
+    // outputs and then the positions of the spent outputs only.
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return (CSizeComputer(nType, nVersion) << *this).size();
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WriteVarInt<Stream, unsigned int>(s, pos.nFile);
+        WriteVarInt<Stream, unsigned int>(s, pos.nBlockPos);
+        WriteVarInt<Stream, unsigned int>(s, pos.nTxPos);
+        unsigned int nOutputs = vSpent.size();
+        WriteVarInt<Stream, unsigned int>(s, nOutputs);
+        for (unsigned int i = 0; i < nOutputs; i += 8)
+        {
+            unsigned char chBits = 0;
+            for (unsigned int j = 0; j < 8 && i + j < nOutputs; j++)
+                if (!vSpent[i + j].IsNull())
+                    chBits |= (1 << j);
+            WRITEDATA(s, chBits);
+        }
+        for (unsigned int i = 0; i < nOutputs; i++)
+        {
+            if (vSpent[i].IsNull())
+                continue;
+            WriteVarInt<Stream, unsigned int>(s, vSpent[i].nFile);
+            WriteVarInt<Stream, unsigned int>(s, vSpent[i].nBlockPos);
+            WriteVarInt<Stream, unsigned int>(s, vSpent[i].nTxPos);
+        }
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        pos.nFile = ReadVarInt<Stream, unsigned int>(s);
+        pos.nBlockPos = ReadVarInt<Stream, unsigned int>(s);
+        pos.nTxPos = ReadVarInt<Stream, unsigned int>(s);
+        unsigned int nOutputs = ReadVarInt<Stream, unsigned int>(s);
+        if (nOutputs > MAX_BLOCK_SIZE)
+            throw std::ios_base::failure("CTxIndex::Unserialize() : output count out of range");
+        // Spent outputs are marked with nFile 0 until their position is read
+        vSpent.assign(nOutputs, CDiskTxPos());
+        for (unsigned int i = 0; i < nOutputs; i += 8)
+        {
+            unsigned char chBits;
+            READDATA(s, chBits);
+            for (unsigned int j = 0; j < 8 && i + j < nOutputs; j++)
+                if ((chBits >> j) & 1)
+                    vSpent[i + j].nFile = 0;
+        }
+        for (unsigned int i = 0; i < nOutputs; i++)
+        {
+            if (vSpent[i].IsNull())
+                continue;
+            vSpent[i].nFile = ReadVarInt<Stream, unsigned int>(s);
+            vSpent[i].nBlockPos = ReadVarInt<Stream, unsigned int>(s);
+            vSpent[i].nTxPos = ReadVarInt<Stream, unsigned int>(s);
+        }
+    }
 
     void SetNull()
     {
@@ -1165,7 +1307,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1175,6 +1317,12 @@ public:
         vHave = vHaveIn;
     }
 
+    // Start the locator at a block we only have the header of
+    void PushFront(const uint256& hash)
+    {
+        vHave.insert(vHave.begin(), hash);
+    }
+
     IMPLEMENT_SERIALIZE
     (
         if (!(nType & SER_GETHASH))
@@ -1216,7 +1364,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1235,7 +1383,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1251,7 +1399,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1272,6 +1420,74 @@ public:
 };
 
 
+/** The blocks of the best chain, indexed by height. Kept in step with
+ * pindexBest by SetBestChain() and only changed while holding cs_main.
+ */
+class CChain
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    /** Returns the index entry for the genesis block of this chain, or NULL if none. */
+    CBlockIndex* Genesis() const
+    {
+        return vChain.size() > 0 ? vChain[0] : NULL;
+    }
+
+    /** Returns the index entry for the tip of this chain, or NULL if none. */
+    CBlockIndex* Tip() const
+    {
+        return vChain.size() > 0 ? vChain[vChain.size() - 1] : NULL;
+    }
+
+    /** Returns the index entry at a particular height in this chain, or NULL if no such height exists. */
+    CBlockIndex* operator[](int nHeight) const
+    {
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    /** Efficiently check whether a block is present in this chain. */
+    bool Contains(const CBlockIndex* pindex) const
+    {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    /** Find the successor of a block in this chain, or NULL if the given index is not found or is the tip. */
+    CBlockIndex* Next(const CBlockIndex* pindex) const
+    {
+        if (Contains(pindex))
+            return (*this)[pindex->nHeight + 1];
+        return NULL;
+    }
+
+    /** Return the maximal height in the chain. Is equal to chain.Tip() ? chain.Tip()->nHeight : -1. */
+    int Height() const
+    {
+        return vChain.size() - 1;
+    }
+
+    /** Set/initialize a chain with a given tip. Only the entries above the fork are touched. */
+    void SetTip(CBlockIndex* pindex);
+
+    /** Return a CBlockLocator that refers to a block in this chain (by default the tip). */
+    CBlockLocator GetLocator(const CBlockIndex* pindex = NULL) const;
+
+    /** Find the last common block between this chain and a block index entry. */
+    CBlockIndex* FindFork(CBlockIndex* pindex) const;
+
+    /** Find the block of this chain stored at a position in the block files,
+     *  or NULL if it isn't found. Assumes blocks are stored in height order,
+     *  which holds for most of the chain, so a NULL doesn't prove absence. */
+    CBlockIndex* FindByDiskPos(unsigned int nFile, unsigned int nBlockPos) const;
+};
+
+/** The currently-connected chain of blocks. */
+extern CChain chainActive;
+
+
 
 
 
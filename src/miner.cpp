@@ -5,8 +5,10 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "txdb.h"
+#include "txmempool.h"
 #include "miner.h"
 #include "kernel.h"
+#include "init.h"
 
 using namespace std;
 
@@ -57,25 +59,65 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
 class COrphan
 {
 public:
-    CTransaction* ptx;
+    const CTxMemPoolEntry* pentry;
     set<uint256> setDependsOn;
     double dPriority;
     double dFeePerKb;
 
-    COrphan(CTransaction* ptxIn)
+    COrphan(const CTxMemPoolEntry* pentryIn)
     {
-        ptx = ptxIn;
+        pentry = pentryIn;
         dPriority = dFeePerKb = 0;
     }
 };
 
+// Remembers the mapTestPool entries a transaction is about to overwrite,
+// so a candidate that fails ConnectInputs (or belongs to a package that
+// does) can be backed out in time proportional to its own inputs instead
+// of copying the whole pool.
+class CTestPoolUndo
+{
+private:
+    TxIndexMap& mapTestPool;
+    vector<pair<uint256, CTxIndex> > vRestore;
+    vector<uint256> vErase;
+
+public:
+    CTestPoolUndo(TxIndexMap& mapTestPoolIn, const CTransaction& tx) : mapTestPool(mapTestPoolIn)
+    {
+        set<uint256> setSeen;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            Save(txin.prevout.hash, setSeen);
+        Save(tx.GetHash(), setSeen);
+    }
+
+    void Save(const uint256& hash, set<uint256>& setSeen)
+    {
+        if (!setSeen.insert(hash).second)
+            return;
+        TxIndexMap::const_iterator mi = mapTestPool.find(hash);
+        if (mi == mapTestPool.end())
+            vErase.push_back(hash);
+        else
+            vRestore.push_back(*mi);
+    }
+
+    void Undo()
+    {
+        BOOST_FOREACH(const uint256& hash, vErase)
+            mapTestPool.erase(hash);
+        for (unsigned int i = 0; i < vRestore.size(); i++)
+            mapTestPool[vRestore[i].first] = vRestore[i].second;
+    }
+};
+
 
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
  
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, const CTxMemPoolEntry*> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -98,14 +140,213 @@ public:
     }
 };
 
-// CreateNewBlock: create new block (without proof-of-work/proof-of-stake)
-CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFees)
+// Running totals of the block being assembled
+struct CBlockAssembly
 {
-    // Create new block
-    auto_ptr<CBlock> pblock(new CBlock());
-    if (!pblock.get())
-        return NULL;
+    CBlock* pblock;
+    CBlockIndex* pindexPrev;
+    int nHeight;
+    bool fProofOfStake;
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockMinSize;
+    int64_t nMinTxFee;
+    TxIndexMap mapTestPool;
+    set<uint256> setAdded;
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    int nBlockSigOps;
+    int64_t nFees;
+};
+
+// Appends vPackage, which must be ordered parents first, to the block.
+// Either every transaction is added or none is; on failure hashFailed is
+// the transaction that could not be added.
+static bool AddPackageToBlock(CTxDB& txdb, CBlockAssembly& assembly, const vector<const CTxMemPoolEntry*>& vPackage, uint256& hashFailed)
+{
+    CBlock* pblock = assembly.pblock;
+    size_t nTxBefore = pblock->vtx.size();
+    uint64_t nBlockSize = assembly.nBlockSize;
+    int nBlockSigOps = assembly.nBlockSigOps;
+    int64_t nFees = 0;
+    list<CTestPoolUndo> lUndo;
+    bool fOk = true;
+
+    BOOST_FOREACH(const CTxMemPoolEntry* pentry, vPackage)
+    {
+        const CTransaction& tx = pentry->GetTx();
+        unsigned int nTxSize = pentry->GetTxSize();
+        unsigned int nTxSigOps = pentry->GetSigOpCount();
+
+        // Size and sigop limits
+        if (nBlockSize + nTxSize >= assembly.nBlockMaxSize || nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        {
+            fOk = false;
+            break;
+        }
+
+        // Timestamp limit
+        if (tx.nTime > GetAdjustedTime() || (assembly.fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
+        {
+            fOk = false;
+            break;
+        }
+
+        // Every transaction must pay the block minimum on its own
+        if (pentry->GetFee() < GetMinFee(tx, nBlockSize, GMF_BLOCK))
+        {
+            fOk = false;
+            break;
+        }
+
+        MapPrevTx mapInputs;
+        bool fInvalid;
+        if (!tx.FetchInputs(txdb, assembly.mapTestPool, false, true, mapInputs, fInvalid))
+        {
+            fOk = false;
+            break;
+        }
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        lUndo.push_back(CTestPoolUndo(assembly.mapTestPool, tx));
+        if (!tx.ConnectInputs(txdb, mapInputs, assembly.mapTestPool, CDiskTxPos(1,1,1), assembly.pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
+        {
+            fOk = false;
+            break;
+        }
+        assembly.mapTestPool[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
+
+        pblock->vtx.push_back(tx);
+        nBlockSize += nTxSize;
+        nBlockSigOps += nTxSigOps;
+        nFees += pentry->GetFee();
+    }
+
+    if (!fOk)
+    {
+        hashFailed = vPackage[pblock->vtx.size() - nTxBefore]->GetTx().GetHash();
+        BOOST_REVERSE_FOREACH(CTestPoolUndo& undo, lUndo)
+            undo.Undo();
+        pblock->vtx.resize(nTxBefore);
+        return false;
+    }
+
+    for (size_t i = nTxBefore; i < pblock->vtx.size(); i++)
+    {
+        uint256 hash = pblock->vtx[i].GetHash();
+        assembly.setAdded.insert(hash);
+        if (fDebug && GetBoolArg("-printpriority", false))
+        {
+            const CTxMemPoolEntry* pentry = vPackage[i - nTxBefore];
+            LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
+                   pentry->GetPriority(assembly.pindexPrev->nHeight),
+                   double(pentry->GetFee()) / (double(pentry->GetTxSize())/1000.0), hash.ToString());
+        }
+    }
+    assembly.nBlockSize = nBlockSize;
+    assembly.nBlockTx += vPackage.size();
+    assembly.nBlockSigOps = nBlockSigOps;
+    assembly.nFees += nFees;
+    return true;
+}
 
+// Adds mempool transactions not yet in the block, best ancestor fee rate
+// first. The pool keeps an index of each transaction's fee rate together
+// with its in-pool ancestors, so a child paying for its parents pulls them
+// in as one package. The index is not refreshed as ancestors land in the
+// block, so the order is approximate once packages overlap.
+static void AddTransactionsByFeeRate(CTxDB& txdb, CBlockAssembly& assembly)
+{
+    set<uint256> setFailed;
+    for (set<CMemPoolFeeKey>::const_reverse_iterator ri = mempool.setByAncestorFeeRate.rbegin(); ri != mempool.setByAncestorFeeRate.rend(); ++ri)
+    {
+        const uint256& hash = ri->hash;
+        if (assembly.setAdded.count(hash) || setFailed.count(hash))
+            continue;
+
+        set<uint256> setAncestors;
+        mempool.CalculateMemPoolAncestors(hash, setAncestors);
+        setAncestors.insert(hash);
+
+        vector<pair<uint64_t, const CTxMemPoolEntry*> > vSorted;
+        int64_t nPackageFees = 0;
+        uint64_t nPackageSize = 0;
+        bool fSkip = false;
+        BOOST_FOREACH(const uint256& hashMember, setAncestors)
+        {
+            if (assembly.setAdded.count(hashMember))
+                continue;
+            const CTxMemPoolEntry& entry = mempool.mapTx[hashMember];
+            const CTransaction& tx = entry.GetTx();
+            if (setFailed.count(hashMember) || tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, assembly.nHeight))
+            {
+                fSkip = true;
+                break;
+            }
+            nPackageFees += entry.GetFee();
+            nPackageSize += entry.GetTxSize();
+            vSorted.push_back(make_pair(entry.GetCountWithAncestors(), &entry));
+        }
+        if (fSkip)
+        {
+            setFailed.insert(hash);
+            continue;
+        }
+
+        // Size limits
+        if (assembly.nBlockSize + nPackageSize >= assembly.nBlockMaxSize)
+            continue;
+
+        // Skip free transactions if we're past the minimum block size:
+        double dFeePerKb = double(nPackageFees) / (double(nPackageSize)/1000.0);
+        if ((dFeePerKb < assembly.nMinTxFee) && (assembly.nBlockSize + nPackageSize >= assembly.nBlockMinSize))
+            continue;
+
+        // A transaction has more in-pool ancestors than any of its
+        // ancestors, so this puts parents first
+        sort(vSorted.begin(), vSorted.end());
+        vector<const CTxMemPoolEntry*> vPackage;
+        vPackage.reserve(vSorted.size());
+        for (unsigned int i = 0; i < vSorted.size(); i++)
+            vPackage.push_back(vSorted[i].second);
+
+        uint256 hashFailed;
+        if (!AddPackageToBlock(txdb, assembly, vPackage, hashFailed))
+        {
+            setFailed.insert(hashFailed);
+            setFailed.insert(hash);
+        }
+    }
+}
+
+// Sets the coinbase value and header fields that depend on the transactions
+static void FinishBlock(CBlockAssembly& assembly)
+{
+    CBlock* pblock = assembly.pblock;
+    CBlockIndex* pindexPrev = assembly.pindexPrev;
+
+    nLastBlockTx = assembly.nBlockTx;
+    nLastBlockSize = assembly.nBlockSize;
+
+    if (fDebug && GetBoolArg("-printpriority", false))
+        LogPrintf("CreateNewBlock(): total size %u\n", assembly.nBlockSize);
+
+    if (!assembly.fProofOfStake)
+        pblock->vtx[0].vout[0].nValue = GetProofOfWorkReward(assembly.nHeight, assembly.nFees);
+
+    // Fill in header
+    pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+    pblock->nTime          = max(pindexPrev->GetPastTimeLimit()+1, pblock->GetMaxTransactionTime());
+    if (!assembly.fProofOfStake)
+        pblock->UpdateTime(pindexPrev);
+    pblock->nNonce         = 0;
+}
+
+// Builds a block on pindexBest into assembly.pblock, which the caller owns
+static bool AssembleBlock(CReserveKey& reservekey, bool fProofOfStake, CBlockAssembly& assembly)
+{
+    CBlock* pblock = assembly.pblock;
     CBlockIndex* pindexPrev = pindexBest;
     int nHeight = pindexPrev->nHeight + 1;
 
@@ -119,7 +360,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
     {
         CPubKey pubkey;
         if (!reservekey.GetReservedKey(pubkey))
-            return NULL;
+            return false;
         txNew.vout[0].scriptPubKey.SetDestination(pubkey.GetID());
     }
     else
@@ -161,216 +402,335 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
     pblock->nBits = GetNextTargetRequired(pindexPrev, fProofOfStake);
 
     // Collect memory pool transactions into the block
-    int64_t nFees = 0;
     {
         LOCK2(cs_main, mempool.cs);
         CTxDB txdb("r");
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        assembly.pindexPrev = pindexPrev;
+        assembly.nHeight = nHeight;
+        assembly.fProofOfStake = fProofOfStake;
+        assembly.nBlockMaxSize = nBlockMaxSize;
+        assembly.nBlockMinSize = nBlockMinSize;
+        assembly.nMinTxFee = nMinTxFee;
+        assembly.nBlockSize = 1000;
+        assembly.nBlockTx = 0;
+        assembly.nBlockSigOps = 100;
+        assembly.nFees = 0;
+
+        // First fill the priority area, highest priority first. Priority
+        // ages with the chain, so it cannot be indexed by the pool and is
+        // sorted here; the area is small.
+        if (nBlockPrioritySize > 0)
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
+            list<COrphan> vOrphan; // list memory doesn't move
+            map<uint256, vector<COrphan*> > mapDependers;
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            // This vector will be sorted into a priority queue:
+            vector<TxPriority> vecPriority;
+            vecPriority.reserve(mempool.mapTx.size());
+            for (CTxMemPool::TxMap::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
             {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
+                const CTxMemPoolEntry& entry = (*mi).second;
+                const CTransaction& tx = entry.GetTx();
+                if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+                    continue;
 
+                // Size, sigops, fee and entry priority were computed once by
+                // AcceptToMemoryPool; in-pool parents are linked by the pool.
+                COrphan* porphan = NULL;
+                BOOST_FOREACH(const uint256& hashParent, mempool.GetMemPoolParents((*mi).first))
+                {
                     // Has to wait for dependencies
                     if (!porphan)
                     {
                         // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
+                        vOrphan.push_back(COrphan(&entry));
                         porphan = &vOrphan.back();
                     }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
+                    mapDependers[hashParent].push_back(porphan);
+                    porphan->setDependsOn.insert(hashParent);
                 }
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
 
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
+                // Inputs confirmed at entry have gained one confirmation per block since
+                double dPriority = entry.GetPriority(pindexPrev->nHeight);
+                double dFeePerKb = double(entry.GetFee()) / (double(entry.GetTxSize())/1000.0);
 
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
+                if (porphan)
+                {
+                    porphan->dPriority = dPriority;
+                    porphan->dFeePerKb = dFeePerKb;
+                }
+                else
+                    vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &entry));
+            }
 
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
+            TxPriorityCompare comparer(false);
+            std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
 
-            if (porphan)
+            while (!vecPriority.empty())
             {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
+                // Take highest priority transaction off the priority queue:
+                double dPriority = vecPriority.front().get<0>();
+                const CTxMemPoolEntry* pentry = vecPriority.front().get<2>();
+
+                std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                vecPriority.pop_back();
+
+                // Leave the rest to the fee-ordered pass once past the priority
+                // size or we run out of high-priority transactions:
+                if ((assembly.nBlockSize + pentry->GetTxSize() >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250))
+                    break;
+
+                uint256 hashFailed;
+                if (!AddPackageToBlock(txdb, assembly, vector<const CTxMemPoolEntry*>(1, pentry), hashFailed))
+                    continue;
+
+                // Add transactions that depend on this one to the priority queue
+                uint256 hash = pentry->GetTx().GetHash();
+                if (mapDependers.count(hash))
+                {
+                    BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+                    {
+                        if (!porphan->setDependsOn.empty())
+                        {
+                            porphan->setDependsOn.erase(hash);
+                            if (porphan->setDependsOn.empty())
+                            {
+                                vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->pentry));
+                                std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                            }
+                        }
+                    }
+                }
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
         }
 
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
+        // Then take transactions by fee rate
+        AddTransactionsByFeeRate(txdb, assembly);
 
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        FinishBlock(assembly);
+    }
 
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
+    return true;
+}
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+// CreateNewBlock: create new block (without proof-of-work/proof-of-stake)
+CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFees)
+{
+    // Create new block
+    auto_ptr<CBlock> pblock(new CBlock());
+    if (!pblock.get())
+        return NULL;
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
+    CBlockAssembly assembly;
+    assembly.pblock = pblock.get();
+    if (!AssembleBlock(reservekey, fProofOfStake, assembly))
+        return NULL;
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+    if (pFees)
+        *pFees = assembly.nFees;
 
-            // Timestamp limit
-            if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
-                continue;
+    return pblock.release();
+}
 
-            // Transaction fee
-            int64_t nMinFee = GetMinFee(tx, nBlockSize, GMF_BLOCK);
+//////////////////////////////////////////////////////////////////////////////
+//
+// CBlockTemplateManager
+//
 
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
+CBlockTemplateManager templateManager;
 
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
+// A template together with what it took to build it, so transactions that
+// arrive later can be appended without starting over
+struct CBlockTemplateManager::CTemplateState
+{
+    CBlock block;
+    CBlockAssembly assembly;
+    boost::shared_ptr<const CBlock> ptemplate; // published copy of block
+    unsigned int nTransactionsUpdated;
+    int64_t nTimeBuilt;
+    int64_t nTimeUpdated;
+
+    CTemplateState()
+    {
+        assembly.pblock = &block;
+        assembly.pindexPrev = NULL;
+        nTransactionsUpdated = 0;
+        nTimeBuilt = nTimeUpdated = 0;
+    }
+};
 
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-                continue;
+CBlockTemplateManager::CBlockTemplateManager()
+{
+    nExtraNonce = 0;
+    hashNotifiedPrev = 0;
+    nNotifiedFees = 0;
+    nNotifiedTxUpdates = 0;
+    nNotifiedTime = 0;
+    fLongPollRefresh = false;
+}
 
-            int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-            if (nTxFees < nMinFee)
-                continue;
+boost::shared_ptr<const CBlock> CBlockTemplateManager::GetTemplate(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFees, CBlockIndex** ppindexPrev)
+{
+    // The mining RPCs call in with cs_main held, so it is always taken
+    // before cs; pindexBest is read under it too
+    LOCK2(cs_main, mempool.cs);
+    LOCK(cs);
 
-            nTxSigOps += GetP2SHSigOpCount(tx, mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+    boost::shared_ptr<CTemplateState>& pstate = fProofOfStake ? pstateStake : pstateWork;
+    unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    int64_t nNow = GetTime();
 
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
-                continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
+    if (!pstate || pstate->assembly.pindexPrev != pindexBest ||
+        (nTransactionsUpdated != pstate->nTransactionsUpdated && nNow - pstate->nTimeBuilt > TEMPLATE_REBUILD_INTERVAL))
+    {
+        // New tip, or long enough for the priority area and evictions to matter:
+        // start over
+        boost::shared_ptr<CTemplateState> pstateNew(new CTemplateState());
+        pstateNew->nTransactionsUpdated = nTransactionsUpdated;
+        if (!AssembleBlock(reservekey, fProofOfStake, pstateNew->assembly))
+            return boost::shared_ptr<const CBlock>();
+        pstateNew->ptemplate.reset(new CBlock(pstateNew->block));
+        pstateNew->nTimeBuilt = pstateNew->nTimeUpdated = nNow;
+        pstate = pstateNew;
+    }
+    else if (nTransactionsUpdated != pstate->nTransactionsUpdated && nNow - pstate->nTimeUpdated >= TEMPLATE_UPDATE_INTERVAL)
+    {
+        // Same tip: everything already in the block is still valid and
+        // mapTestPool still describes it, so only new arrivals are checked
+        CTxDB txdb("r");
+        size_t nTxBefore = pstate->block.vtx.size();
+        pstate->nTransactionsUpdated = nTransactionsUpdated;
+        pstate->nTimeUpdated = nNow;
+        AddTransactionsByFeeRate(txdb, pstate->assembly);
+        if (pstate->block.vtx.size() != nTxBefore)
+        {
+            FinishBlock(pstate->assembly);
+            pstate->ptemplate.reset(new CBlock(pstate->block));
+            LogPrint("mining", "CBlockTemplateManager : added %u transactions to %s template\n",
+                pstate->block.vtx.size() - nTxBefore, fProofOfStake ? "proof-of-stake" : "proof-of-work");
+        }
+    }
+
+    if (!fProofOfStake)
+        NotifyWork(*pstate);
+
+    if (pFees)
+        *pFees = pstate->assembly.nFees;
+    if (ppindexPrev)
+        *ppindexPrev = pstate->assembly.pindexPrev;
+    return pstate->ptemplate;
+}
 
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+void CBlockTemplateManager::NotifyWork(const CTemplateState& state)
+{
+    bool fChanged;
+    {
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        fChanged = (state.block.hashPrevBlock != hashNotifiedPrev || state.assembly.nFees != nNotifiedFees);
+        hashNotifiedPrev = state.block.hashPrevBlock;
+        nNotifiedFees = state.assembly.nFees;
+        nNotifiedTxUpdates = state.nTransactionsUpdated;
+        nNotifiedTime = state.nTimeUpdated;
+    }
+    if (fChanged)
+        cvBlockChange.notify_all();
+}
 
-            if (fDebug && GetBoolArg("-printpriority", false))
+void CBlockTemplateManager::WaitForChange(CReserveKey& reservekey, const uint256& hashPrevBlock, int64_t nFees, int64_t nMinIncrease, int64_t nTimeGiveUp)
+{
+    int64_t nNextRefresh = 0;
+    boost::unique_lock<boost::mutex> lock(csBestBlock);
+    while (!ShutdownRequested() && hashBestBlockNotified == hashPrevBlock)
+    {
+        int64_t nNow = GetTime();
+        bool fCurrent = (hashNotifiedPrev == hashPrevBlock);
+        if (fCurrent && nNotifiedFees >= nFees + nMinIncrease)
+            return;
+        if (fCurrent && nNotifiedFees != nFees && nNow >= nTimeGiveUp)
+            return;
+
+        // The template misses transactions the pool accepted since it was
+        // built; GetTemplate would not add them sooner than this either
+        bool fStale = (!fCurrent || nNotifiedTxUpdates != nTxUpdatesNotified);
+        int64_t nRefresh = max(nNextRefresh, fCurrent ? nNotifiedTime + TEMPLATE_UPDATE_INTERVAL : 0);
+        if (fStale && !fLongPollRefresh && nNow >= nRefresh)
+        {
+            fLongPollRefresh = true;
+            lock.unlock();
+            try
             {
-                LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString());
+                GetTemplate(reservekey, false);
             }
-
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
+            catch (...)
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
+                lock.lock();
+                fLongPollRefresh = false;
+                throw;
             }
+            lock.lock();
+            fLongPollRefresh = false;
+            nNextRefresh = nNow + TEMPLATE_UPDATE_INTERVAL;
+            // Another waiter may be owed a refresh this one did not cover
+            cvBlockChange.notify_all();
+            continue;
         }
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
+        // Sleep until signalled, or until the next refresh or giving up is due
+        int64_t nWake = 0;
+        if (fStale && !fLongPollRefresh)
+            nWake = nRefresh;
+        if (nNow < nTimeGiveUp && (nWake == 0 || nTimeGiveUp < nWake))
+            nWake = nTimeGiveUp;
+        if (nWake == 0)
+            cvBlockChange.wait(lock);
+        else
+            cvBlockChange.timed_wait(lock, boost::get_system_time() + boost::posix_time::seconds(nWake - nNow));
+    }
+}
 
-        if (fDebug && GetBoolArg("-printpriority", false))
-            LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
+void CBlockTemplateManager::CreateWork(const boost::shared_ptr<const CBlock>& ptemplate, CBlockIndex* pindexPrev, CBlock& block)
+{
+    LOCK(cs);
 
-        if (!fProofOfStake)
-            pblock->vtx[0].vout[0].nValue = GetProofOfWorkReward(nHeight, nFees);
+    // Work on an old tip can never be accepted
+    if (ptemplate->hashPrevBlock != hashWorkPrevBlock)
+    {
+        mapWork.clear();
+        vWorkOrder.clear();
+        hashWorkPrevBlock = ptemplate->hashPrevBlock;
+    }
 
-        if (pFees)
-            *pFees = nFees;
+    block = *ptemplate;
+    block.UpdateTime(pindexPrev);
+    block.nNonce = 0;
+    IncrementExtraNonce(&block, pindexPrev, nExtraNonce);
 
-        // Fill in header
-        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-        pblock->nTime          = max(pindexPrev->GetPastTimeLimit()+1, pblock->GetMaxTransactionTime());
-        if (!fProofOfStake)
-            pblock->UpdateTime(pindexPrev);
-        pblock->nNonce         = 0;
+    if (mapWork.insert(make_pair(block.hashMerkleRoot, make_pair(ptemplate, block.vtx[0].vin[0].scriptSig))).second)
+        vWorkOrder.push_back(block.hashMerkleRoot);
+    while (vWorkOrder.size() > MAX_WORK_TEMPLATES)
+    {
+        mapWork.erase(vWorkOrder.front());
+        vWorkOrder.pop_front();
     }
+}
 
-    return pblock.release();
+bool CBlockTemplateManager::GetWork(const uint256& hashMerkleRoot, CBlock& block)
+{
+    LOCK(cs);
+
+    map<uint256, pair<boost::shared_ptr<const CBlock>, CScript> >::const_iterator mi = mapWork.find(hashMerkleRoot);
+    if (mi == mapWork.end())
+        return false;
+    block = *mi->second.first;
+    block.vtx[0].vin[0].scriptSig = mi->second.second;
+    return true;
 }
 
+std::string CBlockTemplateManager::GetLongPollId(const CBlock& block, int64_t nFees)
+{
+    return block.hashPrevBlock.GetHex() + i64tostr(nFees);
+}
 
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
@@ -554,9 +914,10 @@ void ThreadStakeMiner(CWallet *pwallet)
         // Create new block
         //
         int64_t nFees;
-        auto_ptr<CBlock> pblock(CreateNewBlock(reservekey, true, &nFees));
-        if (!pblock.get())
+        boost::shared_ptr<const CBlock> ptemplate = templateManager.GetTemplate(reservekey, true, &nFees);
+        if (!ptemplate)
             return;
+        auto_ptr<CBlock> pblock(new CBlock(*ptemplate));
 
         // Trying to sign a block
         if (pblock->SignBlock(*pwallet, nFees))
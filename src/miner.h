@@ -9,6 +9,17 @@
 #include "main.h"
 #include "wallet.h"
 
+#include <deque>
+
+#include <boost/shared_ptr.hpp>
+
+/** Rebuild a template from scratch at most this often (seconds) while the tip is unchanged */
+static const int64_t TEMPLATE_REBUILD_INTERVAL = 60;
+/** Append newly arrived transactions to a template at most this often (seconds) */
+static const int64_t TEMPLATE_UPDATE_INTERVAL = 1;
+/** Number of getwork jobs whose solutions are still accepted */
+static const unsigned int MAX_WORK_TEMPLATES = 500;
+
 /* Generate a new block, without valid proof-of-work */
 CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake=false, int64_t* pFees = 0);
 
@@ -24,6 +35,69 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 /** Check mined proof-of-stake block */
 bool CheckStake(CBlock* pblock, CWallet& wallet);
 
+/**
+ * Block templates shared by the mining RPCs and the staking thread.
+ *
+ * One proof-of-work and one proof-of-stake template are kept for the current
+ * tip. Templates handed out are immutable; transactions that enter the pool
+ * are appended to a fresh copy, and the whole template is rebuilt when the
+ * tip changes or TEMPLATE_REBUILD_INTERVAL has passed. Work handed out by
+ * getwork is remembered by merkle root, up to MAX_WORK_TEMPLATES jobs, so
+ * solutions can be matched to their template.
+ *
+ * GetTemplate takes cs_main and mempool.cs before cs, and csBestBlock last.
+ * Callers must not hold cs while they take cs_main.
+ */
+class CBlockTemplateManager
+{
+private:
+    struct CTemplateState;
+
+    CCriticalSection cs;
+    boost::shared_ptr<CTemplateState> pstateWork;
+    boost::shared_ptr<CTemplateState> pstateStake;
+
+    unsigned int nExtraNonce;
+    uint256 hashWorkPrevBlock;
+    std::map<uint256, std::pair<boost::shared_ptr<const CBlock>, CScript> > mapWork;
+    std::deque<uint256> vWorkOrder;
+
+    // Newest proof-of-work template as long polls see it, under csBestBlock
+    uint256 hashNotifiedPrev;
+    int64_t nNotifiedFees;
+    unsigned int nNotifiedTxUpdates;
+    int64_t nNotifiedTime;
+    bool fLongPollRefresh; // a long poll is bringing the template up to date
+
+    void NotifyWork(const CTemplateState& state);
+
+public:
+    CBlockTemplateManager();
+
+    /** Current template on pindexBest, NULL if one could not be created */
+    boost::shared_ptr<const CBlock> GetTemplate(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFees = NULL, CBlockIndex** ppindexPrev = NULL);
+
+    /** Copy ptemplate into block with a fresh extranonce and time, and remember it */
+    void CreateWork(const boost::shared_ptr<const CBlock>& ptemplate, CBlockIndex* pindexPrev, CBlock& block);
+
+    /** Block handed out by CreateWork with the given merkle root, without nTime/nNonce */
+    bool GetWork(const uint256& hashMerkleRoot, CBlock& block);
+
+    /**
+     * Wait for a getblocktemplate long poll until the tip is no longer
+     * hashPrevBlock, the proof-of-work template earns nMinIncrease more than
+     * nFees, or nTimeGiveUp has passed and its fees changed at all. Holds no
+     * lock but csBestBlock while waiting; pool changes are folded into the
+     * template by one waiter at a time, at most every TEMPLATE_UPDATE_INTERVAL.
+     */
+    void WaitForChange(CReserveKey& reservekey, const uint256& hashPrevBlock, int64_t nFees, int64_t nMinIncrease, int64_t nTimeGiveUp);
+
+    /** Identifies the tip and fees of a template for getblocktemplate long polling */
+    static std::string GetLongPollId(const CBlock& block, int64_t nFees);
+};
+
+extern CBlockTemplateManager templateManager;
+
 /** Base sha256 mining transform */
 void SHA256Transform(void* pstate, void* pinput, const void* pinit);
 
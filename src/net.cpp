@@ -7,11 +7,15 @@
 #include "db.h"
 #include "net.h"
 #include "main.h"
+#include "txmempool.h"
 #include "addrman.h"
 #include "ui_interface.h"
+#include "netpoll.h"
 
 #ifdef WIN32
 #include <string.h>
+#else
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -21,6 +25,8 @@
 #include <miniupnpc/upnperrors.h>
 #endif
 
+#include <boost/scoped_ptr.hpp>
+
 // Dump addresses to peers.dat every 15 minutes (900s)
 #define DUMP_ADDRESSES_INTERVAL 900
 
@@ -54,10 +60,12 @@ CAddrMan addrman;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+static CSocketPoller* pSocketPoller = NULL;
+static void RegisterSocket(CNode* pnode);
+map<CInv, CSharedMessage> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
-map<CInv, int64_t> mapAlreadyAskedFor;
+boost::unordered_map<CInv, int64_t, SaltedInvHasher> mapAlreadyAskedFor;
 
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
@@ -308,10 +316,17 @@ void AddressCurrentlyConnected(const CService& addr)
 }
 
 
+NodeId CNode::nLastNodeId = 0;
+CCriticalSection CNode::cs_nLastNodeId;
+
 uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+uint64_t CNode::nMaxOutboundLimit = 0;
+int64_t CNode::nMaxOutboundCycleStart = 0;
+uint64_t CNode::nMaxOutboundBytesInCycle = 0;
+std::map<CNetAddr, uint64_t> CNode::mapHistoricalBytesInCycle;
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -393,6 +408,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        RegisterSocket(pnode);
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -411,6 +427,8 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrint("net", "disconnecting node %s\n", addrName);
+        if (pSocketPoller)
+            pSocketPoller->Remove(hSocket);
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
     }
@@ -494,6 +512,7 @@ bool CNode::Misbehaving(int howmuch)
 #define X(name) stats.name = name
 void CNode::copyStats(CNodeStats &stats)
 {
+    stats.nodeid = this->id;
     X(nServices);
     X(nLastSend);
     X(nLastRecv);
@@ -525,6 +544,15 @@ void CNode::copyStats(CNodeStats &stats)
     
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    {
+        LOCK(cs_vSend);
+        stats.nSendQueueSize = vSendMsg.size() + vSendMsgBulk.size();
+        stats.nSendQueueBytes = nSendSize;
+        stats.nSendQueueMax = nSendQueueMax;
+    }
+    netStats.GetCommandCounts(stats.vCommandCounts);
+    netStats.GetQueueCounts(stats.queueCounts);
 }
 #undef X
 
@@ -554,12 +582,62 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         nBytes -= handled;
 
         if (msg.complete())
-            msg.nTime = GetTimeMicros();
+            msg.Complete();
     }
 
     return true;
 }
 
+// Receive buffers are kept for reuse in power of two size classes, so a
+// steady stream of messages doesn't allocate, and a reused buffer isn't
+// zeroed by CSerializeData's allocator on every release. Buffers larger
+// than RECV_BUFFER_POOL_MAX, those past RECV_BUFFER_POOL_DEPTH in their
+// class, and those a message outgrows are still freed, and so zeroed:
+// vRecv is a CDataStream, which always uses the zeroing allocator.
+static CCriticalSection cs_recvBufferPool;
+static vector<CSerializeData> vRecvBufferPool[21];
+
+static unsigned int RecvBufferClass(size_t nSize)
+{
+    unsigned int nClass = 10; // 1 KiB is the smallest
+    while (((size_t)1 << nClass) < nSize)
+        nClass++;
+    return nClass;
+}
+
+static void GetRecvBuffer(size_t nSize, CSerializeData& buf)
+{
+    unsigned int nClass = RecvBufferClass(min(nSize, (size_t)RECV_BUFFER_POOL_MAX));
+    {
+        LOCK(cs_recvBufferPool);
+        if (!vRecvBufferPool[nClass].empty())
+        {
+            buf.swap(vRecvBufferPool[nClass].back());
+            vRecvBufferPool[nClass].pop_back();
+            return;
+        }
+    }
+    buf.reserve((size_t)1 << nClass);
+}
+
+static void ReleaseRecvBuffer(CSerializeData& buf)
+{
+    // Only whole size classes go back, so a buffer always fits its class
+    size_t nCapacity = buf.capacity();
+    if (nCapacity < 1024 || nCapacity > RECV_BUFFER_POOL_MAX)
+        return;
+    unsigned int nClass = RecvBufferClass(nCapacity);
+    if (((size_t)1 << nClass) != nCapacity)
+        nClass--;
+    buf.clear();
+    LOCK(cs_recvBufferPool);
+    if (vRecvBufferPool[nClass].size() < RECV_BUFFER_POOL_DEPTH)
+    {
+        vRecvBufferPool[nClass].push_back(CSerializeData());
+        vRecvBufferPool[nClass].back().swap(buf);
+    }
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -588,6 +666,15 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     // switch state to reading message data
     in_data = true;
 
+    // Take a buffer the size of the message, up to RECV_BUFFER_POOL_MAX;
+    // past that it only grows as the data actually arrives
+    if (hdr.nMessageSize > 0)
+    {
+        CSerializeData buf;
+        GetRecvBuffer(hdr.nMessageSize, buf);
+        vRecv.SwapBuffer(buf);
+    }
+
     return nCopy;
 }
 
@@ -596,17 +683,29 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
-    }
-
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    vRecv.write(pch, nCopy);
     nDataPos += nCopy;
 
+    // Checksum as the data comes in, while it is still in cache
+    hasher.write(pch, nCopy);
+
     return nCopy;
 }
 
+void CNetMessage::Complete()
+{
+    nTime = GetTimeMicros();
+    uint256 hash = hasher.GetHash();
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+}
+
+void CNetMessage::ReleaseBuffer()
+{
+    CSerializeData buf;
+    vRecv.SwapBuffer(buf);
+    ReleaseRecvBuffer(buf);
+}
+
 
 
 
@@ -615,25 +714,74 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+void FinalizeMessageHeader(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    int64_t nNow = 0;
 
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
+    while (!pnode->vSendMsg.empty()) {
+        assert(pnode->vSendMsg.front().msg->size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData &data = *pnode->vSendMsg.front().msg;
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Hand the kernel as many queued messages as it takes in one call
+        struct iovec iov[MAX_SEND_IOV];
+        int nIov = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CQueuedMessage>::iterator itIov = pnode->vSendMsg.begin(); itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV; itIov++, nIov++) {
+            iov[nIov].iov_base = (void*)&(*itIov->msg)[nOffset];
+            iov[nIov].iov_len = itIov->msg->size() - nOffset;
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            // Drop the messages that went out completely
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                const CQueuedMessage& queued = pnode->vSendMsg.front();
+                size_t nRemaining = queued.msg->size() - pnode->nSendOffset;
+                if (nLeft < nRemaining) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRemaining;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
-                it++;
-            } else {
+                pnode->nSendSize -= queued.msg->size();
+                if (nNow == 0)
+                    nNow = GetTimeMicros();
+                pnode->netStats.RecordQueueTime(nNow - queued.nTimeQueued);
+                netStatsTotal.RecordQueueTime(nNow - queued.nTimeQueued);
+                pnode->vSendMsg.pop_front();
+                // Bulk data goes out once everything else has
+                if (pnode->vSendMsg.empty() && !pnode->vSendMsgBulk.empty()) {
+                    pnode->vSendMsg.push_back(pnode->vSendMsgBulk.front());
+                    pnode->vSendMsgBulk.pop_front();
+                }
+            }
+            if (pnode->nSendOffset != 0) {
                 // could not send full message; stop sending more
                 break;
             }
@@ -652,218 +800,367 @@ void SocketSendData(CNode *pnode)
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->vSendMsg.empty()) {
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
 static list<CNode*> vNodesDisconnected;
 
+// A message handler thread's work: nodes with a complete message waiting,
+// in the order they got one, and whether to visit all its nodes now. Each
+// node is pinned to one handler so its messages are handled in order.
+struct CMessageHandlerQueue
+{
+    deque<CNode*> vNodesRunnable;
+    bool fRoundRequested;
+    CWaitableCriticalSection cs;
+    CConditionVariable cv;
+
+    CMessageHandlerQueue() : fRoundRequested(false) { }
+};
+static CMessageHandlerQueue messageHandlers[MAX_MESSAGE_HANDLER_THREADS];
+static int nMessageHandlerThreads = 1;
+
+static CMessageHandlerQueue& GetMessageHandler(const CNode* pnode)
+{
+    return messageHandlers[pnode->id % nMessageHandlerThreads];
+}
+
+void WakeMessageHandler(CNode* pnode)
+{
+    CMessageHandlerQueue& handler = GetMessageHandler(pnode);
+    {
+        boost::unique_lock<boost::mutex> lock(handler.cs);
+        if (pnode->fRunnable)
+            return;
+        pnode->fRunnable = true;
+        handler.vNodesRunnable.push_back(pnode);
+    }
+    handler.cv.notify_one();
+}
+
+void RequestMessageHandlerRound()
+{
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+    {
+        CMessageHandlerQueue& handler = messageHandlers[i];
+        {
+            boost::unique_lock<boost::mutex> lock(handler.cs);
+            handler.fRoundRequested = true;
+        }
+        handler.cv.notify_one();
+    }
+}
+
+// Nodes left with queued data by an optimistic write, for the socket thread
+// to register write interest for
+static vector<CNode*> vNodesWantSend;
+static CCriticalSection cs_vNodesWantSend;
+
+void RequestSendInterest(CNode* pnode)
+{
+    pnode->fSendQueued = true;
+    {
+        LOCK(cs_vNodesWantSend);
+        vNodesWantSend.push_back(pnode);
+    }
+    if (pSocketPoller)
+        pSocketPoller->Wake();
+}
+
+// Add a new node's socket to the poller
+static void RegisterSocket(CNode* pnode)
+{
+    if (!pSocketPoller)
+        return;
+    LOCK(pnode->cs_vSend);
+    if (pnode->hSocket == INVALID_SOCKET)
+        return;
+    pnode->fSendInterest = !pnode->vSendMsg.empty();
+    pSocketPoller->Set(pnode->hSocket, pnode, pnode->fSendInterest);
+}
+
+// Accept one connection on hListenSocket; false once there are none left
+static bool AcceptConnection(SOCKET hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %d\n", nErr);
+        return false;
+    }
+
+    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+        LogPrintf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+    {
+        closesocket(hSocket);
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        closesocket(hSocket);
+    }
+    else
+    {
+        LogPrint("net", "accepted connection %s\n", addr.ToString());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+        RegisterSocket(pnode);
+    }
+    return true;
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    int64_t nNextHousekeeping = 0;
+    // Nodes reported ready that haven't been read or written up to
+    // EWOULDBLOCK yet; the epoll backend won't report them again until then
+    set<CNode*> setReady;
+    bool fProgress = false;
+    vector<CSocketEvent> vEvents;
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        pSocketPoller->Set(hListenSocket, NULL, false);
 
     while (true)
     {
-        //
-        // Disconnect nodes
-        //
+        if (GetTimeMillis() >= nNextHousekeeping)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            nNextHousekeeping = GetTimeMillis() + SOCKET_HOUSEKEEPING_INTERVAL;
+
+            //
+            // Disconnect nodes
+            //
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
+                LOCK(cs_vNodes);
+                // Disconnect unused nodes
+                vector<CNode*> vNodesCopy = vNodes;
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                    if (pnode->fDisconnect ||
+                        (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
+                    {
+                        // remove from vNodes
+                        vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                        setReady.erase(pnode);
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                        // release outbound grant (if any)
+                        pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                        // close socket and cleanup
+                        pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
+                        // hold in disconnected pool until all refs are released
+                        if (pnode->fNetworkNode || pnode->fInbound)
+                            pnode->Release();
+                        vNodesDisconnected.push_back(pnode);
+                    }
                 }
             }
-        }
-        {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                // Delete disconnected nodes
+                list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+                BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
                 {
-                    bool fDelete = false;
+                    // wait until threads are done using it
+                    if (pnode->GetRefCount() <= 0)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        bool fDelete = false;
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
+                            TRY_LOCK(pnode->cs_vSend, lockSend);
+                            if (lockSend && !pnode->fSendQueued)
                             {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
+                                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                                if (lockRecv)
+                                {
+                                    TRY_LOCK(pnode->cs_inventory, lockInv);
+                                    if (lockInv)
+                                        fDelete = true;
+                                }
                             }
                         }
+                        if (fDelete)
+                        {
+                            // The message handler may have picked it up meanwhile
+                            boost::unique_lock<boost::mutex> lock(GetMessageHandler(pnode).cs);
+                            if (pnode->fRunnable || pnode->GetRefCount() > 0)
+                                fDelete = false;
+                        }
+                        if (fDelete)
+                        {
+                            vNodesDisconnected.remove(pnode);
+                            g_signals.FinalizeNode(pnode->id);
+                            delete pnode;
+                        }
+                    }
+                }
+            }
+            if(vNodes.size() != nPrevNodeCount) {
+                nPrevNodeCount = vNodes.size();
+                uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+            }
+
+            //
+            // Inactivity checking
+            //
+            int64_t nTime = GetTime();
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+            {
+                if (nTime - pnode->nTimeConnected > 60)
+                {
+                    if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+                    {
+                        LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+                        pnode->fDisconnect = true;
+                    }
+                    else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+                    {
+                        LogPrintf("socket sending timeout: %ds\n", nTime - pnode->nLastSend);
+                        pnode->fDisconnect = true;
+                    }
+                    else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+                    {
+                        LogPrintf("socket receive timeout: %ds\n", nTime - pnode->nLastRecv);
+                        pnode->fDisconnect = true;
                     }
-                    if (fDelete)
+                    else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
                     {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                        LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+                        pnode->fDisconnect = true;
                     }
                 }
             }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
-        }
 
 
         //
-        // Find which sockets have data to receive
+        // Register write interest for nodes that queued data
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
+        vector<CNode*> vWantSend;
+        {
+            LOCK(cs_vNodesWantSend);
+            vWantSend.swap(vNodesWantSend);
         }
+        BOOST_FOREACH(CNode* pnode, vWantSend)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
+            LOCK(pnode->cs_vSend);
+            pnode->fSendQueued = false;
+            if (pnode->hSocket != INVALID_SOCKET && !pnode->vSendMsg.empty() && !pnode->fSendInterest)
             {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend) {
-                        // do not read, if draining write queue
-                        if (!pnode->vSendMsg.empty())
-                            FD_SET(pnode->hSocket, &fdsetSend);
-                        else
-                            FD_SET(pnode->hSocket, &fdsetRecv);
-                        FD_SET(pnode->hSocket, &fdsetError);
-                        hSocketMax = max(hSocketMax, pnode->hSocket);
-                        have_fds = true;
-                    }
-                }
+                pnode->fSendInterest = true;
+                pSocketPoller->Set(pnode->hSocket, pnode, true);
             }
         }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+
+        //
+        // Wait for sockets to become ready
+        //
+        // Don't sleep while there is work left from the last round; retry
+        // soon if it was held up by a lock or a full send queue
+        int64_t nWait = setReady.empty() ? SOCKET_HOUSEKEEPING_INTERVAL : (fProgress ? 0 : 10);
+        nWait = min(nWait, max(nNextHousekeeping - GetTimeMillis(), (int64_t)0));
+        vEvents.clear();
+        if (!pSocketPoller->Wait(nWait, vEvents))
+            MilliSleep(nWait);
         boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
+        bool fListenReady = false;
+        BOOST_FOREACH(const CSocketEvent& event, vEvents)
         {
-            if (have_fds)
+            if (!event.ptr)
             {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                fListenReady = true;
+                continue;
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+            CNode* pnode = (CNode*)event.ptr;
+            if (event.fRecv || event.fError)
+                pnode->fPollRecv = true;
+            if (event.fSend)
+                pnode->fPollSend = true;
+            setReady.insert(pnode);
         }
 
 
         //
         // Accept new connections
         //
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (fListenReady)
         {
-            struct sockaddr_storage sockaddr;
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                while (hListenSocket != INVALID_SOCKET && AcceptConnection(hListenSocket))
+                    boost::this_thread::interruption_point();
+        }
 
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    LogPrintf("Warning: Unknown socket family\n");
 
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
+        //
+        // Service each ready socket
+        //
+        fProgress = false;
+        set<CNode*>::iterator it = setReady.begin();
+        while (it != setReady.end())
+        {
+            boost::this_thread::interruption_point();
+            CNode* pnode = *it;
 
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    LogPrintf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
-            {
-                closesocket(hSocket);
-            }
-            else if (CNode::IsBanned(addr))
+            if (pnode->hSocket == INVALID_SOCKET)
             {
-                LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                closesocket(hSocket);
+                pnode->fPollRecv = pnode->fPollSend = false;
+                setReady.erase(it++);
+                continue;
             }
-            else
+
+            //
+            // Send
+            //
+            if (pnode->fPollSend)
             {
-                LogPrint("net", "accepted connection %s\n", addr.ToString());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend)
                 {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
+                    uint64_t nSendBytes = pnode->nSendBytes;
+                    SocketSendData(pnode);
+                    if (pnode->nSendBytes != nSendBytes)
+                        fProgress = true;
+                    // SocketSendData stops at EWOULDBLOCK or an empty queue
+                    pnode->fPollSend = false;
+                    if (pnode->vSendMsg.empty() && pnode->fSendInterest && pnode->hSocket != INVALID_SOCKET)
+                    {
+                        pnode->fSendInterest = false;
+                        pSocketPoller->Set(pnode->hSocket, pnode, false);
+                    }
                 }
             }
-        }
-
-
-        //
-        // Service each socket
-        //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
-        {
-            boost::this_thread::interruption_point();
 
             //
             // Receive
             //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            // do not read, if draining write queue
+            if (pnode->fPollRecv && pnode->nSendSize == 0 && pnode->hSocket != INVALID_SOCKET)
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
@@ -872,6 +1169,7 @@ void ThreadSocketHandler()
                         if (!pnode->fDisconnect)
                             LogPrintf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
                         pnode->CloseSocketDisconnect();
+                        pnode->fPollRecv = false;
                     }
                     else {
                         // typical socket buffer is 8K-64K
@@ -881,9 +1179,16 @@ void ThreadSocketHandler()
                         {
                             if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
                                 pnode->CloseSocketDisconnect();
+                            else if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete())
+                                WakeMessageHandler(pnode);
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                             pnode->RecordBytesRecv(nBytes);
+                            fProgress = true;
+                            // A short read emptied the socket buffer, more
+                            // data will be a new edge
+                            if (nBytes < (int)sizeof(pchBuf))
+                                pnode->fPollRecv = false;
                         }
                         else if (nBytes == 0)
                         {
@@ -891,6 +1196,7 @@ void ThreadSocketHandler()
                             if (!pnode->fDisconnect)
                                 LogPrint("net", "socket closed\n");
                             pnode->CloseSocketDisconnect();
+                            pnode->fPollRecv = false;
                         }
                         else if (nBytes < 0)
                         {
@@ -902,55 +1208,16 @@ void ThreadSocketHandler()
                                     LogPrintf("socket recv error %d\n", nErr);
                                 pnode->CloseSocketDisconnect();
                             }
+                            pnode->fPollRecv = false;
                         }
                     }
                 }
             }
 
-            //
-            // Send
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
-            }
-
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %ds\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %ds\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
-        }
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            if (!pnode->fPollRecv && !pnode->fPollSend)
+                setReady.erase(it++);
+            else
+                ++it;
         }
     }
 }
@@ -1132,11 +1399,17 @@ void DumpAddresses()
 {
     int64_t nStart = GetTimeMillis();
 
+    // Serialize and write a copy, so connecting and address relay don't
+    // wait on addrman while peers.dat is written
+    boost::scoped_ptr<CAddrMan> paddrSnapshot(new CAddrMan());
+    addrman.GetSnapshot(*paddrSnapshot);
+    int64_t nSnapshot = GetTimeMillis() - nStart;
+
     CAddrDB adb;
-    adb.Write(addrman);
+    adb.Write(*paddrSnapshot);
 
-    LogPrint("net", "Flushed %d addresses to peers.dat  %dms\n",
-           addrman.size(), GetTimeMillis() - nStart);
+    LogPrint("net", "Flushed %d addresses to peers.dat  %dms (%dms copying)\n",
+           addrman.size(), GetTimeMillis() - nStart, nSnapshot);
 }
 
 void static ProcessOneShot()
@@ -1395,11 +1668,107 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
-void ThreadMessageHandler()
+// Handle pnode's messages for up to MESSAGE_HANDLER_PEER_BUDGET ms, then send
+// what it has coming. Returns true if it has more complete messages.
+static bool ProcessNodeMessages(CNode* pnode)
+{
+    bool fMore = false;
+    {
+        LOCK(pnode->cs_vRecvMsg);
+        int64_t nStart = GetTimeMillis();
+        while (true)
+        {
+            size_t nMsgs = pnode->vRecvMsg.size(), nGetData = pnode->vRecvGetData.size();
+            size_t nOrphanWork = pnode->setOrphanWork.size(), nTxVerify = pnode->vTxVerify.size();
+            if (!g_signals.ProcessMessages(pnode))
+            {
+                pnode->CloseSocketDisconnect();
+                break;
+            }
+            boost::this_thread::interruption_point();
+
+            // Stop when it is waiting on something else: a full send
+            // buffer, a partial message or transaction verification
+            if (pnode->vRecvMsg.size() == nMsgs && pnode->vRecvGetData.size() == nGetData &&
+                pnode->setOrphanWork.size() == nOrphanWork && pnode->vTxVerify.size() == nTxVerify)
+                break;
+            if (pnode->fDisconnect || pnode->nSendSize >= SendBufferSize())
+                break;
+            if (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete())
+                break;
+            if (GetTimeMillis() - nStart >= MESSAGE_HANDLER_PEER_BUDGET)
+            {
+                fMore = true;
+                break;
+            }
+        }
+    }
+
+    {
+        LOCK(pnode->cs_vSend);
+        g_signals.SendMessages(pnode, false);
+    }
+    return fMore;
+}
+
+void ThreadMessageHandler(int nHandler)
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    CMessageHandlerQueue& handler = messageHandlers[nHandler];
+    int64_t nNextRound = 0;
+    unsigned int nRound = nHandler;
     while (true)
     {
+        // Sleep until a node has a message, a round is asked for or due
+        bool fRound = false;
+        {
+            boost::unique_lock<boost::mutex> lock(handler.cs);
+            int64_t nWait = nNextRound - GetTimeMillis();
+            if (handler.vNodesRunnable.empty() && !handler.fRoundRequested && nWait > 0)
+                handler.cv.timed_wait(lock, boost::posix_time::milliseconds(nWait));
+            if (handler.fRoundRequested || GetTimeMillis() >= nNextRound)
+            {
+                fRound = true;
+                handler.fRoundRequested = false;
+            }
+        }
+        boost::this_thread::interruption_point();
+
+        //
+        // Runnable nodes, in turn
+        //
+        vector<CNode*> vRunnable;
+        {
+            LOCK(cs_vNodes);
+            boost::unique_lock<boost::mutex> lock(handler.cs);
+            vRunnable.assign(handler.vNodesRunnable.begin(), handler.vNodesRunnable.end());
+            handler.vNodesRunnable.clear();
+            BOOST_FOREACH(CNode* pnode, vRunnable) {
+                pnode->fRunnable = false;
+                pnode->AddRef();
+            }
+        }
+        BOOST_FOREACH(CNode* pnode, vRunnable)
+        {
+            if (!pnode->fDisconnect && ProcessNodeMessages(pnode))
+                WakeMessageHandler(pnode);
+        }
+        if (!vRunnable.empty())
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vRunnable)
+                pnode->Release();
+        }
+
+        if (!fRound)
+            continue;
+
+        //
+        // Every node of this handler: trickle relay, pings, requests, and
+        // messages left behind by a full send buffer or transaction
+        // verification
+        //
+        nNextRound = GetTimeMillis() + MESSAGE_HANDLER_ROUND_INTERVAL;
         bool fHaveSyncNode = false;
 
         vector<CNode*> vNodesCopy;
@@ -1413,17 +1782,19 @@ void ThreadMessageHandler()
             }
         }
 
-        if (!fHaveSyncNode)
+        if (nHandler == 0 && !fHaveSyncNode)
             StartSync(vNodesCopy);
 
-        // Poll the connected nodes for messages
+        // Handlers take turns picking the trickle node
+        vector<CNode*> vOwnNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (&GetMessageHandler(pnode) == &handler)
+                vOwnNodes.push_back(pnode);
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+        if (!vOwnNodes.empty() && nRound++ % nMessageHandlerThreads == 0)
+            pnodeTrickle = vOwnNodes[GetRand(vOwnNodes.size())];
 
-        bool fSleep = true;
-
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        BOOST_FOREACH(CNode* pnode, vOwnNodes)
         {
             if (pnode->fDisconnect)
                 continue;
@@ -1438,9 +1809,9 @@ void ThreadMessageHandler()
 
                     if (pnode->nSendSize < SendBufferSize())
                     {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                        if (!pnode->vRecvGetData.empty() || !pnode->setOrphanWork.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                         {
-                            fSleep = false;
+                            WakeMessageHandler(pnode);
                         }
                     }
                 }
@@ -1461,9 +1832,6 @@ void ThreadMessageHandler()
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->Release();
         }
-
-        if (fSleep)
-            MilliSleep(100);
     }
 }
 
@@ -1656,6 +2024,11 @@ void StartNode(boost::thread_group& threadGroup)
 #endif
 
     // Send and receive from sockets, accept connections
+    if (!pSocketPoller)
+    {
+        pSocketPoller = CSocketPoller::Create();
+        LogPrintf("Using %s for network sockets\n", pSocketPoller->GetName());
+    }
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -1664,8 +2037,11 @@ void StartNode(boost::thread_group& threadGroup)
     // Initiate outbound connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
-    // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    // Process messages, each peer on one of the handler threads
+    nMessageHandlerThreads = max(1, min((int)GetArg("-msghandlerthreads", 1), MAX_MESSAGE_HANDLER_THREADS));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand",
+                                              boost::function<void()>(boost::bind(&ThreadMessageHandler, i))));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1700,6 +2076,9 @@ public:
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     LogPrintf("closesocket(hListenSocket) failed with error %d\n", WSAGetLastError());
 
+        delete pSocketPoller;
+        pSocketPoller = NULL;
+
 #ifdef WIN32
         // Shutdown Windows Sockets
         WSACleanup();
@@ -1728,8 +2107,10 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved,
+        // as a complete message that getdata replies share
+        if (!mapRelay.count(inv))
+            mapRelay.insert(std::make_pair(inv, MakeSharedMessage("tx", ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
 
@@ -1746,6 +2127,76 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+
+    int64_t nNow = GetTime();
+    if (nMaxOutboundCycleStart + MAX_UPLOAD_TIMEFRAME < nNow)
+    {
+        // Start a new cycle
+        nMaxOutboundCycleStart = nNow;
+        nMaxOutboundBytesInCycle = 0;
+        mapHistoricalBytesInCycle.clear();
+    }
+    nMaxOutboundBytesInCycle += bytes;
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t nLimit)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundLimit = nLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+int64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+    if (nMaxOutboundCycleStart == 0)
+        return MAX_UPLOAD_TIMEFRAME;
+    return max((int64_t)0, nMaxOutboundCycleStart + MAX_UPLOAD_TIMEFRAME - GetTime());
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+    return nMaxOutboundBytesInCycle >= nMaxOutboundLimit ? 0 : nMaxOutboundLimit - nMaxOutboundBytesInCycle;
+}
+
+bool CNode::OutboundTargetReached(bool fHistorical)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    uint64_t nReserve = 0;
+    if (fHistorical)
+        nReserve = nMaxOutboundLimit / 100 * UPLOAD_TARGET_RELAY_SHARE * GetMaxOutboundTimeLeftInCycle() / MAX_UPLOAD_TIMEFRAME;
+    return nMaxOutboundBytesInCycle + nReserve >= nMaxOutboundLimit;
+}
+
+bool CNode::ServeHistoricalBlock(const CNetAddr& addr, uint64_t nBytes)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return true;
+    if (OutboundTargetReached(true))
+        return false;
+
+    // What historical blocks may use is split evenly between the peers
+    // they went to in this cycle; everyone gets at least one block
+    uint64_t& nServed = mapHistoricalBytesInCycle[addr];
+    uint64_t nShare = nMaxOutboundLimit / 100 * (100 - UPLOAD_TARGET_RELAY_SHARE) / mapHistoricalBytesInCycle.size();
+    if (nServed > 0 && nServed + nBytes > nShare)
+        return false;
+    nServed += nBytes;
+    return true;
 }
 
 uint64_t CNode::GetTotalBytesRecv()
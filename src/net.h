@@ -7,6 +7,8 @@
 
 #include <deque>
 #include <boost/array.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 #include <boost/foreach.hpp>
 #include <boost/signals2/signal.hpp>
 #include <openssl/rand.h>
@@ -16,21 +18,45 @@
 #include <arpa/inet.h>
 #endif
 
-#include "mruset.h"
+#include "bloom.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "addrman.h"
 #include "hash.h"
+#include "netstats.h"
 
 class CNode;
 class CBlockIndex;
+class CTxVerifyJob;
+class CPartialBlock;
 extern int nBestHeight;
 
+typedef int NodeId;
+
 
 /** Time between pings automatically sent out for latency probing and keepalive (in seconds). */
 static const int PING_INTERVAL = 2 * 60;
 /** Time after which to disconnect, after waiting for a ping response (or inactivity). */
 static const int TIMEOUT_INTERVAL = 20 * 60;
+/** Milliseconds between disconnect and inactivity sweeps of the socket thread */
+static const int64_t SOCKET_HOUSEKEEPING_INTERVAL = 100;
+/** Milliseconds between message handler rounds over every peer, for trickle relay and pings */
+static const int64_t MESSAGE_HANDLER_ROUND_INTERVAL = 100;
+/** Milliseconds the message handler spends on one peer's messages before moving on */
+static const int64_t MESSAGE_HANDLER_PEER_BUDGET = 10;
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
+/** Seconds over which -maxuploadtarget applies */
+static const int64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
+/** Percentage of -maxuploadtarget, pro rata over what's left of the cycle,
+ *  kept from serving historical blocks for relaying new ones */
+static const int UPLOAD_TARGET_RELAY_SHARE = 20;
+/** Maximum number of queued messages handed to the kernel in one send call */
+static const int MAX_SEND_IOV = 64;
+/** Largest receive buffer taken from the pool; bigger messages grow theirs as data arrives */
+static const unsigned int RECV_BUFFER_POOL_MAX = 1024 * 1024;
+/** Idle buffers the receive buffer pool keeps per size class */
+static const unsigned int RECV_BUFFER_POOL_DEPTH = 4;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -49,11 +75,58 @@ void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
 
+/** A complete message (header, payload and checksum) ready to be sent.
+ *  It is immutable, so one serialization can sit in the send queues of
+ *  any number of peers. */
+typedef boost::shared_ptr<const CSerializeData> CSharedMessage;
+
+/** A message in a peer's send queue */
+struct CQueuedMessage
+{
+    CSharedMessage msg;
+    int64_t nTimeQueued; // microseconds
+
+    CQueuedMessage(const CSharedMessage& msgIn, int64_t nTimeQueuedIn) : msg(msgIn), nTimeQueued(nTimeQueuedIn) { }
+};
+
+/** Fill in the payload size and checksum of the message header at the start of ss */
+void FinalizeMessageHeader(CDataStream& ss);
+
+/**
+ * Serialize a message once, for PushSharedMessage to as many peers as need it.
+ *
+ * The payload is serialized at PROTOCOL_VERSION, not at each peer's send
+ * version, so only types whose encoding doesn't depend on the stream version
+ * may be shared. "block", "cmpctblock", "tx" and "inv" qualify: CTransaction
+ * and CBlock switch the stream version to their own nVersion before any
+ * field that could depend on it, and the compact block parts and CInv are
+ * fixed-width or VARINT. Anything version-dependent, such as CAddress, goes through
+ * PushMessage instead.
+ */
+template<typename T>
+CSharedMessage MakeSharedMessage(const char* pszCommand, const T& payload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(pszCommand, 0) << payload;
+    FinalizeMessageHeader(ss);
+    boost::shared_ptr<CSerializeData> pmsg(new CSerializeData());
+    ss.GetAndClear(*pmsg);
+    return pmsg;
+}
+
+/** Have the socket thread wait for pnode to become writable; cs_vSend must be held */
+void RequestSendInterest(CNode *pnode);
+/** Queue pnode for the message handler, which has a complete message of it to process */
+void WakeMessageHandler(CNode *pnode);
+/** Have the message handler visit every peer now, e.g. to announce a new block */
+void RequestMessageHandlerRound();
+
 // Signals for message handling
 struct CNodeSignals
 {
     boost::signals2::signal<bool (CNode*)> ProcessMessages;
     boost::signals2::signal<bool (CNode*, bool)> SendMessages;
+    boost::signals2::signal<void (NodeId)> FinalizeNode;
 };
 
 CNodeSignals& GetNodeSignals();
@@ -89,6 +162,9 @@ enum
 {
     MSG_TX = 1,
     MSG_BLOCK,
+    MSG_FILTERED_BLOCK, // unused, keeps the numbering of other clients
+    // getdata only: answered with "cmpctblock" instead of "block"
+    MSG_CMPCT_BLOCK,
 };
 
 extern bool fDiscover;
@@ -98,10 +174,10 @@ extern CAddrMan addrman;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSharedMessage> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
-extern std::map<CInv, int64_t> mapAlreadyAskedFor;
+extern boost::unordered_map<CInv, int64_t, SaltedInvHasher> mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
 extern CCriticalSection cs_vAddedNodes;
@@ -112,6 +188,7 @@ extern CCriticalSection cs_vAddedNodes;
 class CNodeStats
 {
 public:
+    NodeId nodeid;
     uint64_t nServices;
     int64_t nLastSend;
     int64_t nLastRecv;
@@ -128,6 +205,11 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    size_t nSendQueueSize;
+    size_t nSendQueueBytes;
+    size_t nSendQueueMax;
+    std::vector<CNetCommandCounts> vCommandCounts;
+    CNetQueueCounts queueCounts;
 };
 
 
@@ -143,15 +225,18 @@ public:
 
     CDataStream vRecv;              // received message data
     unsigned int nDataPos;
+    CHashWriter hasher;             // of the data received so far
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
+    unsigned int nChecksum;         // of the data, set once complete
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn), hasher(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
+        nChecksum = 0;
     }
 
     bool complete() const
@@ -169,6 +254,9 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+    void Complete();
+    // Hand vRecv's buffer back to the pool once the message is processed
+    void ReleaseBuffer();
 };
 
 
@@ -186,8 +274,15 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CQueuedMessage> vSendMsg;
+    std::deque<CQueuedMessage> vSendMsgBulk; // sent once vSendMsg is empty
+    size_t nSendQueueMax; // most messages vSendMsg held at once; protected by cs_vSend
     CCriticalSection cs_vSend;
+    bool fSendInterest; // poller watches for writability; protected by cs_vSend
+    bool fSendQueued; // waiting in RequestSendInterest's queue; protected by cs_vSend
+    bool fPollRecv; // ready to read, only used by the socket thread
+    bool fPollSend; // ready to write, only used by the socket thread
+    bool fRunnable; // queued by WakeMessageHandler; protected by its handler's lock
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
@@ -211,7 +306,10 @@ public:
     bool fDisconnect;
     CSemaphoreGrant grantOutbound;
     int nRefCount;
+    NodeId id;
 protected:
+    static NodeId nLastNodeId;
+    static CCriticalSection cs_nLastNodeId;
 
     // Denial-of-service detection/prevention
     // Key is IP address, value is banned-until-time
@@ -225,16 +323,32 @@ public:
     uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
     bool fStartSync;
+    bool fHeadersPending; // more headers to ask for once blocks catch up
 
-    // flood relay
+    // flood relay; vAddrToSend and setAddrKnown are protected by cs_inventory
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter setAddrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
     uint256 hashCheckpointKnown; // ppcoin: known sent sync-checkpoint
 
+    // Orphan transactions whose missing parents arrived from this peer,
+    // retried one per ProcessMessages call; protected by cs_vRecvMsg
+    std::set<uint256> setOrphanWork;
+    // Relayed transactions being verified, oldest first; protected by cs_vRecvMsg
+    std::deque<boost::shared_ptr<CTxVerifyJob> > vTxVerify;
+
+    // Compact block relay, negotiated with "sendcmpct"
+    bool fSupportsCompact; // peer serves and accepts compact blocks
+    bool fAnnounceCompact; // peer wants new blocks pushed as "cmpctblock" without an inv
+    // Block from this peer's "cmpctblock" waiting for "blocktxn"; protected by cs_main
+    boost::shared_ptr<CPartialBlock> pPartialBlock;
+
+    // traffic and processing time by command
+    CNetStats netStats;
+
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter setInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -249,7 +363,7 @@ public:
     // Whether a ping is requested.
     bool fPingQueued;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000, 0.001), setInventoryKnown(SendBufferSize() / 100, 0.000001)
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -272,19 +386,32 @@ public:
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
+        nSendQueueMax = 0;
+        fSendInterest = false;
+        fSendQueued = false;
+        fPollRecv = false;
+        fPollSend = false;
+        fRunnable = false;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
         fStartSync = false;
+        fHeadersPending = false;
         fGetAddr = false;
         nMisbehavior = 0;
         hashCheckpointKnown = 0;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
         nPingNonceSent = 0;
         nPingUsecStart = 0;
         nPingUsecTime = 0;
         fPingQueued = false;
+        fSupportsCompact = false;
+        fAnnounceCompact = false;
+
+        {
+            LOCK(cs_nLastNodeId);
+            id = nLastNodeId++;
+        }
 
         // Be shy and don't send version until we hear
         if (hSocket != INVALID_SOCKET && !fInbound)
@@ -307,6 +434,13 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // -maxuploadtarget; protected by cs_totalBytesSent
+    static uint64_t nMaxOutboundLimit;
+    static int64_t nMaxOutboundCycleStart;
+    static uint64_t nMaxOutboundBytesInCycle;
+    // Historical block bytes served per peer address in this cycle
+    static std::map<CNetAddr, uint64_t> mapHistoricalBytesInCycle;
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -354,6 +488,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_inventory);
         setAddrKnown.insert(addr);
     }
 
@@ -362,7 +497,8 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr))
+        LOCK(cs_inventory);
+        if (addr.IsValid() && !setAddrKnown.contains(addr))
             vAddrToSend.push_back(addr);
     }
 
@@ -379,7 +515,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!setInventoryKnown.contains(inv))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -437,28 +573,50 @@ public:
         if (ssSend.size() == 0)
             return;
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+        FinalizeMessageHeader(ssSend);
+
+        LogPrint("net", "(%d bytes)\n", ssSend.size() - CMessageHeader::HEADER_SIZE);
 
-        // Set the checksum
-        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+        boost::shared_ptr<CSerializeData> pmsg(new CSerializeData());
+        ssSend.GetAndClear(*pmsg);
+        QueueSendMessage(pmsg);
 
-        LogPrint("net", "(%d bytes)\n", nSize);
+        LEAVE_CRITICAL_SECTION(cs_vSend);
+    }
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+    // requires LOCK(cs_vSend)
+    void QueueSendMessage(const CSharedMessage& msg, bool fBulk = false)
+    {
+        int nCommand = GetNetCommandIndex(&(*msg)[MESSAGE_START_SIZE]);
+        netStats.RecordSent(nCommand, msg->size());
+        netStatsTotal.RecordSent(nCommand, msg->size());
+
+        // Bulk data waits until everything else queued has gone out, so
+        // SocketSendData moves it over when vSendMsg runs empty
+        if (fBulk && !vSendMsg.empty())
+            vSendMsgBulk.push_back(CQueuedMessage(msg, GetTimeMicros()));
+        else
+            vSendMsg.push_back(CQueuedMessage(msg, GetTimeMicros()));
+        nSendSize += msg->size();
+        nSendQueueMax = std::max(nSendQueueMax, vSendMsg.size() + vSendMsgBulk.size());
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
+        // Whatever is left goes out once the socket is writable
+        if (!vSendMsg.empty() && !fSendInterest && !fSendQueued)
+            RequestSendInterest(this);
+    }
 
-        LEAVE_CRITICAL_SECTION(cs_vSend);
+    /** Send a message made by MakeSharedMessage, without copying it. Bulk
+     *  messages, e.g. historical blocks, go out after all others. */
+    void PushSharedMessage(const CSharedMessage& msg, bool fBulk = false)
+    {
+        LOCK(cs_vSend);
+        LogPrint("net", "sending: %s (%d bytes, shared%s)\n",
+                 std::string(&(*msg)[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE).c_str(),
+                 msg->size() - CMessageHeader::HEADER_SIZE, fBulk ? ", bulk" : "");
+        QueueSendMessage(msg, fBulk);
     }
 
     void PushVersion();
@@ -652,6 +810,18 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    /** Upload budget per MAX_UPLOAD_TIMEFRAME in bytes, 0 for none */
+    static void SetMaxOutboundTarget(uint64_t nLimit);
+    static uint64_t GetMaxOutboundTarget();
+    static int64_t GetMaxOutboundTimeLeftInCycle();
+    static uint64_t GetOutboundTargetBytesLeft();
+    /** Whether the upload target is used up; with fHistorical, whether all
+     *  that's left must be kept for relaying new blocks */
+    static bool OutboundTargetReached(bool fHistorical);
+    /** Charge a historical block of nBytes to addr, unless the upload
+     *  target is near or addr has had its fair share of it this cycle */
+    static bool ServeHistoricalBlock(const CNetAddr& addr, uint64_t nBytes);
 };
 
 inline void RelayInventory(const CInv& inv)
@@ -846,6 +846,13 @@ uint64_t CNetAddr::GetHash() const
     return nRet;
 }
 
+uint64_t CNetAddr::GetSaltedHash(uint64_t k0, uint64_t k1) const
+{
+    uint256 key = 0;
+    memcpy(key.begin(), ip, sizeof(ip));
+    return SipHashUint256(k0, k1, key);
+}
+
 // private extensions to enum Network, only returned by GetExtNetwork,
 // and only used in GetReachabilityFrom
 static const int NET_UNKNOWN = NET_MAX + 0;
@@ -66,6 +66,8 @@ class CNetAddr
         std::string ToStringIP() const;
         unsigned int GetByte(int n) const;
         uint64_t GetHash() const;
+        /** SipHash of the address under the key k0, k1, for salted hash tables */
+        uint64_t GetSaltedHash(uint64_t k0, uint64_t k1) const;
         bool GetInAddr(struct in_addr* pipv4Addr) const;
         std::vector<unsigned char> GetGroup() const;
         int GetReachabilityFrom(const CNetAddr *paddrPartner = NULL) const;
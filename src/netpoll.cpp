@@ -0,0 +1,212 @@
+// Copyright (c) 2016 The BiosCrypto developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "netpoll.h"
+
+#include "sync.h"
+#include "util.h"
+
+#include <map>
+
+#ifdef __linux__
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+using namespace std;
+
+/** Portable backend, bounded by FD_SETSIZE and O(n) per call */
+class CSelectPoller : public CSocketPoller
+{
+private:
+    CCriticalSection cs;
+    map<SOCKET, pair<void*, bool> > mapSockets;
+
+public:
+    bool Set(SOCKET hSocket, void* ptr, bool fSend)
+    {
+        LOCK(cs);
+        mapSockets[hSocket] = make_pair(ptr, fSend);
+        return true;
+    }
+
+    void Remove(SOCKET hSocket)
+    {
+        LOCK(cs);
+        mapSockets.erase(hSocket);
+    }
+
+    bool Wait(int nMilliseconds, vector<CSocketEvent>& vEvents)
+    {
+        // Can't be woken, so don't wait longer than new data may sit queued
+        struct timeval timeout;
+        timeout.tv_sec  = 0;
+        timeout.tv_usec = min(nMilliseconds, 50) * 1000;
+
+        fd_set fdsetRecv;
+        fd_set fdsetSend;
+        fd_set fdsetError;
+        FD_ZERO(&fdsetRecv);
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        SOCKET hSocketMax = 0;
+        vector<pair<SOCKET, void*> > vSockets;
+        {
+            LOCK(cs);
+            for (map<SOCKET, pair<void*, bool> >::iterator it = mapSockets.begin(); it != mapSockets.end(); ++it)
+            {
+                FD_SET(it->first, &fdsetRecv);
+                if (it->second.second)
+                    FD_SET(it->first, &fdsetSend);
+                FD_SET(it->first, &fdsetError);
+                hSocketMax = max(hSocketMax, it->first);
+                vSockets.push_back(make_pair(it->first, it->second.first));
+            }
+        }
+        if (vSockets.empty())
+        {
+            MilliSleep(timeout.tv_usec / 1000);
+            return true;
+        }
+
+        int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        if (nSelect == SOCKET_ERROR)
+        {
+            LogPrintf("socket select error %d\n", WSAGetLastError());
+            return false;
+        }
+
+        for (unsigned int i = 0; i < vSockets.size() && nSelect > 0; i++)
+        {
+            CSocketEvent event;
+            event.ptr = vSockets[i].second;
+            event.fRecv = FD_ISSET(vSockets[i].first, &fdsetRecv);
+            event.fSend = FD_ISSET(vSockets[i].first, &fdsetSend);
+            event.fError = FD_ISSET(vSockets[i].first, &fdsetError);
+            if (event.fRecv || event.fSend || event.fError)
+                vEvents.push_back(event);
+        }
+        return true;
+    }
+
+    void Wake() { }
+
+    const char* GetName() const { return "select"; }
+};
+
+#ifdef __linux__
+/** Edge-triggered epoll, woken through an eventfd */
+class CEpollPoller : public CSocketPoller
+{
+private:
+    int hEpoll;
+    int hWake;
+
+    static const int MAX_EVENTS = 256;
+
+public:
+    CEpollPoller() : hEpoll(-1), hWake(-1) { }
+
+    ~CEpollPoller()
+    {
+        if (hWake >= 0)
+            close(hWake);
+        if (hEpoll >= 0)
+            close(hEpoll);
+    }
+
+    bool Init()
+    {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll < 0)
+            return false;
+        hWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (hWake < 0)
+            return false;
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = this;
+        return epoll_ctl(hEpoll, EPOLL_CTL_ADD, hWake, &ev) == 0;
+    }
+
+    bool Set(SOCKET hSocket, void* ptr, bool fSend)
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        uint32_t nEvents = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        if (fSend)
+            nEvents |= EPOLLOUT;
+        ev.events = nEvents;
+        ev.data.ptr = ptr;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_MOD, hSocket, &ev) == 0)
+            return true;
+        if (errno == ENOENT && epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &ev) == 0)
+            return true;
+        return error("CEpollPoller::Set() : epoll_ctl failed for socket %d: %s", hSocket, strerror(errno));
+    }
+
+    void Remove(SOCKET hSocket)
+    {
+        // Kernels before 2.6.9 want a non-null event even for EPOLL_CTL_DEL
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, &ev);
+    }
+
+    bool Wait(int nMilliseconds, vector<CSocketEvent>& vEvents)
+    {
+        struct epoll_event events[MAX_EVENTS];
+        int nEvents = epoll_wait(hEpoll, events, MAX_EVENTS, nMilliseconds);
+        if (nEvents < 0)
+        {
+            if (errno == EINTR)
+                return true;
+            LogPrintf("socket epoll_wait error %s\n", strerror(errno));
+            return false;
+        }
+
+        for (int i = 0; i < nEvents; i++)
+        {
+            if (events[i].data.ptr == this)
+            {
+                uint64_t nCount;
+                while (read(hWake, &nCount, sizeof(nCount)) > 0)
+                    ;
+                continue;
+            }
+            CSocketEvent event;
+            event.ptr = events[i].data.ptr;
+            event.fRecv = events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP);
+            event.fSend = events[i].events & EPOLLOUT;
+            event.fError = events[i].events & EPOLLERR;
+            vEvents.push_back(event);
+        }
+        return true;
+    }
+
+    void Wake()
+    {
+        uint64_t nOne = 1;
+        if (write(hWake, &nOne, sizeof(nOne)) < 0 && errno != EAGAIN)
+            LogPrintf("CEpollPoller::Wake() : write failed: %s\n", strerror(errno));
+    }
+
+    const char* GetName() const { return "epoll"; }
+};
+#endif
+
+CSocketPoller* CSocketPoller::Create()
+{
+#ifdef __linux__
+    CEpollPoller* pEpoll = new CEpollPoller();
+    if (pEpoll->Init())
+        return pEpoll;
+    LogPrintf("CSocketPoller::Create() : epoll unavailable (%s), using select\n", strerror(errno));
+    delete pEpoll;
+#endif
+    return new CSelectPoller();
+}
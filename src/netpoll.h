@@ -0,0 +1,50 @@
+// Copyright (c) 2016 The BiosCrypto developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_NETPOLL_H
+#define BITCOIN_NETPOLL_H
+
+#include "compat.h"
+
+#include <vector>
+
+/** A registered socket that became ready */
+struct CSocketEvent
+{
+    void* ptr;   // as passed to CSocketPoller::Set
+    bool fRecv;  // readable, or closed by the peer
+    bool fSend;  // writable
+    bool fError;
+};
+
+/**
+ * Waits for many sockets at once. A socket is registered once with a
+ * pointer that Wait hands back for it, and asks to be told about
+ * writability only while it has data queued.
+ *
+ * The epoll backend is edge-triggered: a socket is reported once when it
+ * becomes ready and not again until it has been read or written up to
+ * EWOULDBLOCK. Callers must remember readiness themselves; the select
+ * backend reports level-triggered readiness, which fits the same usage.
+ */
+class CSocketPoller
+{
+public:
+    virtual ~CSocketPoller() { }
+
+    /** Register hSocket, or change its write interest */
+    virtual bool Set(SOCKET hSocket, void* ptr, bool fSend) = 0;
+    /** Unregister hSocket; must be called before it is closed */
+    virtual void Remove(SOCKET hSocket) = 0;
+    /** Wait at most nMilliseconds for sockets to become ready, appending
+     *  them to vEvents. Returns false on error. */
+    virtual bool Wait(int nMilliseconds, std::vector<CSocketEvent>& vEvents) = 0;
+    /** Make a Wait in another thread return early */
+    virtual void Wake() = 0;
+    virtual const char* GetName() const = 0;
+
+    /** epoll where available, select otherwise */
+    static CSocketPoller* Create();
+};
+
+#endif
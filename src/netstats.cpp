@@ -0,0 +1,126 @@
+// Copyright (c) 2016 The BiosCrypto developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "netstats.h"
+
+#include "protocol.h"
+
+#include <string.h>
+
+using namespace std;
+
+CNetStats netStatsTotal;
+
+// Sorted, for a binary search by the command of every message
+static const char* ppszNetCommands[NET_STATS_COMMANDS - 1] =
+{
+    "addr",
+    "alert",
+    "block",
+    "blocktxn",
+    "checkpoint",
+    "cmpctblock",
+    "getaddr",
+    "getblocks",
+    "getblocktxn",
+    "getdata",
+    "getheaders",
+    "headers",
+    "inv",
+    "mempool",
+    "notfound",
+    "ping",
+    "pong",
+    "sendcmpct",
+    "tx",
+    "verack",
+    "version",
+};
+
+int GetNetCommandIndex(const char* pchCommand)
+{
+    int nLow = 0, nHigh = NET_STATS_COMMANDS - 2;
+    while (nLow <= nHigh)
+    {
+        int nMid = (nLow + nHigh) / 2;
+        int nCmp = strncmp(pchCommand, ppszNetCommands[nMid], CMessageHeader::COMMAND_SIZE);
+        if (nCmp == 0)
+            return nMid;
+        if (nCmp < 0)
+            nHigh = nMid - 1;
+        else
+            nLow = nMid + 1;
+    }
+    return NET_STATS_COMMANDS - 1;
+}
+
+const char* GetNetCommandName(int nCommand)
+{
+    if (nCommand < 0 || nCommand >= NET_STATS_COMMANDS - 1)
+        return "other";
+    return ppszNetCommands[nCommand];
+}
+
+int GetNetStatsTimeBucket(int64_t nMicros)
+{
+    int nBucket = 0;
+    for (int64_t nLimit = 16; nMicros >= nLimit && nBucket < NET_STATS_TIME_BUCKETS - 1; nLimit *= 4)
+        nBucket++;
+    return nBucket;
+}
+
+int64_t GetNetStatsTimeBucketLimit(int nBucket)
+{
+    if (nBucket >= NET_STATS_TIME_BUCKETS - 1)
+        return -1;
+    return (int64_t)16 << (2 * nBucket);
+}
+
+void CNetStats::RecordRecv(int nCommand, unsigned int nBytes, int64_t nMicros)
+{
+    CCommandCounters& command = vCommands[nCommand];
+    command.nMsgsRecv.Add(1);
+    command.nBytesRecv.Add(nBytes);
+    command.nProcessMicros.Add(nMicros);
+    command.vProcessTime[GetNetStatsTimeBucket(nMicros)].Add(1);
+}
+
+void CNetStats::RecordSent(int nCommand, unsigned int nBytes)
+{
+    CCommandCounters& command = vCommands[nCommand];
+    command.nMsgsSent.Add(1);
+    command.nBytesSent.Add(nBytes);
+}
+
+void CNetStats::RecordQueueTime(int64_t nMicros)
+{
+    nQueueMsgs.Add(1);
+    nQueueMicros.Add(nMicros);
+    vQueueTime[GetNetStatsTimeBucket(nMicros)].Add(1);
+}
+
+void CNetStats::GetCommandCounts(vector<CNetCommandCounts>& vCounts) const
+{
+    vCounts.resize(NET_STATS_COMMANDS);
+    for (int i = 0; i < NET_STATS_COMMANDS; i++)
+    {
+        const CCommandCounters& command = vCommands[i];
+        CNetCommandCounts& counts = vCounts[i];
+        counts.nMsgsRecv = command.nMsgsRecv.Get();
+        counts.nBytesRecv = command.nBytesRecv.Get();
+        counts.nMsgsSent = command.nMsgsSent.Get();
+        counts.nBytesSent = command.nBytesSent.Get();
+        counts.nProcessMicros = command.nProcessMicros.Get();
+        for (int j = 0; j < NET_STATS_TIME_BUCKETS; j++)
+            counts.vProcessTime[j] = command.vProcessTime[j].Get();
+    }
+}
+
+void CNetStats::GetQueueCounts(CNetQueueCounts& counts) const
+{
+    counts.nMsgs = nQueueMsgs.Get();
+    counts.nMicros = nQueueMicros.Get();
+    for (int j = 0; j < NET_STATS_TIME_BUCKETS; j++)
+        counts.vTime[j] = vQueueTime[j].Get();
+}
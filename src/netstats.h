@@ -0,0 +1,98 @@
+// Copyright (c) 2016 The BiosCrypto developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_NETSTATS_H
+#define BITCOIN_NETSTATS_H
+
+#include <stdint.h>
+#include <vector>
+
+#include <boost/atomic.hpp>
+
+/** Message commands counted separately; any other command counts as "other" */
+static const int NET_STATS_COMMANDS = 22;
+/** Buckets of the time histograms, each four times as wide as the one
+ *  before: below 16us, 64us, 256us, ... 1.05s, and the rest */
+static const int NET_STATS_TIME_BUCKETS = 10;
+
+/** Index in the stats tables of the command in a message header's
+ *  nul-padded command field */
+int GetNetCommandIndex(const char* pchCommand);
+const char* GetNetCommandName(int nCommand);
+int GetNetStatsTimeBucket(int64_t nMicros);
+/** Upper bound of a histogram bucket, in microseconds; -1 for the last */
+int64_t GetNetStatsTimeBucketLimit(int nBucket);
+
+/**
+ * A counter that one thread bumps on a hot path and RPC reads at any time.
+ * Relaxed ordering is enough, nothing is published through it.
+ */
+class CNetStatCounter
+{
+private:
+    boost::atomic<uint64_t> n;
+
+public:
+    CNetStatCounter() : n(0) { }
+    void Add(uint64_t nDelta) { n.fetch_add(nDelta, boost::memory_order_relaxed); }
+    uint64_t Get() const { return n.load(boost::memory_order_relaxed); }
+};
+
+/** A copy of the counters of one command */
+struct CNetCommandCounts
+{
+    uint64_t nMsgsRecv;
+    uint64_t nBytesRecv;
+    uint64_t nMsgsSent;
+    uint64_t nBytesSent;
+    uint64_t nProcessMicros;
+    uint64_t vProcessTime[NET_STATS_TIME_BUCKETS];
+};
+
+/** A copy of the send queue counters */
+struct CNetQueueCounts
+{
+    uint64_t nMsgs;
+    uint64_t nMicros;
+    uint64_t vTime[NET_STATS_TIME_BUCKETS];
+};
+
+/**
+ * Traffic and processing time by message command, and how long messages
+ * waited in send queues; kept for every peer and for the node as a whole.
+ * Recording takes no lock.
+ */
+class CNetStats
+{
+private:
+    struct CCommandCounters
+    {
+        CNetStatCounter nMsgsRecv;
+        CNetStatCounter nBytesRecv;
+        CNetStatCounter nMsgsSent;
+        CNetStatCounter nBytesSent;
+        CNetStatCounter nProcessMicros;
+        CNetStatCounter vProcessTime[NET_STATS_TIME_BUCKETS];
+    };
+    CCommandCounters vCommands[NET_STATS_COMMANDS];
+
+    CNetStatCounter nQueueMsgs;
+    CNetStatCounter nQueueMicros;
+    CNetStatCounter vQueueTime[NET_STATS_TIME_BUCKETS];
+
+public:
+    /** A message was received and handled in nMicros */
+    void RecordRecv(int nCommand, unsigned int nBytes, int64_t nMicros);
+    /** A message was queued to send */
+    void RecordSent(int nCommand, unsigned int nBytes);
+    /** A message went out after nMicros in the send queue */
+    void RecordQueueTime(int64_t nMicros);
+
+    void GetCommandCounts(std::vector<CNetCommandCounts>& vCounts) const;
+    void GetQueueCounts(CNetQueueCounts& counts) const;
+};
+
+/** All peers together, including those gone */
+extern CNetStats netStatsTotal;
+
+#endif // BITCOIN_NETSTATS_H
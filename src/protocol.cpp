@@ -16,6 +16,8 @@ static const char* ppszTypeName[] =
     "ERROR",
     "tx",
     "block",
+    "filtered block",
+    "cmpctblock",
 };
 
 CMessageHeader::CMessageHeader()
@@ -123,6 +125,11 @@ bool operator<(const CInv& a, const CInv& b)
     return (a.type < b.type || (a.type == b.type && a.hash < b.hash));
 }
 
+bool operator==(const CInv& a, const CInv& b)
+{
+    return (a.type == b.type && a.hash == b.hash);
+}
+
 bool CInv::IsKnownType() const
 {
     return (type >= 1 && type < (int)ARRAYLEN(ppszTypeName));
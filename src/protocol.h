@@ -113,6 +113,7 @@ class CInv
         )
 
         friend bool operator<(const CInv& a, const CInv& b);
+        friend bool operator==(const CInv& a, const CInv& b);
 
         bool IsKnownType() const;
         const char* GetCommand() const;
@@ -124,4 +125,19 @@ class CInv
         uint256 hash;
 };
 
+/** Hasher for hash tables keyed by CInv, see SaltedUint256Hasher */
+class SaltedInvHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    SaltedInvHasher() { GetSaltedHashKey(k0, k1); }
+
+    size_t operator()(const CInv& inv) const
+    {
+        return SipHashUint256Extra(k0, k1, inv.hash, inv.type);
+    }
+};
+
 #endif // __INCLUDED_PROTOCOL_H__
@@ -7,6 +7,8 @@
 #include "main.h"
 #include "kernel.h"
 #include "checkpoints.h"
+#include "txdb.h"
+#include "txmempool.h"
 
 using namespace json_spirit;
 using namespace std;
@@ -113,8 +115,8 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPri
     result.push_back(Pair("hash", block.GetHash().GetHex()));
     int confirmations = -1;
     // Only report confirmations if the block is on the main chain
-    if (blockindex->IsInMainChain())
-        confirmations = nBestHeight - blockindex->nHeight + 1;
+    if (chainActive.Contains(blockindex))
+        confirmations = chainActive.Height() - blockindex->nHeight + 1;
     result.push_back(Pair("confirmations", confirmations));
     result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
     result.push_back(Pair("height", blockindex->nHeight));
@@ -197,10 +199,47 @@ Value getdifficulty(const Array& params, bool fHelp)
 
 Value getrawmempool(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "getrawmempool\n"
-            "Returns all transaction ids in memory pool.");
+            "getrawmempool [verbose=false]\n"
+            "Returns all transaction ids in memory pool.\n"
+            "With verbose=true returns an object keyed by txid with the size, fee,\n"
+            "entry time and height, priority, in-pool dependencies and ancestor and\n"
+            "descendant package totals of each transaction.");
+
+    bool fVerbose = false;
+    if (params.size() > 0)
+        fVerbose = params[0].get_bool();
+
+    if (fVerbose)
+    {
+        LOCK(mempool.cs);
+        Object o;
+        for (CTxMemPool::TxMap::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        {
+            const uint256& hash = mi->first;
+            const CTxMemPoolEntry& e = mi->second;
+            Object info;
+            info.push_back(Pair("size", (int)e.GetTxSize()));
+            info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
+            info.push_back(Pair("time", e.GetTime()));
+            info.push_back(Pair("height", (int)e.GetHeight()));
+            info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
+            info.push_back(Pair("currentpriority", e.GetPriority(nBestHeight)));
+            info.push_back(Pair("ancestorcount", (uint64_t)e.GetCountWithAncestors()));
+            info.push_back(Pair("ancestorsize", (uint64_t)e.GetSizeWithAncestors()));
+            info.push_back(Pair("ancestorfees", ValueFromAmount(e.GetFeesWithAncestors())));
+            info.push_back(Pair("descendantcount", (uint64_t)e.GetCountWithDescendants()));
+            info.push_back(Pair("descendantsize", (uint64_t)e.GetSizeWithDescendants()));
+            info.push_back(Pair("descendantfees", ValueFromAmount(e.GetFeesWithDescendants())));
+            Array depends;
+            BOOST_FOREACH(const uint256& hashParent, mempool.GetMemPoolParents(hash))
+                depends.push_back(hashParent.ToString());
+            info.push_back(Pair("depends", depends));
+            o.push_back(Pair(hash.ToString(), info));
+        }
+        return o;
+    }
 
     vector<uint256> vtxid;
     mempool.queryHashes(vtxid);
@@ -212,6 +251,33 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns details on the active state of the transaction memory pool:\n"
+            "  size            number of transactions\n"
+            "  bytes           sum of serialized transaction sizes\n"
+            "  usage           estimated memory usage in bytes\n"
+            "  maxmempool      memory usage limit (-maxmempool) in bytes\n"
+            "  mempoolminfee   current minimum fee per 1000 bytes for new transactions\n"
+            "  evicted         transactions evicted to stay under maxmempool\n"
+            "  expired         transactions removed after -mempoolexpiry hours");
+
+    int64_t nMaxMempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+
+    Object ret;
+    ret.push_back(Pair("size", (uint64_t)mempool.size()));
+    ret.push_back(Pair("bytes", mempool.GetTotalTxSize()));
+    ret.push_back(Pair("usage", (uint64_t)mempool.DynamicUsage()));
+    ret.push_back(Pair("maxmempool", nMaxMempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(max(mempool.GetRollingMinFee(nMaxMempool), MIN_RELAY_TX_FEE))));
+    ret.push_back(Pair("evicted", mempool.GetEvictedCount()));
+    ret.push_back(Pair("expired", mempool.GetExpiredCount()));
+    return ret;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -223,7 +289,7 @@ Value getblockhash(const Array& params, bool fHelp)
     if (nHeight < 0 || nHeight > nBestHeight)
         throw runtime_error("Block number out of range.");
 
-    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+    CBlockIndex* pblockindex = chainActive[nHeight];
     return pblockindex->phashBlock->GetHex();
 }
 
@@ -261,13 +327,7 @@ Value getblockbynumber(const Array& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    uint256 hash = *pblockindex->phashBlock;
-
-    pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex = chainActive[nHeight];
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
@@ -304,3 +364,35 @@ Value getcheckpoint(const Array& params, bool fHelp)
 
     return result;
 }
+
+Value getdbstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "Returns LevelDB statistics and access counters of the transaction index.");
+
+    CTxDB txdb("r");
+    Object result;
+
+    Object sizes;
+    sizes.push_back(Pair("tx", (uint64_t)txdb.GetApproximateSize(DB_TXINDEX)));
+    sizes.push_back(Pair("blockindex", (uint64_t)txdb.GetApproximateSize(DB_BLOCKINDEX)));
+    result.push_back(Pair("approximatesizes", sizes));
+
+    CTxDBStats stats = GetTxDBStats();
+    result.push_back(Pair("gets", (uint64_t)stats.nGets));
+    result.push_back(Pair("getmicros", (uint64_t)stats.nGetMicros));
+    result.push_back(Pair("writes", (uint64_t)stats.nWrites));
+    result.push_back(Pair("writemicros", (uint64_t)stats.nWriteMicros));
+    result.push_back(Pair("slowwrites", (uint64_t)stats.nSlowWrites));
+    result.push_back(Pair("slowwritemicros", (uint64_t)stats.nSlowWriteMicros));
+
+    string strValue;
+    if (txdb.GetProperty("leveldb.stats", strValue))
+        result.push_back(Pair("stats", strValue));
+    if (txdb.GetProperty("leveldb.sstables", strValue))
+        result.push_back(Pair("sstables", strValue));
+
+    return result;
+}
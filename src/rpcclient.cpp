@@ -118,6 +118,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "getblockbynumber", 0 },
     { "getblockbynumber", 1 },
     { "getblockhash", 0 },
+    { "getrawmempool", 0 },
     { "move", 2 },
     { "move", 3 },
     { "sendfrom", 2 },
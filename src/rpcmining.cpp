@@ -8,6 +8,7 @@
 #include "main.h"
 #include "db.h"
 #include "txdb.h"
+#include "txmempool.h"
 #include "init.h"
 #include "miner.h"
 #include "kernel.h"
@@ -219,7 +220,10 @@ Value checkkernel(const Array& params, bool fHelp)
         return result;
 
     int64_t nFees;
-    auto_ptr<CBlock> pblock(CreateNewBlock(*pMiningKey, true, &nFees));
+    boost::shared_ptr<const CBlock> ptemplate = templateManager.GetTemplate(*pMiningKey, true, &nFees);
+    if (!ptemplate)
+        throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+    auto_ptr<CBlock> pblock(new CBlock(*ptemplate));
 
     pblock->nTime = pblock->vtx[0].nTime = nTime;
 
@@ -255,49 +259,18 @@ Value getworkex(const Array& params, bool fHelp)
     if (pindexBest->nHeight >= Params().LastPoWBlock())
         throw JSONRPCError(RPC_MISC_ERROR, "No more PoW blocks");
 
-    typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;
-    static vector<CBlock*> vNewBlock;
-
     if (params.size() == 0)
     {
         // Update block
-        static unsigned int nTransactionsUpdatedLast;
-        static CBlockIndex* pindexPrev;
-        static int64_t nStart;
-        static CBlock* pblock;
-        if (pindexPrev != pindexBest ||
-            (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60))
-        {
-            if (pindexPrev != pindexBest)
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlock* pblock, vNewBlock)
-                    delete pblock;
-                vNewBlock.clear();
-            }
-            nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-            pindexPrev = pindexBest;
-            nStart = GetTime();
-
-            // Create new block
-            pblock = CreateNewBlock(*pMiningKey);
-            if (!pblock)
-                throw JSONRPCError(-7, "Out of memory");
-            vNewBlock.push_back(pblock);
-        }
+        CBlockIndex* pindexPrev;
+        boost::shared_ptr<const CBlock> ptemplate = templateManager.GetTemplate(*pMiningKey, false, NULL, &pindexPrev);
+        if (!ptemplate)
+            throw JSONRPCError(-7, "Out of memory");
 
-        // Update nTime
-        pblock->nTime = max(pindexPrev->GetPastTimeLimit()+1, GetAdjustedTime());
-        pblock->nNonce = 0;
-
-        // Update nExtraNonce
-        static unsigned int nExtraNonce = 0;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
-
-        // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
+        // Fresh nTime and nExtraNonce, remembered for the solution
+        CBlock block;
+        templateManager.CreateWork(ptemplate, pindexPrev, block);
+        CBlock* pblock = &block;
 
         // Prebuild hash buffers
         char pmidstate[32];
@@ -348,16 +321,15 @@ Value getworkex(const Array& params, bool fHelp)
             ((unsigned int*)pdata)[i] = ByteReverse(((unsigned int*)pdata)[i]);
 
         // Get saved block
-        if (!mapNewBlock.count(pdata->hashMerkleRoot))
+        CBlock block;
+        if (!templateManager.GetWork(pdata->hashMerkleRoot, block))
             return false;
-        CBlock* pblock = mapNewBlock[pdata->hashMerkleRoot].first;
+        CBlock* pblock = &block;
 
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
 
-        if(coinbase.size() == 0)
-            pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-        else
+        if(coinbase.size() != 0)
             CDataStream(coinbase, SER_NETWORK, PROTOCOL_VERSION) >> pblock->vtx[0]; // FIXME - HACK!
 
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
@@ -389,57 +361,18 @@ Value getwork(const Array& params, bool fHelp)
     if (pindexBest->nHeight >= Params().LastPoWBlock())
         throw JSONRPCError(RPC_MISC_ERROR, "No more PoW blocks");
 
-    typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
-    static vector<CBlock*> vNewBlock;
-
     if (params.size() == 0)
     {
         // Update block
-        static unsigned int nTransactionsUpdatedLast;
-        static CBlockIndex* pindexPrev;
-        static int64_t nStart;
-        static CBlock* pblock;
-        if (pindexPrev != pindexBest ||
-            (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60))
-        {
-            if (pindexPrev != pindexBest)
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlock* pblock, vNewBlock)
-                    delete pblock;
-                vNewBlock.clear();
-            }
-
-            // Clear pindexPrev so future getworks make a new block, despite any failures from here on
-            pindexPrev = NULL;
-
-            // Store the pindexBest used before CreateNewBlock, to avoid races
-            nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-            CBlockIndex* pindexPrevNew = pindexBest;
-            nStart = GetTime();
-
-            // Create new block
-            pblock = CreateNewBlock(*pMiningKey);
-            if (!pblock)
-                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-            vNewBlock.push_back(pblock);
-
-            // Need to update only after we know CreateNewBlock succeeded
-            pindexPrev = pindexPrevNew;
-        }
-
-        // Update nTime
-        pblock->UpdateTime(pindexPrev);
-        pblock->nNonce = 0;
-
-        // Update nExtraNonce
-        static unsigned int nExtraNonce = 0;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+        CBlockIndex* pindexPrev;
+        boost::shared_ptr<const CBlock> ptemplate = templateManager.GetTemplate(*pMiningKey, false, NULL, &pindexPrev);
+        if (!ptemplate)
+            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
-        // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
+        // Fresh nTime and nExtraNonce, remembered for the solution
+        CBlock block;
+        templateManager.CreateWork(ptemplate, pindexPrev, block);
+        CBlock* pblock = &block;
 
         // Pre-build hash buffers
         char pmidstate[32];
@@ -469,13 +402,13 @@ Value getwork(const Array& params, bool fHelp)
             ((unsigned int*)pdata)[i] = ByteReverse(((unsigned int*)pdata)[i]);
 
         // Get saved block
-        if (!mapNewBlock.count(pdata->hashMerkleRoot))
+        CBlock block;
+        if (!templateManager.GetWork(pdata->hashMerkleRoot, block))
             return false;
-        CBlock* pblock = mapNewBlock[pdata->hashMerkleRoot].first;
+        CBlock* pblock = &block;
 
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
-        pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 
         assert(pwalletMain != NULL);
@@ -504,9 +437,11 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"sizelimit\" : limit of block size\n"
             "  \"bits\" : compressed target of next block\n"
             "  \"height\" : height of the next block\n"
+            "  \"longpollid\" : pass as \"longpollid\" in [params] to wait until the tip or the fees change\n"
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
+    Value lpval;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
@@ -519,6 +454,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
         }
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
+        lpval = find_value(oparam, "longpollid");
     }
 
     if (strMode != "template")
@@ -527,42 +463,53 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (vNodes.empty())
         throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "BiosCrypto is not connected!");
 
-    if (IsInitialBlockDownload())
-        throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "BiosCrypto is downloading blocks...");
-
-    if (pindexBest->nHeight >= Params().LastPoWBlock())
-        throw JSONRPCError(RPC_MISC_ERROR, "No more PoW blocks");
-
-    // Update block
-    static unsigned int nTransactionsUpdatedLast;
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlock* pblock;
-    if (pindexPrev != pindexBest ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
     {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
+        LOCK(cs_main);
+        if (IsInitialBlockDownload())
+            throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "BiosCrypto is downloading blocks...");
 
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = pindexBest;
-        nStart = GetTime();
+        if (pindexBest->nHeight >= Params().LastPoWBlock())
+            throw JSONRPCError(RPC_MISC_ERROR, "No more PoW blocks");
+    }
 
-        // Create new block
-        if(pblock)
+    // This call is thread safe: the wait below holds no locks, so blocks and
+    // transactions keep arriving while a long poll is pending
+    if (lpval.type() != null_type)
+    {
+        // Wait until the tip changes or the template earns meaningfully more
+        if (lpval.type() != str_type)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+        std::string lpstr = lpval.get_str();
+        if (lpstr.size() < 64)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+        uint256 hashWatchedChain(lpstr.substr(0, 64));
+        int64_t nFeesWatched = atoi64(lpstr.substr(64));
+
+        // Without a fee increase, still return once the pool has changed
+        // and a minute has passed, like a polling miner would
+        int64_t nTimeGiveUp = GetTime() + 60;
+        int64_t nMinIncrease = MIN_TX_FEE;
         {
-            delete pblock;
-            pblock = NULL;
+            boost::shared_ptr<const CBlock> ptemplate = templateManager.GetTemplate(*pMiningKey, false);
+            if (ptemplate)
+                nMinIncrease = max(MIN_TX_FEE, ptemplate->vtx[0].vout[0].nValue / 100);
         }
-        pblock = CreateNewBlock(*pMiningKey);
-        if (!pblock)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
+        templateManager.WaitForChange(*pMiningKey, hashWatchedChain, nFeesWatched, nMinIncrease, nTimeGiveUp);
+        if (ShutdownRequested())
+            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
     }
 
+    LOCK(cs_main);
+
+    // Update block
+    CBlockIndex* pindexPrev;
+    int64_t nFees;
+    boost::shared_ptr<const CBlock> ptemplate = templateManager.GetTemplate(*pMiningKey, false, &nFees, &pindexPrev);
+    if (!ptemplate)
+        throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+    CBlock block(*ptemplate);
+    CBlock* pblock = &block;
+
     // Update nTime
     pblock->UpdateTime(pindexPrev);
     pblock->nNonce = 0;
@@ -588,7 +535,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
         entry.push_back(Pair("hash", txHash.GetHex()));
 
         MapPrevTx mapInputs;
-        map<uint256, CTxIndex> mapUnused;
+        TxIndexMap mapUnused;
         bool fInvalid = false;
         if (tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
         {
@@ -638,6 +585,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("curtime", (int64_t)pblock->nTime));
     result.push_back(Pair("bits", strprintf("%08x", pblock->nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
+    result.push_back(Pair("longpollid", CBlockTemplateManager::GetLongPollId(*pblock, nFees)));
 
     return result;
 }
@@ -61,6 +61,46 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+static Array NetStatsHistogramToJSON(const uint64_t vTime[NET_STATS_TIME_BUCKETS])
+{
+    Array hist;
+    for (int i = 0; i < NET_STATS_TIME_BUCKETS; i++)
+        hist.push_back((uint64_t)vTime[i]);
+    return hist;
+}
+
+// Commands that were sent or received, with their counters
+static Object NetCommandCountsToJSON(const vector<CNetCommandCounts>& vCounts, bool fHistograms)
+{
+    Object ret;
+    for (unsigned int i = 0; i < vCounts.size(); i++)
+    {
+        const CNetCommandCounts& counts = vCounts[i];
+        if (counts.nMsgsRecv == 0 && counts.nMsgsSent == 0)
+            continue;
+        Object obj;
+        obj.push_back(Pair("msgsrecv", (uint64_t)counts.nMsgsRecv));
+        obj.push_back(Pair("bytesrecv", (uint64_t)counts.nBytesRecv));
+        obj.push_back(Pair("msgssent", (uint64_t)counts.nMsgsSent));
+        obj.push_back(Pair("bytessent", (uint64_t)counts.nBytesSent));
+        obj.push_back(Pair("processtime", counts.nProcessMicros / 1000.0));
+        if (fHistograms)
+            obj.push_back(Pair("processhist", NetStatsHistogramToJSON(counts.vProcessTime)));
+        ret.push_back(Pair(GetNetCommandName(i), obj));
+    }
+    return ret;
+}
+
+static Object NetQueueCountsToJSON(const CNetQueueCounts& counts, bool fHistograms)
+{
+    Object obj;
+    obj.push_back(Pair("msgssent", (uint64_t)counts.nMsgs));
+    obj.push_back(Pair("averagetime", counts.nMsgs ? counts.nMicros / 1000.0 / counts.nMsgs : 0.0));
+    if (fHistograms)
+        obj.push_back(Pair("timehist", NetStatsHistogramToJSON(counts.vTime)));
+    return obj;
+}
+
 Value getpeerinfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -94,6 +134,20 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
         obj.push_back(Pair("syncnode", stats.fSyncNode));
+        CBlockDownloadStats dlstats;
+        if (GetBlockDownloadStats(stats.nodeid, dlstats))
+        {
+            obj.push_back(Pair("blocksinflight", dlstats.nBlocksInFlight));
+            obj.push_back(Pair("maxblocksinflight", dlstats.nMaxBlocksInFlight));
+            obj.push_back(Pair("blocksreceived", dlstats.nBlocksReceived));
+            obj.push_back(Pair("blocklatency", (double)dlstats.nAvgLatency / 1e6));
+            obj.push_back(Pair("blockstalls", dlstats.nStalls));
+        }
+        obj.push_back(Pair("sendqueue", (uint64_t)stats.nSendQueueSize));
+        obj.push_back(Pair("sendqueuebytes", (uint64_t)stats.nSendQueueBytes));
+        obj.push_back(Pair("sendqueuemax", (uint64_t)stats.nSendQueueMax));
+        obj.push_back(Pair("sendqueuetime", NetQueueCountsToJSON(stats.queueCounts, false)));
+        obj.push_back(Pair("msgstats", NetCommandCountsToJSON(stats.vCommandCounts, false)));
 
         ret.push_back(obj);
     }
@@ -304,11 +358,71 @@ Value getnettotals(const Array& params, bool fHelp)
         throw runtime_error(
             "getnettotals\n"
             "Returns information about network traffic, including bytes in, bytes out,\n"
-            "and current time.");
+            "the upload target and current time.");
 
     Object obj;
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    Object outboundLimit;
+    outboundLimit.push_back(Pair("timeframe", MAX_UPLOAD_TIMEFRAME));
+    outboundLimit.push_back(Pair("target", CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", CNode::OutboundTargetReached(false)));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
     return obj;
 }
+
+Value getnetstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnetstats\n"
+            "Returns traffic and message handling time by message command, and how\n"
+            "long messages waited to be sent, for all peers since startup. Times are\n"
+            "in milliseconds. Histograms count messages by time, in buckets whose\n"
+            "upper bounds are listed in \"histbuckets\"; the last bucket is open.");
+
+    vector<CNetCommandCounts> vCounts;
+    netStatsTotal.GetCommandCounts(vCounts);
+    CNetQueueCounts queueCounts;
+    netStatsTotal.GetQueueCounts(queueCounts);
+
+    Array buckets;
+    for (int i = 0; i < NET_STATS_TIME_BUCKETS - 1; i++)
+        buckets.push_back(GetNetStatsTimeBucketLimit(i) / 1000.0);
+
+    Object ret;
+    ret.push_back(Pair("histbuckets", buckets));
+    ret.push_back(Pair("commands", NetCommandCountsToJSON(vCounts, true)));
+    ret.push_back(Pair("sendqueue", NetQueueCountsToJSON(queueCounts, true)));
+    return ret;
+}
+
+Value getlockwaitstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getlockwaitstats\n"
+            "Returns, per message command, how often the message handlers took the\n"
+            "chain state lock and how long they waited for it, in milliseconds.");
+
+    map<string, CMainLockWaitStats> mapStats;
+    GetMainLockWaitStats(mapStats);
+
+    Object ret;
+    for (map<string, CMainLockWaitStats>::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it)
+    {
+        const CMainLockWaitStats& stats = it->second;
+        Object obj;
+        obj.push_back(Pair("count", (uint64_t)stats.nCount));
+        obj.push_back(Pair("totalwait", stats.nWaitMicros / 1000.0));
+        obj.push_back(Pair("averagewait", stats.nCount ? stats.nWaitMicros / 1000.0 / stats.nCount : 0.0));
+        obj.push_back(Pair("maxwait", stats.nMaxWaitMicros / 1000.0));
+        ret.push_back(Pair(it->first, obj));
+    }
+    return ret;
+}
@@ -8,6 +8,7 @@
 #include "base58.h"
 #include "rpcserver.h"
 #include "txdb.h"
+#include "txmempool.h"
 #include "init.h"
 #include "main.h"
 #include "net.h"
@@ -89,7 +90,7 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
     if (hashBlock != 0)
     {
         entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end() && (*mi).second)
         {
             CBlockIndex* pindex = (*mi).second;
@@ -394,7 +395,7 @@ Value signrawtransaction(const Array& params, bool fHelp)
         CTransaction tempTx;
         MapPrevTx mapPrevTx;
         CTxDB txdb("r");
-        map<uint256, CTxIndex> unused;
+        TxIndexMap unused;
         bool fInvalid;
 
         // FetchInputs aborts on failure, so we go one at a time.
@@ -828,6 +828,78 @@ public:
     }
 };
 
+/** Serializes into a buffer the caller owns, for example on the stack, so
+ *  that encoding a value doesn't allocate. Use GetSerializeSize to size it.
+ */
+class CBufferWriter
+{
+protected:
+    char* pbegin;
+    size_t nCapacity;
+    size_t nSize;
+
+public:
+    int nType;
+    int nVersion;
+
+    CBufferWriter(char* pbeginIn, size_t nCapacityIn, int nTypeIn, int nVersionIn) :
+        pbegin(pbeginIn), nCapacity(nCapacityIn), nSize(0), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    CBufferWriter& write(const char* pch, size_t nSize)
+    {
+        if (nSize > nCapacity - this->nSize)
+            throw std::ios_base::failure("CBufferWriter::write() : buffer full");
+        memcpy(pbegin + this->nSize, pch, nSize);
+        this->nSize += nSize;
+        return *this;
+    }
+
+    template<typename T>
+    CBufferWriter& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+
+    const char* data() const { return pbegin; }
+    size_t size() const { return nSize; }
+};
+
+/** Unserializes in place from a buffer owned by someone else, without the
+ *  copy a CDataStream makes.
+ */
+class CBufferReader
+{
+protected:
+    const char* pcur;
+    const char* pend;
+
+public:
+    int nType;
+    int nVersion;
+
+    CBufferReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn) :
+        pcur(pbeginIn), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    CBufferReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > (size_t)(pend - pcur))
+            throw std::ios_base::failure("CBufferReader::read() : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return *this;
+    }
+
+    template<typename T>
+    CBufferReader& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+
+    bool empty() const { return pcur == pend; }
+};
+
 /** Double ended buffer combining vector and stream-like interfaces.
  *
  * >> and << read and write unformatted data using the above serialization templates.
@@ -1120,6 +1192,12 @@ public:
         data.insert(data.end(), begin(), end());
         clear();
     }
+
+    // Exchange the whole buffer, unread data or not, with data
+    void SwapBuffer(CSerializeData &data) {
+        vch.swap(data);
+        nReadPos = 0;
+    }
 };
 
 
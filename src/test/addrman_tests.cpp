@@ -0,0 +1,98 @@
+#include <boost/test/unit_test.hpp>
+
+#include "addrman.h"
+#include "serialize.h"
+#include "test/addrman_util.h"
+#include "util.h"
+#include "version.h"
+
+using namespace std;
+
+// Exposes how many vInfo slots are in use
+class CAddrManTest : public CAddrMan
+{
+public:
+    size_t GetSlots() const
+    {
+        size_t nSlots, nFree;
+        GetIdUsage(nSlots, nFree);
+        return nSlots;
+    }
+
+    size_t GetFreeIds() const
+    {
+        size_t nSlots, nFree;
+        GetIdUsage(nSlots, nFree);
+        return nFree;
+    }
+};
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+BOOST_AUTO_TEST_CASE(addrman_reuse_ids)
+{
+    CAddrManTest addrman;
+    FillAddrMan(addrman, 2000, 100);
+    int nSize = addrman.size();
+    BOOST_CHECK(nSize > 1500);
+
+    // Failed attempts make entries less likely, but they can still be picked
+    for (unsigned int n = 0; n < 2000; n += 7)
+        addrman.Attempt(TestAddress(n));
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(addrman.Select().IsRoutable());
+
+    // Every slot holds an entry or waits in vFreeIds
+    BOOST_CHECK_EQUAL(addrman.GetSlots(), addrman.size() + addrman.GetFreeIds());
+
+    // Entries pushed out by collisions free their slots, and vInfo doesn't
+    // grow while one of them is left to take
+    unsigned int nReused = 0;
+    for (unsigned int n = 2000; n < 20000; n++)
+    {
+        size_t nSlots = addrman.GetSlots();
+        size_t nFree = addrman.GetFreeIds();
+        addrman.Add(TestAddress(n), TestSource(n));
+        if (nFree > 0)
+        {
+            BOOST_CHECK_EQUAL(addrman.GetSlots(), nSlots);
+            nReused++;
+        }
+        BOOST_CHECK_EQUAL(addrman.GetSlots(), addrman.size() + addrman.GetFreeIds());
+    }
+    BOOST_CHECK(nReused > 0);
+    BOOST_CHECK(addrman.size() > nSize);
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(addrman.Select().IsRoutable());
+}
+
+BOOST_AUTO_TEST_CASE(addrman_snapshot)
+{
+    CAddrMan addrman;
+    FillAddrMan(addrman, 5000, 200);
+
+    // A snapshot serializes to the same bytes as the tables it was taken of
+    CAddrMan addrSnapshot;
+    addrman.GetSnapshot(addrSnapshot);
+    CDataStream ssLive(SER_DISK, CLIENT_VERSION);
+    ssLive << addrman;
+    CDataStream ssSnapshot(SER_DISK, CLIENT_VERSION);
+    ssSnapshot << addrSnapshot;
+    BOOST_CHECK(ssLive.str() == ssSnapshot.str());
+
+    // and reads back as the same tables
+    CAddrMan addrRead;
+    ssSnapshot >> addrRead;
+    BOOST_CHECK_EQUAL(addrRead.size(), addrman.size());
+    CDataStream ssRead(SER_DISK, CLIENT_VERSION);
+    ssRead << addrRead;
+    BOOST_CHECK(ssRead.str() == ssLive.str());
+
+    // Changing the tables afterwards doesn't touch the snapshot
+    FillAddrMan(addrman, 8000, 0);
+    CDataStream ssAgain(SER_DISK, CLIENT_VERSION);
+    ssAgain << addrSnapshot;
+    BOOST_CHECK(ssAgain.str() == ssLive.str());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,39 @@
+// Copyright (c) 2016 The BiosCrypto developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_TEST_ADDRMAN_UTIL_H
+#define BITCOIN_TEST_ADDRMAN_UTIL_H
+
+// Generated address manager contents, shared by the addrman unit tests and
+// contrib/addrman-bench
+
+#include "addrman.h"
+#include "timedata.h"
+
+// A routable address, and a source, for every n; spread over many groups
+inline CAddress TestAddress(unsigned int n)
+{
+    struct in_addr ina;
+    ina.s_addr = htonl(((20 + n % 80) << 24) | ((n * 7919) & 0xffffff));
+    CAddress addr(CService(ina, 8333));
+    addr.nTime = GetAdjustedTime();
+    return addr;
+}
+
+inline CNetAddr TestSource(unsigned int n)
+{
+    struct in_addr ina;
+    ina.s_addr = htonl(((20 + n % 71) << 24) | ((n % 997) << 8) | 1);
+    return CNetAddr(ina);
+}
+
+// Offer nAddresses of them and mark nGood as good
+inline void FillAddrMan(CAddrMan& addrman, unsigned int nAddresses, unsigned int nGood)
+{
+    for (unsigned int n = 0; n < nAddresses; n++)
+        addrman.Add(TestAddress(n), TestSource(n));
+    for (unsigned int n = 0; n < nGood; n++)
+        addrman.Good(TestAddress(n * 13 % nAddresses));
+}
+
+#endif
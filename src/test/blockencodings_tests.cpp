@@ -0,0 +1,100 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockencodings.h"
+#include "txmempool.h"
+
+using namespace std;
+
+static CTransaction MakeTx(int64_t nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+// Coinbase followed by three transactions
+static CBlock MakeBlock()
+{
+    CBlock block;
+    block.vtx.resize(1);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.vtx[0].vin[0].scriptSig = CScript() << 1 << OP_0;
+    block.vtx[0].vout.resize(1);
+    block.vtx[0].vout[0].scriptPubKey = CScript() << OP_TRUE;
+    for (int i = 1; i <= 3; i++)
+        block.vtx.push_back(MakeTx(i * COIN));
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+BOOST_AUTO_TEST_CASE(cmpctblock_roundtrip)
+{
+    CBlock block = MakeBlock();
+    CTxMemPool pool;
+    pool.addUnchecked(block.vtx[1].GetHash(), CTxMemPoolEntry(block.vtx[1], 0, 0, 0.0, 0, 0, 1));
+    pool.addUnchecked(block.vtx[3].GetHash(), CTxMemPoolEntry(block.vtx[3], 0, 0, 0.0, 0, 0, 1));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CCompactBlock(block);
+    CCompactBlock cmpctblock;
+    ss >> cmpctblock;
+    BOOST_CHECK(cmpctblock.GetBlockHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilled.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.shortids.v.size(), 3U);
+    BOOST_CHECK_EQUAL(::GetSerializeSize(cmpctblock.shortids, SER_NETWORK, PROTOCOL_VERSION), 1U + 3 * 6);
+
+    // The transaction missing from the pool is requested
+    CPartialBlock partial;
+    BOOST_CHECK(partial.InitData(cmpctblock, pool, vector<boost::shared_ptr<const CTransaction> >()));
+    BOOST_CHECK(partial.IsTxAvailable(0) && partial.IsTxAvailable(1) && partial.IsTxAvailable(3));
+    vector<unsigned int> vMissing;
+    partial.GetMissing(vMissing);
+    BOOST_CHECK(vMissing == vector<unsigned int>(1, 2));
+
+    CBlock blockOut;
+    BOOST_CHECK(!partial.FillBlock(blockOut, vector<CTransaction>()));
+    BOOST_CHECK(!partial.FillBlock(blockOut, vector<CTransaction>(1, MakeTx(COIN))));
+    BOOST_CHECK(partial.FillBlock(blockOut, vector<CTransaction>(1, block.vtx[2])));
+    BOOST_CHECK(blockOut.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(blockOut.vtx.size(), block.vtx.size());
+
+    // ... unless an extra transaction, e.g. an orphan, provides it
+    vector<boost::shared_ptr<const CTransaction> > vExtra(1, boost::shared_ptr<const CTransaction>(new CTransaction(block.vtx[2])));
+    CPartialBlock partial2;
+    BOOST_CHECK(partial2.InitData(cmpctblock, pool, vExtra));
+    partial2.GetMissing(vMissing);
+    BOOST_CHECK(vMissing.empty());
+    BOOST_CHECK_EQUAL(partial2.nFromPool, 2U);
+    BOOST_CHECK_EQUAL(partial2.nFromExtra, 1U);
+    BOOST_CHECK(partial2.FillBlock(blockOut, vector<CTransaction>()));
+    BOOST_CHECK(blockOut.hashMerkleRoot == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_invalid)
+{
+    CBlock block = MakeBlock();
+    CTxMemPool pool;
+
+    // Prefilled positions out of order or out of range
+    CCompactBlock cmpctblock(block);
+    cmpctblock.vPrefilled.push_back(CPrefilledTransaction(0, block.vtx[0]));
+    CPartialBlock partial;
+    BOOST_CHECK(!partial.InitData(cmpctblock, pool, vector<boost::shared_ptr<const CTransaction> >()));
+
+    CCompactBlock cmpctblock2(block);
+    cmpctblock2.vPrefilled[0].nIndex = 4;
+    BOOST_CHECK(!partial.InitData(cmpctblock2, pool, vector<boost::shared_ptr<const CTransaction> >()));
+
+    BOOST_CHECK(!partial.InitData(CCompactBlock(), pool, vector<boost::shared_ptr<const CTransaction> >()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,75 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bloom.h"
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(bloom_tests)
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // Last 100 entries are always remembered, with about a 1% false positive rate
+    CRollingBloomFilter rb1(100, 0.01);
+
+    vector<uint256> vData;
+    for (int i = 0; i < 399; i++)
+        vData.push_back(GetRandHash());
+    for (unsigned int i = 0; i < 399; i++)
+    {
+        rb1.insert(vData[i]);
+        BOOST_CHECK(rb1.contains(vData[i]));
+        // The previous 100 are still there
+        for (unsigned int j = (i >= 100 ? i - 100 : 0); j < i; j++)
+            BOOST_CHECK(rb1.contains(vData[j]));
+    }
+
+    // Random items not inserted match about 1% of the time
+    int nHits = 0;
+    for (int i = 0; i < 10000; i++)
+        if (rb1.contains(GetRandHash()))
+            nHits++;
+    BOOST_CHECK(nHits < 300);
+
+    // Items from three generations back are gone, bar false positives
+    nHits = 0;
+    for (int i = 0; i < 100; i++)
+        if (rb1.contains(vData[i]))
+            nHits++;
+    BOOST_CHECK(nHits < 10);
+
+    // reset forgets everything
+    rb1.reset();
+    nHits = 0;
+    for (int i = 0; i < 399; i++)
+        if (rb1.contains(vData[i]))
+            nHits++;
+    BOOST_CHECK(nHits < 15);
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom_keys)
+{
+    CRollingBloomFilter rb(1000, 0.000001);
+    uint256 hash = GetRandHash();
+
+    // Inventory of different types is different
+    rb.insert(CInv(MSG_TX, hash));
+    BOOST_CHECK(rb.contains(CInv(MSG_TX, hash)));
+    BOOST_CHECK(!rb.contains(CInv(MSG_BLOCK, hash)));
+
+    // So is the same address on another port
+    CService addr("1.2.3.4", 8333);
+    rb.insert(addr);
+    BOOST_CHECK(rb.contains(CService("1.2.3.4", 8333)));
+    BOOST_CHECK(!rb.contains(CService("1.2.3.4", 8334)));
+    BOOST_CHECK(!rb.contains(CService("1.2.3.5", 8333)));
+
+    // Memory doesn't grow with use
+    size_t nUsage = rb.GetMemoryUsage();
+    for (int i = 0; i < 10000; i++)
+        rb.insert(GetRandHash());
+    BOOST_CHECK_EQUAL(rb.GetMemoryUsage(), nUsage);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
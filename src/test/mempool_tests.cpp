@@ -0,0 +1,113 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txmempool.h"
+
+using namespace std;
+
+// Transaction spending output 0 of each of vParents (or a made-up
+// confirmed output if there are none)
+static CTransaction MakeTx(const vector<uint256>& vParents, int64_t nValue)
+{
+    CTransaction tx;
+    if (vParents.empty())
+    {
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    }
+    BOOST_FOREACH(const uint256& hash, vParents)
+        tx.vin.push_back(CTxIn(COutPoint(hash, 0)));
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+static uint256 AddTx(CTxMemPool& pool, const CTransaction& tx, int64_t nFee, int64_t nTime = 0)
+{
+    uint256 hash = tx.GetHash();
+    pool.addUnchecked(hash, CTxMemPoolEntry(tx, nFee, 0, 0.0, 0, nTime, 1));
+    return hash;
+}
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(mempool_package_state)
+{
+    CTxMemPool pool;
+    LOCK(pool.cs);
+
+    // parent <- child <- grandchild
+    CTransaction txParent = MakeTx(vector<uint256>(), 10 * COIN);
+    uint256 hashParent = AddTx(pool, txParent, 1000);
+    CTransaction txChild = MakeTx(vector<uint256>(1, hashParent), 9 * COIN);
+    uint256 hashChild = AddTx(pool, txChild, 2000);
+    CTransaction txGrandChild = MakeTx(vector<uint256>(1, hashChild), 8 * COIN);
+    uint256 hashGrandChild = AddTx(pool, txGrandChild, 40000);
+
+    BOOST_CHECK_EQUAL(pool.mapTx[hashParent].GetCountWithDescendants(), 3U);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashParent].GetFeesWithDescendants(), 43000);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashGrandChild].GetCountWithAncestors(), 3U);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashGrandChild].GetFeesWithAncestors(), 43000);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashChild].GetCountWithAncestors(), 2U);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashChild].GetCountWithDescendants(), 2U);
+
+    // Best package by ancestor fee rate is the grandchild's
+    BOOST_CHECK(pool.setByAncestorFeeRate.rbegin()->hash == hashGrandChild);
+    BOOST_CHECK_EQUAL(pool.setByAncestorFeeRate.size(), 3U);
+    BOOST_CHECK_EQUAL(pool.setByFeeRate.size(), 3U);
+
+    // Parent mined: the others lose an ancestor
+    pool.remove(txParent);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashChild].GetCountWithAncestors(), 1U);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashGrandChild].GetCountWithAncestors(), 2U);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashGrandChild].GetFeesWithAncestors(), 42000);
+    BOOST_CHECK(pool.GetMemPoolParents(hashChild).empty());
+
+    // Parent resurrected by a reorganisation: links and totals are restored
+    AddTx(pool, txParent, 1000);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashGrandChild].GetCountWithAncestors(), 3U);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashParent].GetCountWithDescendants(), 3U);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(hashParent).count(hashChild), 1U);
+
+    // Removing the child recursively takes the grandchild with it
+    pool.remove(txChild, true);
+    BOOST_CHECK_EQUAL(pool.mapTx.size(), 1U);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashParent].GetCountWithDescendants(), 1U);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashParent].GetSizeWithDescendants(), pool.mapTx[hashParent].GetTxSize());
+    BOOST_CHECK_EQUAL(pool.setByAncestorFeeRate.size(), 1U);
+    BOOST_CHECK(pool.mapNextTx.size() == txParent.vin.size());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim_and_expire)
+{
+    CTxMemPool pool;
+    LOCK(pool.cs);
+
+    // A low fee parent with a high fee child outranks a medium fee loner
+    CTransaction txLow = MakeTx(vector<uint256>(), COIN);
+    uint256 hashLow = AddTx(pool, txLow, 100, 1000);
+    CTransaction txChild = MakeTx(vector<uint256>(1, hashLow), COIN / 2);
+    uint256 hashChild = AddTx(pool, txChild, 100000, 3000);
+    CTransaction txMedium = MakeTx(vector<uint256>(), COIN);
+    uint256 hashMedium = AddTx(pool, txMedium, 10000, 2000);
+
+    BOOST_CHECK_EQUAL(pool.GetRollingMinFee(1000000), 0);
+    size_t nUsage = pool.DynamicUsage();
+    BOOST_CHECK(nUsage > pool.GetTotalTxSize());
+
+    // Evict just enough: the lowest package by descendant fee rate goes
+    BOOST_CHECK_EQUAL(pool.TrimToSize(nUsage - 1), 1U);
+    BOOST_CHECK(!pool.mapTx.count(hashMedium));
+    BOOST_CHECK(pool.mapTx.count(hashLow) && pool.mapTx.count(hashChild));
+    BOOST_CHECK(pool.GetRollingMinFee(1000000) >= MIN_RELAY_TX_FEE);
+    BOOST_CHECK_EQUAL(pool.GetEvictedCount(), 1U);
+
+    // Expiring the parent takes the child with it
+    BOOST_CHECK_EQUAL(pool.Expire(1500), 2U);
+    BOOST_CHECK(pool.mapTx.empty());
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 0U);
+    BOOST_CHECK_EQUAL(pool.DynamicUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -42,4 +42,32 @@ BOOST_AUTO_TEST_CASE(varints)
 
 }
 
+BOOST_AUTO_TEST_CASE(buffer_streams)
+{
+    // A buffer writer produces the same bytes as a CDataStream
+    vector<int> v(10, 7);
+    string str("buffer");
+    CDataStream ss(SER_DISK, 0);
+    ss << VARINT(1000) << v << str;
+    char pch[64];
+    CBufferWriter writer(pch, sizeof(pch), SER_DISK, 0);
+    writer << VARINT(1000) << v << str;
+    BOOST_CHECK(writer.size() == ss.size());
+    BOOST_CHECK(string(writer.data(), writer.size()) == ss.str());
+
+    // and a buffer reader reads them back in place
+    int n;
+    vector<int> v2;
+    string str2;
+    CBufferReader reader(writer.data(), writer.data() + writer.size(), SER_DISK, 0);
+    reader >> VARINT(n) >> v2 >> str2;
+    BOOST_CHECK(n == 1000 && v2 == v && str2 == str);
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+
+    // Neither runs past the end of its buffer
+    CBufferWriter writerShort(pch, 8, SER_DISK, 0);
+    BOOST_CHECK_THROW(writerShort << str << str, std::ios_base::failure);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -15,4 +15,20 @@ BOOST_AUTO_TEST_CASE(uint256_equality)
     BOOST_CHECK(num1+num2 == num3+num2);
 }
 
+BOOST_AUTO_TEST_CASE(uint256_siphash)
+{
+    // Reference SipHash-2-4 of the bytes 00..1f and 00..23
+    std::vector<unsigned char> vch(32);
+    for (int i = 0; i < 32; i++)
+        vch[i] = i;
+    uint256 num(vch);
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, num), 0x7127512f72f27cceULL);
+    BOOST_CHECK_EQUAL(SipHashUint256Extra(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, num, 0x23222120), 0x314dffbe0815a3b4ULL);
+
+    // Salted: equal values hash equally within the process
+    SaltedUint256Hasher hasher;
+    BOOST_CHECK_EQUAL(hasher(num), SaltedUint256Hasher()(num));
+    BOOST_CHECK(hasher(num) != hasher(num + 1));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
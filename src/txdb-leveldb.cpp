@@ -5,9 +5,12 @@
 
 #include <map>
 
+#include <boost/atomic.hpp>
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/thread.hpp>
 
 #include <leveldb/env.h>
 #include <leveldb/cache.h>
@@ -20,20 +23,96 @@
 #include "util.h"
 #include "main.h"
 #include "chainparams.h"
+#include "ui_interface.h"
 
 using namespace std;
 using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+// Last index version keyed by serialized (string, hash) pairs and with the
+// full vSpent vector in every transaction index record.
+static const int DATABASE_VERSION_LEGACY_KEYS = 70509;
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
     int nCacheSizeMB = GetArg("-dbcache", 25);
     options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    int nBloomBits = GetArg("-dbbloombits", 10);
+    options.filter_policy = nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(nBloomBits) : NULL;
+    // The remaining defaults are LevelDB's own.
+    options.write_buffer_size = GetArg("-dbwritebuffer", 4) * 1048576;
+    options.max_open_files = GetArg("-dbmaxopenfiles", 1000);
+    options.block_size = GetArg("-dbblocksize", 4) * 1024;
+    options.compression = GetBoolArg("-dbcompression", true) ? leveldb::kSnappyCompression : leveldb::kNoCompression;
     return options;
 }
 
+// Access counters reported by getdbstats. A write that takes longer than
+// this is counted as slow. That includes writers LevelDB delays while level
+// 0 compactions catch up, but also large batches and synced writes, so it is
+// not a compaction stall count; leveldb.stats has the compaction picture.
+// The counters are relaxed atomics, so counting adds no lock to every read
+// and write; getdbstats may see them mid-update.
+static const int64_t DB_SLOW_WRITE_MICROS = 1000;
+static boost::atomic<uint64_t> nDBGets(0), nDBGetMicros(0);
+static boost::atomic<uint64_t> nDBWrites(0), nDBWriteMicros(0);
+static boost::atomic<uint64_t> nDBSlowWrites(0), nDBSlowWriteMicros(0);
+
+CTxDBStats GetTxDBStats()
+{
+    CTxDBStats stats;
+    stats.nGets = nDBGets.load(boost::memory_order_relaxed);
+    stats.nGetMicros = nDBGetMicros.load(boost::memory_order_relaxed);
+    stats.nWrites = nDBWrites.load(boost::memory_order_relaxed);
+    stats.nWriteMicros = nDBWriteMicros.load(boost::memory_order_relaxed);
+    stats.nSlowWrites = nDBSlowWrites.load(boost::memory_order_relaxed);
+    stats.nSlowWriteMicros = nDBSlowWriteMicros.load(boost::memory_order_relaxed);
+    return stats;
+}
+
+static void RecordGet(int64_t nMicros)
+{
+    nDBGets.fetch_add(1, boost::memory_order_relaxed);
+    nDBGetMicros.fetch_add(nMicros, boost::memory_order_relaxed);
+}
+
+static void RecordWrite(int64_t nMicros)
+{
+    nDBWrites.fetch_add(1, boost::memory_order_relaxed);
+    nDBWriteMicros.fetch_add(nMicros, boost::memory_order_relaxed);
+    if (nMicros > DB_SLOW_WRITE_MICROS)
+    {
+        nDBSlowWrites.fetch_add(1, boost::memory_order_relaxed);
+        nDBSlowWriteMicros.fetch_add(nMicros, boost::memory_order_relaxed);
+    }
+}
+
+// Optional key-access trace (-dbtrace=<file>) for replaying the txdb load
+// with contrib/txdb-bench. Each record is the operation ('G'et, 'P'ut,
+// 'D'elete or batch 'C'ommit), the key length and key, and the value size.
+// fileDBTrace is only touched under cs_dbtrace; fDBTrace lets accesses skip
+// the lock while no trace is open.
+static CCriticalSection cs_dbtrace;
+static FILE* fileDBTrace = NULL;
+static boost::atomic<bool> fDBTrace(false);
+
+static void TraceAccess(char chOp, const leveldb::Slice& key, uint32_t nValueSize)
+{
+    if (!fDBTrace.load(boost::memory_order_relaxed))
+        return;
+    LOCK(cs_dbtrace);
+    if (!fileDBTrace)
+        return;
+    unsigned char chKeySize = std::min(key.size(), (size_t)255);
+    unsigned char pchValueSize[4] = { (unsigned char)nValueSize, (unsigned char)(nValueSize >> 8),
+                                      (unsigned char)(nValueSize >> 16), (unsigned char)(nValueSize >> 24) };
+    fwrite(&chOp, 1, 1, fileDBTrace);
+    fwrite(&chKeySize, 1, 1, fileDBTrace);
+    fwrite(key.data(), 1, chKeySize, fileDBTrace);
+    fwrite(pchValueSize, 1, sizeof(pchValueSize), fileDBTrace);
+}
+
 static void init_blockindex(leveldb::Options& options, bool fRemoveOld = false, bool fCreateBootstrap = false) {
     // First time init.
     filesystem::path directory = GetDataDir() / "txleveldb";
@@ -86,17 +165,43 @@ CTxDB::CTxDB(const char* pszMode)
 
     options = GetOptions();
     options.create_if_missing = fCreate;
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
 
     init_blockindex(options); // Init directory
     pdb = txdb;
 
+    if (mapArgs.count("-dbtrace"))
+    {
+        LOCK(cs_dbtrace);
+        if (!fileDBTrace)
+        {
+            filesystem::path pathTrace(mapArgs["-dbtrace"]);
+            if (!pathTrace.is_complete())
+                pathTrace = GetDataDir() / pathTrace;
+            fileDBTrace = fopen(pathTrace.string().c_str(), "ab");
+            if (fileDBTrace)
+            {
+                fDBTrace = true;
+                LogPrintf("Tracing txdb access to %s\n", pathTrace.string());
+            }
+        }
+    }
+
     if (Exists(string("version")))
     {
         ReadVersion(nVersion);
         LogPrintf("Transaction index version is %d\n", nVersion);
 
-        if (nVersion < DATABASE_VERSION)
+        if (nVersion == DATABASE_VERSION_LEGACY_KEYS)
+        {
+            // Same data under the old string keys; convert it in place.
+            bool fTmp = fReadOnly;
+            fReadOnly = false;
+            if (!MigrateCompactKeys())
+                throw runtime_error("CTxDB() : failed to convert the transaction index to the compact format");
+            WriteVersion(DATABASE_VERSION);
+            fReadOnly = fTmp;
+        }
+        else if (nVersion < DATABASE_VERSION)
         {
             LogPrintf("Required index version is %d, removing old database\n", DATABASE_VERSION);
 
@@ -126,8 +231,88 @@ CTxDB::CTxDB(const char* pszMode)
     LogPrintf("Opened LevelDB successfully\n");
 }
 
+bool CTxDB::MigrateCompactKeys()
+{
+    LogPrintf("Converting transaction index to compact keys...\n");
+    int64_t nStart = GetTimeMillis();
+
+    const char* vpszType[] = { "tx", "blockindex" };
+    for (unsigned int nType = 0; nType < sizeof(vpszType) / sizeof(vpszType[0]); nType++)
+    {
+        const string strType = vpszType[nType];
+        CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+        ssStartKey << make_pair(strType, uint256(0));
+        const string strPrefix = ssStartKey.str().substr(0, ssStartKey.size() - sizeof(uint256));
+
+        // Each batch adds the new records and deletes the old ones, so an
+        // interrupted conversion simply continues on the next start.
+        unsigned int nCount = 0;
+        leveldb::WriteBatch batch;
+        leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+        for (iterator->Seek(ssStartKey.str()); iterator->Valid(); iterator->Next())
+        {
+            leveldb::Slice key = iterator->key();
+            if (!key.starts_with(strPrefix) || key.size() != strPrefix.size() + sizeof(uint256))
+                break;
+            uint256 hash;
+            memcpy(hash.begin(), key.data() + strPrefix.size(), sizeof(uint256));
+
+            if (strType == "tx")
+            {
+                int nLegacyVersion;
+                CTxIndex txindex;
+                try {
+                    CDataStream ssValue(iterator->value().data(), iterator->value().data() + iterator->value().size(), SER_DISK, CLIENT_VERSION);
+                    ssValue >> nLegacyVersion >> txindex.pos >> txindex.vSpent;
+                }
+                catch (std::exception &e) {
+                    delete iterator;
+                    return error("MigrateCompactKeys() : deserialize error for tx %s", hash.ToString());
+                }
+                CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+                ssValue << txindex;
+                batch.Put(CTxDBKey(DB_TXINDEX, hash).GetSlice(), leveldb::Slice(&ssValue[0], ssValue.size()));
+            }
+            else
+                batch.Put(CTxDBKey(DB_BLOCKINDEX, hash).GetSlice(), iterator->value());
+            batch.Delete(key);
+
+            if (++nCount % 10000 == 0)
+            {
+                leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+                if (!status.ok()) {
+                    delete iterator;
+                    return error("MigrateCompactKeys() : batch commit failure: %s", status.ToString());
+                }
+                batch.Clear();
+                LogPrintf("MigrateCompactKeys() : %u %s records converted\n", nCount, strType);
+            }
+        }
+        delete iterator;
+        leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+        if (!status.ok())
+            return error("MigrateCompactKeys() : batch commit failure: %s", status.ToString());
+        LogPrintf("MigrateCompactKeys() : %u %s records converted\n", nCount, strType);
+    }
+
+    // Reclaim the space of the old records.
+    pdb->CompactRange(NULL, NULL);
+
+    LogPrintf("Converted transaction index in %dms\n", GetTimeMillis() - nStart);
+    return true;
+}
+
 void CTxDB::Close()
 {
+    {
+        LOCK(cs_dbtrace);
+        if (fileDBTrace)
+        {
+            fDBTrace = false;
+            fclose(fileDBTrace);
+            fileDBTrace = NULL;
+        }
+    }
     delete txdb;
     txdb = pdb = NULL;
     delete options.filter_policy;
@@ -148,7 +333,10 @@ bool CTxDB::TxnBegin()
 bool CTxDB::TxnCommit()
 {
     assert(activeBatch);
+    TraceAccess('C', leveldb::Slice(), 0);
+    int64_t nStart = GetTimeMicros();
     leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
+    RecordWrite(GetTimeMicros() - nStart);
     delete activeBatch;
     activeBatch = NULL;
     if (!status.ok()) {
@@ -160,7 +348,7 @@ bool CTxDB::TxnCommit()
 
 class CBatchScanner : public leveldb::WriteBatch::Handler {
 public:
-    std::string needle;
+    leveldb::Slice needle;
     bool *deleted;
     std::string *foundValue;
     bool foundEntry;
@@ -168,15 +356,15 @@ public:
     CBatchScanner() : foundEntry(false) {}
 
     virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
+        if (key == needle) {
             foundEntry = true;
             *deleted = false;
-            *foundValue = value.ToString();
+            foundValue->assign(value.data(), value.size());
         }
     }
 
     virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
+        if (key == needle) {
             foundEntry = true;
             *deleted = true;
         }
@@ -188,11 +376,11 @@ public:
 // a database transaction begins reads are consistent with it. It would be good
 // to change that assumption in future and avoid the performance hit, though in
 // practice it does not appear to be large.
-bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
+bool CTxDB::ScanBatch(const leveldb::Slice &key, string *value, bool *deleted) const {
     assert(activeBatch);
     *deleted = false;
     CBatchScanner scanner;
-    scanner.needle = key.str();
+    scanner.needle = key;
     scanner.deleted = deleted;
     scanner.foundValue = value;
     leveldb::Status status = activeBatch->Iterate(&scanner);
@@ -202,15 +390,109 @@ bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) cons
     return scanner.foundEntry;
 }
 
+bool CTxDB::ReadRaw(const leveldb::Slice& key, string& strValue)
+{
+    if (activeBatch) {
+        // First we must search for it in the currently pending set of
+        // changes to the db. If not found in the batch, go on to read disk.
+        bool deleted = false;
+        if (ScanBatch(key, &strValue, &deleted))
+            return !deleted;
+    }
+    int64_t nStart = GetTimeMicros();
+    leveldb::Status status = pdb->Get(leveldb::ReadOptions(), key, &strValue);
+    RecordGet(GetTimeMicros() - nStart);
+    TraceAccess('G', key, strValue.size());
+    if (!status.ok()) {
+        if (status.IsNotFound())
+            return false;
+        // Some unexpected error.
+        LogPrintf("LevelDB read failure: %s\n", status.ToString());
+        return false;
+    }
+    return true;
+}
+
+bool CTxDB::WriteRaw(const leveldb::Slice& key, const leveldb::Slice& value)
+{
+    if (fReadOnly)
+        assert(!"Write called on database in read-only mode");
+
+    TraceAccess('P', key, value.size());
+    if (activeBatch) {
+        activeBatch->Put(key, value);
+        return true;
+    }
+    TraceAccess('C', leveldb::Slice(), 0);
+    int64_t nStart = GetTimeMicros();
+    leveldb::Status status = pdb->Put(leveldb::WriteOptions(), key, value);
+    RecordWrite(GetTimeMicros() - nStart);
+    if (!status.ok()) {
+        LogPrintf("LevelDB write failure: %s\n", status.ToString());
+        return false;
+    }
+    return true;
+}
+
+bool CTxDB::EraseRaw(const leveldb::Slice& key)
+{
+    if (!pdb)
+        return false;
+    if (fReadOnly)
+        assert(!"Erase called on database in read-only mode");
+
+    TraceAccess('D', key, 0);
+    if (activeBatch) {
+        activeBatch->Delete(key);
+        return true;
+    }
+    TraceAccess('C', leveldb::Slice(), 0);
+    int64_t nStart = GetTimeMicros();
+    leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), key);
+    RecordWrite(GetTimeMicros() - nStart);
+    return (status.ok() || status.IsNotFound());
+}
+
+bool CTxDB::ExistsRaw(const leveldb::Slice& key)
+{
+    if (activeBatch) {
+        bool deleted;
+        if (ScanBatch(key, &strValueBuffer, &deleted) && !deleted) {
+            return true;
+        }
+    }
+
+    int64_t nStart = GetTimeMicros();
+    leveldb::Status status = pdb->Get(leveldb::ReadOptions(), key, &strValueBuffer);
+    RecordGet(GetTimeMicros() - nStart);
+    TraceAccess('G', key, strValueBuffer.size());
+    return status.IsNotFound() == false;
+}
+
+bool CTxDB::GetProperty(const string& strName, string& strValue)
+{
+    return pdb->GetProperty(strName, &strValue);
+}
+
+uint64_t CTxDB::GetApproximateSize(char chType)
+{
+    const char pchBegin[1] = { chType };
+    const char pchEnd[1] = { (char)(chType + 1) };
+    leveldb::Range range(leveldb::Slice(pchBegin, 1), leveldb::Slice(pchEnd, 1));
+    uint64_t nSize = 0;
+    pdb->GetApproximateSizes(&range, 1, &nSize);
+    return nSize;
+}
+
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
+    return Read(CTxDBKey(DB_TXINDEX, hash), txindex);
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
-    return Write(make_pair(string("tx"), hash), txindex);
+    return Write(CTxDBKey(DB_TXINDEX, hash), txindex);
 }
 
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
@@ -218,19 +500,19 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    return Write(CTxDBKey(DB_TXINDEX, hash), txindex);
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
 {
     uint256 hash = tx.GetHash();
 
-    return Erase(make_pair(string("tx"), hash));
+    return Erase(CTxDBKey(DB_TXINDEX, hash));
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
-    return Exists(make_pair(string("tx"), hash));
+    return Exists(CTxDBKey(DB_TXINDEX, hash));
 }
 
 bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
@@ -260,7 +542,7 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
 
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
-    return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
+    return Write(CTxDBKey(DB_BLOCKINDEX, blockindex.GetBlockHash()), blockindex);
 }
 
 bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
@@ -309,7 +591,7 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
@@ -323,39 +605,223 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
-bool CTxDB::LoadBlockIndex()
+// Block index snapshot, written on clean shutdown so that the next startup
+// can load the whole index with one sequential read instead of walking every
+// block index key in LevelDB. It is removed as soon as it has been read, so
+// it can never be older than the database it describes.
+static filesystem::path BlockIndexSnapshotPath()
 {
-    if (mapBlockIndex.size() > 0) {
-        // Already loaded once in this session. It can happen during migration
-        // from BDB.
-        return true;
+    return GetDataDir() / "blkindex.dat";
+}
+
+bool CTxDB::WriteBlockIndexSnapshot()
+{
+    uint256 hashBest;
+    if (!ReadHashBestChain(hashBest) || hashBest != hashBestChain)
+        return error("WriteBlockIndexSnapshot() : best chain not committed to the database");
+
+    vector<pair<uint256, CDiskBlockIndex> > vIndex;
+    vIndex.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vIndex.push_back(make_pair(item.first, CDiskBlockIndex(item.second)));
+
+    // serialize header and index, checksum data up to that point, then append csum
+    CDataStream ssIndex(SER_DISK, CLIENT_VERSION);
+    ssIndex << FLATDATA(Params().MessageStart());
+    ssIndex << DATABASE_VERSION << hashBest;
+    ssIndex << vIndex;
+    uint256 hash = Hash(ssIndex.begin(), ssIndex.end());
+    ssIndex << hash;
+
+    filesystem::path pathSnapshot = BlockIndexSnapshotPath();
+    filesystem::path pathTmp = GetDataDir() / "blkindex.dat.new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("WriteBlockIndexSnapshot() : open failed");
+
+    try {
+        fileout << ssIndex;
     }
-    // The block index is an in-memory structure that maps hashes to on-disk
-    // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
+    catch (std::exception &e) {
+        return error("WriteBlockIndexSnapshot() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, pathSnapshot))
+        return error("WriteBlockIndexSnapshot() : Rename-into-place failed");
+
+    LogPrintf("Wrote block index snapshot with %u entries\n", vIndex.size());
+    return true;
+}
+
+bool CTxDB::ReadBlockIndexSnapshot(vector<pair<uint256, CDiskBlockIndex> >& vIndex)
+{
+    filesystem::path pathSnapshot = BlockIndexSnapshotPath();
+    if (!filesystem::exists(pathSnapshot))
+        return false;
+
+    // A snapshot is only good for the startup right after the shutdown that
+    // wrote it; anything written from now on goes to LevelDB alone.
+    vector<unsigned char> vchData;
+    uint256 hashIn;
+    {
+        FILE *file = fopen(pathSnapshot.string().c_str(), "rb");
+        CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+        if (!filein)
+            return error("ReadBlockIndexSnapshot() : open failed");
+
+        int64_t nDataSize = filesystem::file_size(pathSnapshot) - (int64_t)sizeof(uint256);
+        if (nDataSize < 0)
+            nDataSize = 0;
+        vchData.resize(nDataSize);
+        try {
+            if (nDataSize > 0)
+                filein.read((char *)&vchData[0], nDataSize);
+            filein >> hashIn;
+        }
+        catch (std::exception &e) {
+            vchData.clear();
+        }
+    }
+    filesystem::remove(pathSnapshot);
+    if (vchData.empty())
+        return error("ReadBlockIndexSnapshot() : I/O error");
+
+    CDataStream ssIndex(vchData, SER_DISK, CLIENT_VERSION);
+    if (hashIn != Hash(ssIndex.begin(), ssIndex.end()))
+        return error("ReadBlockIndexSnapshot() : checksum mismatch; data corrupted");
+
+    uint256 hashBest;
+    if (!ReadHashBestChain(hashBest))
+        return false;
+
+    unsigned char pchMsgTmp[4];
+    int nSnapshotVersion;
+    uint256 hashSnapshotBest;
+    try {
+        ssIndex >> FLATDATA(pchMsgTmp);
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
+            return error("ReadBlockIndexSnapshot() : invalid network magic number");
+
+        ssIndex >> nSnapshotVersion >> hashSnapshotBest;
+        if (nSnapshotVersion != DATABASE_VERSION || hashSnapshotBest != hashBest)
+            return error("ReadBlockIndexSnapshot() : snapshot does not match the database");
+
+        ssIndex >> vIndex;
+    }
+    catch (std::exception &e) {
+        vIndex.clear();
+        return error("ReadBlockIndexSnapshot() : I/O error or stream data corrupted");
+    }
+
+    // Every block above genesis has its parent in the index, so no height
+    // reaches the entry count. LoadBlockIndex sizes a vector by the highest
+    // one; leave a snapshot that says otherwise to the LevelDB scan.
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        int nHeight = vIndex[i].second.nHeight;
+        if (nHeight < 0 || (unsigned int)nHeight >= vIndex.size())
+        {
+            vIndex.clear();
+            return error("ReadBlockIndexSnapshot() : height %d out of range; data corrupted", nHeight);
+        }
+    }
+
+    return true;
+}
+
+static void DecodeBlockIndexRange(const vector<string>* pvValues, vector<pair<uint256, CDiskBlockIndex> >* pvIndex,
+                                  size_t nBegin, size_t nEnd, bool* pfError)
+{
+    try {
+        for (size_t i = nBegin; i < nEnd; i++)
+        {
+            const string& strValue = (*pvValues)[i];
+            CBufferReader ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            CDiskBlockIndex& diskindex = (*pvIndex)[i].second;
+            ssValue >> diskindex;
+            (*pvIndex)[i].first = diskindex.GetBlockHash();
+        }
+    }
+    catch (std::exception &e) {
+        *pfError = true;
+    }
+}
+
+bool CTxDB::ReadBlockIndexEntries(vector<pair<uint256, CDiskBlockIndex> >& vIndex)
+{
+    // Collect the raw values first; the iterator itself is sequential, but
+    // deserializing and hashing the headers is not and is spread over all cores.
+    vector<string> vValues;
     leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
     // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
-    iterator->Seek(ssStartKey.str());
+    iterator->Seek(CTxDBKey(DB_BLOCKINDEX, 0).GetSlice());
     // Now read each entry.
     while (iterator->Valid())
     {
         boost::this_thread::interruption_point();
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
         // Did we reach the end of the data to read?
-        if (strType != "blockindex")
+        leveldb::Slice key = iterator->key();
+        if (key.size() != 1 + sizeof(uint256) || key[0] != DB_BLOCKINDEX)
             break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
+        vValues.push_back(iterator->value().ToString());
+        iterator->Next();
+    }
+    delete iterator;
+
+    vIndex.resize(vValues.size());
+    bool fError = false;
+    size_t nThreads = std::max(1u, std::min(8u, boost::thread::hardware_concurrency()));
+    if (vValues.size() < 1000 * nThreads)
+        nThreads = 1;
+    if (nThreads == 1)
+        DecodeBlockIndexRange(&vValues, &vIndex, 0, vValues.size(), &fError);
+    else
+    {
+        boost::scoped_array<bool> pfErrors(new bool[nThreads]);
+        boost::thread_group threadGroup;
+        for (size_t n = 0; n < nThreads; n++)
+        {
+            pfErrors[n] = false;
+            size_t nBegin = vValues.size() * n / nThreads;
+            size_t nEnd = vValues.size() * (n + 1) / nThreads;
+            threadGroup.create_thread(boost::bind(&DecodeBlockIndexRange, &vValues, &vIndex, nBegin, nEnd, &pfErrors[n]));
+        }
+        threadGroup.join_all();
+        for (size_t n = 0; n < nThreads; n++)
+            fError |= pfErrors[n];
+    }
+    if (fError)
+        return error("LoadBlockIndex() : deserialize error");
 
-        uint256 blockHash = diskindex.GetBlockHash();
+    return true;
+}
+
+bool CTxDB::LoadBlockIndex()
+{
+    if (mapBlockIndex.size() > 0) {
+        // Already loaded once in this session. It can happen during migration
+        // from BDB.
+        return true;
+    }
+    // The block index is an in-memory structure that maps hashes to on-disk
+    // locations where the contents of the block can be found. Here, we read it
+    // from the shutdown snapshot, or scan it out of the DB, into mapBlockIndex.
+    vector<pair<uint256, CDiskBlockIndex> > vIndex;
+    if (ReadBlockIndexSnapshot(vIndex))
+        LogPrintf("LoadBlockIndex(): loaded %u entries from block index snapshot\n", vIndex.size());
+    else if (!ReadBlockIndexEntries(vIndex))
+        return false;
+
+    boost::this_thread::interruption_point();
+
+    int nMaxHeight = 0;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CDiskBlockIndex)& item, vIndex)
+    {
+        const uint256& blockHash = item.first;
+        const CDiskBlockIndex& diskindex = item.second;
 
         // Construct block index object
         CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
@@ -381,34 +847,34 @@ bool CTxDB::LoadBlockIndex()
         if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
             pindexGenesisBlock = pindexNew;
 
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
+        if (!pindexNew->CheckIndex())
             return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
-        }
 
         // NovaCoin: build setStakeSeen
         if (pindexNew->IsProofOfStake())
             setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
 
-        iterator->Next();
+        nMaxHeight = std::max(nMaxHeight, pindexNew->nHeight);
     }
-    delete iterator;
+    if (!vIndex.empty() && nMaxHeight >= (int)vIndex.size())
+        return error("LoadBlockIndex() : height %d exceeds the %u index entries", nMaxHeight, vIndex.size());
+    vIndex.clear();
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainTrust
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
+    // Calculate nChainTrust. Bucketing by height gives a topological order
+    // (every parent is one height below its child) without sorting the index.
+    vector<vector<CBlockIndex*> > vByHeight(nMaxHeight + 1);
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
     {
         CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        if (pindex->nHeight >= 0 && pindex->nHeight <= nMaxHeight)
+            vByHeight[pindex->nHeight].push_back(pindex);
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    BOOST_FOREACH(const vector<CBlockIndex*>& vAtHeight, vByHeight)
     {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        BOOST_FOREACH(CBlockIndex* pindex, vAtHeight)
+            pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
     }
 
     // Load hashBestChain pointer to end of best chain
@@ -421,6 +887,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    chainActive.SetTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -438,125 +905,219 @@ bool CTxDB::LoadBlockIndex()
     ReadBestInvalidTrust(bnBestInvalidTrust);
     nBestInvalidTrust = bnBestInvalidTrust.getuint256();
 
-    // Verify blocks in the best chain
-    int nCheckLevel = GetArg("-checklevel", 1);
-    int nCheckDepth = GetArg( "-checkblocks", 500);
-    if (nCheckDepth == 0)
-        nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > nBestHeight)
-        nCheckDepth = nBestHeight;
-    LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CBlockIndex* pindexFork = NULL;
-    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
-    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
+    // Verify blocks in the best chain, or leave that to ThreadVerifyBlockIndex
+    // once the node is up.
+    if (GetBoolArg("-checkblocksbackground", false))
+        return true;
+    return VerifyBlockIndex(GetArg("-checklevel", 1), GetArg("-checkblocks", 500));
+}
+
+enum
+{
+    VERIFY_UNCHECKED = 0,
+    VERIFY_OK,
+    VERIFY_BAD,
+    VERIFY_READ_FAILED,
+};
+
+// Work shared by the block verification threads. Blocks are handed out in
+// order from the tip down, so the threads read neighbouring blocks from the
+// block files at the same time and keep the disk busy.
+struct CBlockVerifyJob
+{
+    int nCheckLevel;
+    std::vector<CBlockIndex*> vToCheck;
+    std::map<std::pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
+    std::vector<int> vResult;
+    size_t nNext;
+    boost::mutex mutex;
+};
+
+static int VerifyBlock(CTxDB& txdb, const CBlockVerifyJob& job, CBlockIndex* pindex)
+{
+    const int nCheckLevel = job.nCheckLevel;
+    bool fBad = false;
+    CBlock block;
+    if (!block.ReadFromDisk(pindex))
+        return VERIFY_READ_FAILED;
+    // check level 1: verify block validity
+    // check level 7: verify block signature too
+    if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
     {
-        boost::this_thread::interruption_point();
-        if (pindex->nHeight < nBestHeight-nCheckDepth)
-            break;
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        // check level 1: verify block validity
-        // check level 7: verify block signature too
-        if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
-        {
-            LogPrintf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-            pindexFork = pindex->pprev;
-        }
-        // check level 2: verify transaction index validity
-        if (nCheckLevel>1)
+        LogPrintf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+        fBad = true;
+    }
+    // check level 2: verify transaction index validity
+    if (nCheckLevel>1)
+    {
+        BOOST_FOREACH(const CTransaction &tx, block.vtx)
         {
-            pair<unsigned int, unsigned int> pos = make_pair(pindex->nFile, pindex->nBlockPos);
-            mapBlockPos[pos] = pindex;
-            BOOST_FOREACH(const CTransaction &tx, block.vtx)
+            uint256 hashTx = tx.GetHash();
+            CTxIndex txindex;
+            if (txdb.ReadTxIndex(hashTx, txindex))
             {
-                uint256 hashTx = tx.GetHash();
-                CTxIndex txindex;
-                if (ReadTxIndex(hashTx, txindex))
+                // check level 3: checker transaction hashes
+                if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
                 {
-                    // check level 3: checker transaction hashes
-                    if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
+                    // either an error or a duplicate transaction
+                    CTransaction txFound;
+                    if (!txFound.ReadFromDisk(txindex.pos))
                     {
-                        // either an error or a duplicate transaction
-                        CTransaction txFound;
-                        if (!txFound.ReadFromDisk(txindex.pos))
+                        LogPrintf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString());
+                        fBad = true;
+                    }
+                    else
+                        if (txFound.GetHash() != hashTx) // not a duplicate tx
                         {
-                            LogPrintf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString());
-                            pindexFork = pindex->pprev;
+                            LogPrintf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString());
+                            fBad = true;
                         }
-                        else
-                            if (txFound.GetHash() != hashTx) // not a duplicate tx
-                            {
-                                LogPrintf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString());
-                                pindexFork = pindex->pprev;
-                            }
-                    }
-                    // check level 4: check whether spent txouts were spent within the main chain
-                    unsigned int nOutput = 0;
-                    if (nCheckLevel>3)
+                }
+                // check level 4: check whether spent txouts were spent within the main chain
+                unsigned int nOutput = 0;
+                if (nCheckLevel>3)
+                {
+                    BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
                     {
-                        BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
+                        if (!txpos.IsNull())
                         {
-                            if (!txpos.IsNull())
+                            // the spend has to be in this block or one checked above it
+                            pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
+                            map<pair<unsigned int, unsigned int>, CBlockIndex*>::const_iterator mi = job.mapBlockPos.find(posFind);
+                            if (mi == job.mapBlockPos.end() || mi->second->nHeight < pindex->nHeight)
+                            {
+                                LogPrintf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString(), hashTx.ToString());
+                                fBad = true;
+                            }
+                            // check level 6: check whether spent txouts were spent by a valid transaction that consume them
+                            if (nCheckLevel>5)
                             {
-                                pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
-                                if (!mapBlockPos.count(posFind))
+                                CTransaction txSpend;
+                                if (!txSpend.ReadFromDisk(txpos))
                                 {
-                                    LogPrintf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString(), hashTx.ToString());
-                                    pindexFork = pindex->pprev;
+                                    LogPrintf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString(), nOutput);
+                                    fBad = true;
                                 }
-                                // check level 6: check whether spent txouts were spent by a valid transaction that consume them
-                                if (nCheckLevel>5)
+                                else if (!txSpend.CheckTransaction())
                                 {
-                                    CTransaction txSpend;
-                                    if (!txSpend.ReadFromDisk(txpos))
-                                    {
-                                        LogPrintf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else if (!txSpend.CheckTransaction())
-                                    {
-                                        LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else
+                                    LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString(), nOutput);
+                                    fBad = true;
+                                }
+                                else
+                                {
+                                    bool fFound = false;
+                                    BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
+                                        if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
+                                            fFound = true;
+                                    if (!fFound)
                                     {
-                                        bool fFound = false;
-                                        BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
-                                            if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
-                                                fFound = true;
-                                        if (!fFound)
-                                        {
-                                            LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString(), nOutput);
-                                            pindexFork = pindex->pprev;
-                                        }
+                                        LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString(), nOutput);
+                                        fBad = true;
                                     }
                                 }
                             }
-                            nOutput++;
                         }
+                        nOutput++;
                     }
                 }
-                // check level 5: check whether all prevouts are marked spent
-                if (nCheckLevel>4)
-                {
-                     BOOST_FOREACH(const CTxIn &txin, tx.vin)
-                     {
-                          CTxIndex txindex;
-                          if (ReadTxIndex(txin.prevout.hash, txindex))
-                              if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
-                              {
-                                  LogPrintf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString(), txin.prevout.n, hashTx.ToString());
-                                  pindexFork = pindex->pprev;
-                              }
-                     }
-                }
             }
+            // check level 5: check whether all prevouts are marked spent
+            if (nCheckLevel>4)
+            {
+                 BOOST_FOREACH(const CTxIn &txin, tx.vin)
+                 {
+                      CTxIndex txindex;
+                      if (txdb.ReadTxIndex(txin.prevout.hash, txindex))
+                          if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
+                          {
+                              LogPrintf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString(), txin.prevout.n, hashTx.ToString());
+                              fBad = true;
+                          }
+                 }
+            }
+        }
+    }
+    return fBad ? VERIFY_BAD : VERIFY_OK;
+}
+
+static void ThreadVerifyBlocks(CBlockVerifyJob* pjob)
+{
+    CTxDB txdb("r");
+    while (true)
+    {
+        boost::this_thread::interruption_point();
+        size_t i;
+        {
+            boost::mutex::scoped_lock lock(pjob->mutex);
+            if (pjob->nNext >= pjob->vToCheck.size())
+                return;
+            i = pjob->nNext++;
+        }
+        int nResult = VerifyBlock(txdb, *pjob, pjob->vToCheck[i]);
+        {
+            boost::mutex::scoped_lock lock(pjob->mutex);
+            pjob->vResult[i] = nResult;
+        }
+    }
+}
+
+bool VerifyBlockIndex(int nCheckLevel, int nCheckDepth)
+{
+    CBlockVerifyJob job;
+    job.nCheckLevel = nCheckLevel;
+    job.nNext = 0;
+    if (nCheckDepth <= 0)
+        nCheckDepth = 1000000000; // suffices until the year 19000
+    {
+        LOCK(cs_main);
+        if (nCheckDepth > nBestHeight)
+            nCheckDepth = nBestHeight;
+        for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
+        {
+            if (pindex->nHeight < nBestHeight-nCheckDepth)
+                break;
+            job.vToCheck.push_back(pindex);
+            if (nCheckLevel>1)
+                job.mapBlockPos[make_pair(pindex->nFile, pindex->nBlockPos)] = pindex;
         }
     }
+    job.vResult.assign(job.vToCheck.size(), VERIFY_UNCHECKED);
+
+    int nThreads = GetArg("-checkthreads", boost::thread::hardware_concurrency());
+    nThreads = std::max(1, std::min(nThreads, 16));
+    LogPrintf("Verifying last %i blocks at level %i using %d threads\n", nCheckDepth, nCheckLevel, nThreads);
+
+    boost::thread_group threadGroup;
+    for (int n = 0; n < nThreads; n++)
+        threadGroup.create_thread(boost::bind(&ThreadVerifyBlocks, &job));
+    try {
+        threadGroup.join_all();
+    }
+    catch (boost::thread_interrupted) {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        throw;
+    }
+
+    // Same outcome as checking one block at a time from the tip down: the
+    // best chain moves back to the parent of the lowest bad block.
+    CBlockIndex* pindexFork = NULL;
+    for (unsigned int i = 0; i < job.vToCheck.size(); i++)
+    {
+        if (job.vResult[i] == VERIFY_READ_FAILED)
+            return error("LoadBlockIndex() : block.ReadFromDisk failed");
+        if (job.vResult[i] == VERIFY_BAD)
+            pindexFork = job.vToCheck[i]->pprev;
+    }
     if (pindexFork)
     {
         boost::this_thread::interruption_point();
+        LOCK(cs_main);
+        if (pindexFork != pindexBest && !pindexFork->pnext)
+        {
+            LogPrintf("LoadBlockIndex() : *** block %d is no longer in the best chain\n", pindexFork->nHeight);
+            return true;
+        }
         // Reorg back to the fork
         LogPrintf("LoadBlockIndex() : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
         CBlock block;
@@ -568,3 +1129,24 @@ bool CTxDB::LoadBlockIndex()
 
     return true;
 }
+
+void ThreadVerifyBlockIndex()
+{
+    // Spent-output checks compare against the block positions collected when
+    // the check started, which blocks connected since then would fail.
+    int nCheckLevel = GetArg("-checklevel", 1);
+    if (nCheckLevel > 3)
+    {
+        LogPrintf("ThreadVerifyBlockIndex() : limiting background check level to 3\n");
+        nCheckLevel = 3;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    if (VerifyBlockIndex(nCheckLevel, GetArg("-checkblocks", 500)))
+        LogPrintf("Background block verification done  %dms\n", GetTimeMillis() - nStart);
+    else
+    {
+        strMiscWarning = _("Warning: background block verification failed, see debug.log for details.");
+        LogPrintf("Background block verification FAILED  %dms\n", GetTimeMillis() - nStart);
+    }
+}
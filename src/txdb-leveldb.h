@@ -15,6 +15,49 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+// Record types of the fixed-size txdb keys.
+static const char DB_TXINDEX = 't';
+static const char DB_BLOCKINDEX = 'b';
+
+// Values and keys up to this size are encoded on the stack; a CTxIndex or
+// block index entry is well below it.
+static const unsigned int TXDB_ENCODE_BUFFER_SIZE = 512;
+
+// Access counters of the txdb, in microseconds where timed.
+struct CTxDBStats
+{
+    uint64_t nGets;
+    uint64_t nGetMicros;
+    uint64_t nWrites;
+    uint64_t nWriteMicros;
+    uint64_t nSlowWrites;
+    uint64_t nSlowWriteMicros;
+
+    CTxDBStats() : nGets(0), nGetMicros(0), nWrites(0), nWriteMicros(0), nSlowWrites(0), nSlowWriteMicros(0) {}
+};
+
+CTxDBStats GetTxDBStats();
+
+// A txdb key made of a one byte record type followed by the raw 256-bit hash,
+// encoded in place so that building one never allocates.
+class CTxDBKey
+{
+private:
+    char data[1 + sizeof(uint256)];
+
+public:
+    CTxDBKey(char chType, const uint256& hash)
+    {
+        data[0] = chType;
+        memcpy(&data[1], hash.begin(), sizeof(uint256));
+    }
+
+    leveldb::Slice GetSlice() const
+    {
+        return leveldb::Slice(data, sizeof(data));
+    }
+};
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -50,45 +93,48 @@ private:
     bool fReadOnly;
     int nVersion;
 
+    // Reused by every read and by encodings too big for the stack, so a
+    // CTxDB that handles many records allocates only for the first.
+    std::string strValueBuffer;
+    std::vector<char> vchKeyBuffer;
+    std::vector<char> vchValueBuffer;
+
 protected:
     // Returns true and sets (value,false) if activeBatch contains the given key
     // or leaves value alone and sets deleted = true if activeBatch contains a
     // delete for it.
-    bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
+    bool ScanBatch(const leveldb::Slice &key, std::string *value, bool *deleted) const;
 
-    template<typename K, typename T>
-    bool Read(const K& key, T& value)
+    // Raw access by already encoded key, going through activeBatch if any.
+    bool ReadRaw(const leveldb::Slice& key, std::string& strValue);
+    bool WriteRaw(const leveldb::Slice& key, const leveldb::Slice& value);
+    bool EraseRaw(const leveldb::Slice& key);
+    bool ExistsRaw(const leveldb::Slice& key);
+
+    // Serialize obj into pchBuffer, or into vchSpill if it doesn't fit.
+    template<typename T>
+    static leveldb::Slice Encode(const T& obj, char* pchBuffer, std::vector<char>& vchSpill)
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
-        ssKey << key;
-        std::string strValue;
-
-        bool readFromDb = true;
-        if (activeBatch) {
-            // First we must search for it in the currently pending set of
-            // changes to the db. If not found in the batch, go on to read disk.
-            bool deleted = false;
-            readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
-            if (deleted) {
-                return false;
-            }
+        size_t nSize = ::GetSerializeSize(obj, SER_DISK, CLIENT_VERSION);
+        if (nSize > TXDB_ENCODE_BUFFER_SIZE)
+        {
+            vchSpill.resize(nSize);
+            pchBuffer = &vchSpill[0];
         }
-        if (readFromDb) {
-            leveldb::Status status = pdb->Get(leveldb::ReadOptions(),
-                                              ssKey.str(), &strValue);
-            if (!status.ok()) {
-                if (status.IsNotFound())
-                    return false;
-                // Some unexpected error.
-                LogPrintf("LevelDB read failure: %s\n", status.ToString());
-                return false;
-            }
-        }
-        // Unserialize value
+        CBufferWriter ssObj(pchBuffer, nSize, SER_DISK, CLIENT_VERSION);
+        ssObj << obj;
+        return leveldb::Slice(ssObj.data(), ssObj.size());
+    }
+
+    template<typename T>
+    bool ReadValue(const leveldb::Slice& key, T& value)
+    {
+        if (!ReadRaw(key, strValueBuffer))
+            return false;
+        // Unserialize value in place
         try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(),
-                                SER_DISK, CLIENT_VERSION);
+            CBufferReader ssValue(strValueBuffer.data(), strValueBuffer.data() + strValueBuffer.size(),
+                                  SER_DISK, CLIENT_VERSION);
             ssValue >> value;
         }
         catch (std::exception &e) {
@@ -97,68 +143,66 @@ protected:
         return true;
     }
 
-    template<typename K, typename T>
-    bool Write(const K& key, const T& value)
+    template<typename T>
+    bool WriteValue(const leveldb::Slice& key, const T& value)
     {
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
 
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
-        ssKey << key;
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.reserve(10000);
-        ssValue << value;
+        char pchValue[TXDB_ENCODE_BUFFER_SIZE];
+        return WriteRaw(key, Encode(value, pchValue, vchValueBuffer));
+    }
 
-        if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
-            return true;
-        }
-        leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
-        if (!status.ok()) {
-            LogPrintf("LevelDB write failure: %s\n", status.ToString());
-            return false;
-        }
-        return true;
+    // Per-hash records use fixed-size binary keys.
+    template<typename T>
+    bool Read(const CTxDBKey& key, T& value)
+    {
+        return ReadValue(key.GetSlice(), value);
+    }
+
+    template<typename T>
+    bool Write(const CTxDBKey& key, const T& value)
+    {
+        return WriteValue(key.GetSlice(), value);
+    }
+
+    bool Erase(const CTxDBKey& key)
+    {
+        return EraseRaw(key.GetSlice());
+    }
+
+    bool Exists(const CTxDBKey& key)
+    {
+        return ExistsRaw(key.GetSlice());
+    }
+
+    // Everything else is keyed by a serialized object, usually a string.
+    template<typename K, typename T>
+    bool Read(const K& key, T& value)
+    {
+        char pchKey[TXDB_ENCODE_BUFFER_SIZE];
+        return ReadValue(Encode(key, pchKey, vchKeyBuffer), value);
+    }
+
+    template<typename K, typename T>
+    bool Write(const K& key, const T& value)
+    {
+        char pchKey[TXDB_ENCODE_BUFFER_SIZE];
+        return WriteValue(Encode(key, pchKey, vchKeyBuffer), value);
     }
 
     template<typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
-            return false;
-        if (fReadOnly)
-            assert(!"Erase called on database in read-only mode");
-
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
-        ssKey << key;
-        if (activeBatch) {
-            activeBatch->Delete(ssKey.str());
-            return true;
-        }
-        leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
-        return (status.ok() || status.IsNotFound());
+        char pchKey[TXDB_ENCODE_BUFFER_SIZE];
+        return EraseRaw(Encode(key, pchKey, vchKeyBuffer));
     }
 
     template<typename K>
     bool Exists(const K& key)
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
-        ssKey << key;
-        std::string unused;
-
-        if (activeBatch) {
-            bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
-            }
-        }
-
-
-        leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
-        return status.IsNotFound() == false;
+        char pchKey[TXDB_ENCODE_BUFFER_SIZE];
+        return ExistsRaw(Encode(key, pchKey, vchKeyBuffer));
     }
 
 
@@ -202,9 +246,21 @@ public:
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
     bool LoadBlockIndex();
+    bool WriteBlockIndexSnapshot();
+
+    // LevelDB introspection for getdbstats.
+    bool GetProperty(const std::string& strName, std::string& strValue);
+    uint64_t GetApproximateSize(char chType);
 private:
     bool LoadBlockIndexGuts();
+    bool MigrateCompactKeys();
+    bool ReadBlockIndexSnapshot(std::vector<std::pair<uint256, CDiskBlockIndex> >& vIndex);
+    bool ReadBlockIndexEntries(std::vector<std::pair<uint256, CDiskBlockIndex> >& vIndex);
 };
 
+/** Check the last nCheckDepth blocks of the best chain at nCheckLevel and move
+ *  the best chain back before the lowest bad block found. */
+bool VerifyBlockIndex(int nCheckLevel, int nCheckDepth);
+void ThreadVerifyBlockIndex();
 
 #endif // BITCOIN_DB_H
@@ -9,8 +9,91 @@
 
 using namespace std;
 
+// Heap memory held by a transaction beyond sizeof(CTransaction)
+static size_t RecursiveDynamicUsage(const CTransaction& tx)
+{
+    size_t mem = memusage::DynamicUsage(tx.vin) + memusage::DynamicUsage(tx.vout);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        mem += memusage::DynamicUsage(*static_cast<const vector<unsigned char>*>(&txin.scriptSig));
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        mem += memusage::DynamicUsage(*static_cast<const vector<unsigned char>*>(&txout.scriptPubKey));
+    return mem;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry()
+{
+    nFee = 0; nTxSize = 0; nSigOps = 0; dPriority = 0.0; nValueInChain = 0; nTime = 0; nHeight = 0; nUsageSize = 0;
+    nCountWithAncestors = nSizeWithAncestors = 0; nFeesWithAncestors = 0;
+    nCountWithDescendants = nSizeWithDescendants = 0; nFeesWithDescendants = 0;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee, unsigned int _nSigOps,
+                                 double _dPriority, int64_t _nValueInChain, int64_t _nTime, unsigned int _nHeight):
+    tx(_tx), nFee(_nFee), nSigOps(_nSigOps), dPriority(_dPriority), nValueInChain(_nValueInChain), nTime(_nTime), nHeight(_nHeight)
+{
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nUsageSize = RecursiveDynamicUsage(tx);
+
+    nCountWithAncestors = nCountWithDescendants = 1;
+    nSizeWithAncestors = nSizeWithDescendants = nTxSize;
+    nFeesWithAncestors = nFeesWithDescendants = nFee;
+}
+
+// Priority is sum(valuein * age) / txsize. Inputs that were confirmed
+// when the transaction entered the pool gain one confirmation per block
+// since, so the entry priority can be aged without touching the disk.
+double CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
+{
+    if (currentHeight <= nHeight || nTxSize == 0)
+        return dPriority;
+    double deltaPriority = ((double)(currentHeight - nHeight) * nValueInChain) / nTxSize;
+    return dPriority + deltaPriority;
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, int64_t modifyFee, int64_t modifyCount)
+{
+    nSizeWithAncestors += modifySize;
+    nFeesWithAncestors += modifyFee;
+    nCountWithAncestors += modifyCount;
+    assert(int64_t(nCountWithAncestors) > 0);
+}
+
+void CTxMemPoolEntry::UpdateDescendantState(int64_t modifySize, int64_t modifyFee, int64_t modifyCount)
+{
+    nSizeWithDescendants += modifySize;
+    nFeesWithDescendants += modifyFee;
+    nCountWithDescendants += modifyCount;
+    assert(int64_t(nCountWithDescendants) > 0);
+}
+
+static CMemPoolFeeKey FeeKey(const uint256& hash, const CTxMemPoolEntry& entry)
+{
+    return CMemPoolFeeKey(entry.GetFee(), entry.GetTxSize(), hash);
+}
+
+static CMemPoolFeeKey AncestorFeeKey(const uint256& hash, const CTxMemPoolEntry& entry)
+{
+    return CMemPoolFeeKey(entry.GetFeesWithAncestors(), entry.GetSizeWithAncestors(), hash);
+}
+
+static CMemPoolFeeKey DescendantFeeKey(const uint256& hash, const CTxMemPoolEntry& entry)
+{
+    return CMemPoolFeeKey(entry.GetFeesWithDescendants(), entry.GetSizeWithDescendants(), hash);
+}
+
+// Rolling minimum fee halves every 12 hours (faster while the pool is small)
+static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
 CTxMemPool::CTxMemPool()
 {
+    nTransactionsUpdated = 0;
+    nLinks = 0;
+    nTotalTxSize = 0;
+    cachedInnerUsage = 0;
+    nEvicted = 0;
+    nExpired = 0;
+    dRollingMinimumFeeRate = 0;
+    nLastRollingFeeUpdate = GetTime();
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -25,16 +108,127 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+void CTxMemPool::UpdateAncestorState(TxMap::iterator it, int64_t modifySize, int64_t modifyFee, int64_t modifyCount)
+{
+    // The ancestor index is keyed on these totals, so re-file the entry
+    setByAncestorFeeRate.erase(AncestorFeeKey(it->first, it->second));
+    it->second.UpdateAncestorState(modifySize, modifyFee, modifyCount);
+    setByAncestorFeeRate.insert(AncestorFeeKey(it->first, it->second));
+}
+
+void CTxMemPool::UpdateDescendantState(TxMap::iterator it, int64_t modifySize, int64_t modifyFee, int64_t modifyCount)
+{
+    setByDescendantFeeRate.erase(DescendantFeeKey(it->first, it->second));
+    it->second.UpdateDescendantState(modifySize, modifyFee, modifyCount);
+    setByDescendantFeeRate.insert(DescendantFeeKey(it->first, it->second));
+}
+
+// Recompute package totals from scratch for the given transactions. Only
+// needed when a transaction joins or leaves the middle of a chain, which
+// happens when a reorganisation resurrects parents of pool transactions.
+void CTxMemPool::RecalculatePackageState(const set<uint256>& setAffected)
+{
+    BOOST_FOREACH(const uint256& hash, setAffected)
+    {
+        TxMap::iterator it = mapTx.find(hash);
+        if (it == mapTx.end())
+            continue;
+        const CTxMemPoolEntry& entry = it->second;
+
+        set<uint256> setAncestors;
+        CalculateMemPoolAncestors(hash, setAncestors);
+        int64_t nSize = entry.GetTxSize(), nFees = entry.GetFee(), nCount = 1;
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+        {
+            const CTxMemPoolEntry& ancestor = mapTx[hashAncestor];
+            nSize += ancestor.GetTxSize();
+            nFees += ancestor.GetFee();
+            nCount++;
+        }
+        UpdateAncestorState(it, nSize - entry.GetSizeWithAncestors(), nFees - entry.GetFeesWithAncestors(),
+                            nCount - entry.GetCountWithAncestors());
+
+        set<uint256> setDescendants;
+        CalculateDescendants(hash, setDescendants);
+        nSize = 0; nFees = 0; nCount = 0;
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+        {
+            const CTxMemPoolEntry& descendant = mapTx[hashDescendant];
+            nSize += descendant.GetTxSize();
+            nFees += descendant.GetFee();
+            nCount++;
+        }
+        UpdateDescendantState(it, nSize - entry.GetSizeWithDescendants(), nFees - entry.GetFeesWithDescendants(),
+                              nCount - entry.GetCountWithDescendants());
+    }
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = tx;
+        if (mapTx.count(hash))
+            return true;
+        TxMap::iterator it = mapTx.insert(make_pair(hash, entry)).first;
+        const CTransaction& tx = it->second.GetTx();
+        TxLinks& links = mapLinks[hash];
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+        {
+            mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+            const uint256& hashParent = tx.vin[i].prevout.hash;
+            if (mapTx.count(hashParent) && links.setParents.insert(hashParent).second)
+            {
+                mapLinks[hashParent].setChildren.insert(hash);
+                nLinks++;
+            }
+        }
+        // Pool transactions may already spend this one if it was
+        // resurrected from a disconnected block
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            NextTxMap::iterator mi = mapNextTx.find(COutPoint(hash, i));
+            if (mi == mapNextTx.end())
+                continue;
+            uint256 hashChild = mi->second.ptx->GetHash();
+            if (links.setChildren.insert(hashChild).second)
+            {
+                mapLinks[hashChild].setParents.insert(hash);
+                nLinks++;
+            }
+        }
+
+        setByFeeRate.insert(FeeKey(hash, it->second));
+        setByEntryTime.insert(make_pair(it->second.GetTime(), hash));
+        nTotalTxSize += it->second.GetTxSize();
+        cachedInnerUsage += it->second.GetDynamicMemoryUsage();
+        if (links.setChildren.empty())
+        {
+            set<uint256> setAncestors;
+            CalculateMemPoolAncestors(hash, setAncestors);
+            int64_t nSize = 0, nFees = 0;
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+            {
+                TxMap::iterator mi = mapTx.find(hashAncestor);
+                nSize += mi->second.GetTxSize();
+                nFees += mi->second.GetFee();
+                UpdateDescendantState(mi, it->second.GetTxSize(), it->second.GetFee(), 1);
+            }
+            it->second.UpdateAncestorState(nSize, nFees, setAncestors.size());
+            setByAncestorFeeRate.insert(AncestorFeeKey(hash, it->second));
+            setByDescendantFeeRate.insert(DescendantFeeKey(hash, it->second));
+        }
+        else
+        {
+            set<uint256> setAffected;
+            CalculateDescendants(hash, setAffected);
+            set<uint256> setDescendants(setAffected);
+            BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+                CalculateMemPoolAncestors(hashDescendant, setAffected);
+            RecalculatePackageState(setAffected);
+        }
         nTransactionsUpdated++;
     }
     return true;
@@ -46,18 +240,61 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
     {
         LOCK(cs);
         uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
+        TxMap::iterator it = mapTx.find(hash);
+        if (it != mapTx.end())
         {
             if (fRecursive) {
                 for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it != mapNextTx.end())
-                        remove(*it->second.ptx, true);
+                    NextTxMap::iterator itNext = mapNextTx.find(COutPoint(hash, i));
+                    if (itNext != mapNextTx.end())
+                        remove(*itNext->second.ptx, true);
                 }
             }
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+
+            // Take this transaction out of the packages it belongs to
+            const CTxMemPoolEntry& entry = it->second;
+            set<uint256> setAncestors, setDescendants;
+            CalculateMemPoolAncestors(hash, setAncestors);
+            CalculateDescendants(hash, setDescendants);
+            setDescendants.erase(hash);
+            bool fMiddle = !setAncestors.empty() && !setDescendants.empty();
+            if (!fMiddle)
+            {
+                BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+                    UpdateDescendantState(mapTx.find(hashAncestor), -(int64_t)entry.GetTxSize(), -entry.GetFee(), -1);
+                BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+                    UpdateAncestorState(mapTx.find(hashDescendant), -(int64_t)entry.GetTxSize(), -entry.GetFee(), -1);
+            }
+
+            TxLinks& links = mapLinks[hash];
+            nLinks -= links.setParents.size() + links.setChildren.size();
+            BOOST_FOREACH(const uint256& hashParent, links.setParents)
+                mapLinks[hashParent].setChildren.erase(hash);
+            BOOST_FOREACH(const uint256& hashChild, links.setChildren)
+                mapLinks[hashChild].setParents.erase(hash);
+            mapLinks.erase(hash);
+
+            setByFeeRate.erase(FeeKey(hash, entry));
+            setByAncestorFeeRate.erase(AncestorFeeKey(hash, entry));
+            setByDescendantFeeRate.erase(DescendantFeeKey(hash, entry));
+            setByEntryTime.erase(make_pair(entry.GetTime(), hash));
+            nTotalTxSize -= entry.GetTxSize();
+            cachedInnerUsage -= entry.GetDynamicMemoryUsage();
+            BOOST_FOREACH(const CTxIn& txin, entry.GetTx().vin)
                 mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
+            mapTx.erase(it);
+
+            // Descendants may have lost more than one ancestor
+            if (fMiddle)
+            {
+                set<uint256> setAffected(setAncestors);
+                BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+                {
+                    setAffected.insert(hashDescendant);
+                    CalculateMemPoolAncestors(hashDescendant, setAffected);
+                }
+                RecalculatePackageState(setAffected);
+            }
             nTransactionsUpdated++;
         }
     }
@@ -69,7 +306,7 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
     // Remove transactions which depend on inputs of tx, recursively
     LOCK(cs);
     BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
+        NextTxMap::iterator it = mapNextTx.find(txin.prevout);
         if (it != mapNextTx.end()) {
             const CTransaction &txConflict = *it->second.ptx;
             if (txConflict != tx)
@@ -84,6 +321,14 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapLinks.clear();
+    nLinks = 0;
+    setByFeeRate.clear();
+    setByAncestorFeeRate.clear();
+    setByDescendantFeeRate.clear();
+    setByEntryTime.clear();
+    nTotalTxSize = 0;
+    cachedInnerUsage = 0;
     ++nTransactionsUpdated;
 }
 
@@ -93,14 +338,165 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (TxMap::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
+const set<uint256>& CTxMemPool::GetMemPoolParents(const uint256& hash) const
+{
+    static const set<uint256> setEmpty;
+    LinksMap::const_iterator it = mapLinks.find(hash);
+    return it == mapLinks.end() ? setEmpty : it->second.setParents;
+}
+
+const set<uint256>& CTxMemPool::GetMemPoolChildren(const uint256& hash) const
+{
+    static const set<uint256> setEmpty;
+    LinksMap::const_iterator it = mapLinks.find(hash);
+    return it == mapLinks.end() ? setEmpty : it->second.setChildren;
+}
+
+// Adds all in-pool ancestors of hash (not hash itself) to setAncestors
+void CTxMemPool::CalculateMemPoolAncestors(const uint256& hash, set<uint256>& setAncestors) const
+{
+    vector<uint256> vStack(1, hash);
+    while (!vStack.empty())
+    {
+        uint256 hashCur = vStack.back();
+        vStack.pop_back();
+        BOOST_FOREACH(const uint256& hashParent, GetMemPoolParents(hashCur))
+            if (setAncestors.insert(hashParent).second)
+                vStack.push_back(hashParent);
+    }
+}
+
+// Adds hash and all of its in-pool descendants to setDescendants
+void CTxMemPool::CalculateDescendants(const uint256& hash, set<uint256>& setDescendants) const
+{
+    vector<uint256> vStack(1, hash);
+    setDescendants.insert(hash);
+    while (!vStack.empty())
+    {
+        uint256 hashCur = vStack.back();
+        vStack.pop_back();
+        BOOST_FOREACH(const uint256& hashChild, GetMemPoolChildren(hashCur))
+            if (setDescendants.insert(hashChild).second)
+                vStack.push_back(hashChild);
+    }
+}
+
+size_t CTxMemPool::DynamicUsage() const
+{
+    LOCK(cs);
+    // Link sets hold one node per relation on each side
+    size_t nLinkUsage = 2 * nLinks * memusage::MallocUsage(sizeof(memusage::stl_tree_node<uint256>));
+    return memusage::DynamicUsage(mapTx) + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapLinks) +
+           memusage::DynamicUsage(setByFeeRate) + memusage::DynamicUsage(setByAncestorFeeRate) +
+           memusage::DynamicUsage(setByDescendantFeeRate) + memusage::DynamicUsage(setByEntryTime) +
+           nLinkUsage + cachedInnerUsage;
+}
+
+void CTxMemPool::TrackPackageRemoved(double dFeeRate)
+{
+    AssertLockHeld(cs);
+    if (dFeeRate > dRollingMinimumFeeRate)
+    {
+        dRollingMinimumFeeRate = dFeeRate;
+        nLastRollingFeeUpdate = GetTime();
+    }
+}
+
+unsigned int CTxMemPool::TrimToSize(size_t nSizeLimit)
+{
+    LOCK(cs);
+    unsigned int nRemoved = 0;
+    double dMaxFeeRateRemoved = 0;
+    while (!mapTx.empty() && DynamicUsage() > nSizeLimit)
+    {
+        // Lowest package fee rate first; its descendants go with it
+        const CMemPoolFeeKey& key = *setByDescendantFeeRate.begin();
+
+        // New transactions must beat what was evicted by the minimum relay
+        // fee, so they are not simply evicted again
+        double dFeeRate = (double)key.nFee * 1000 / key.nSize + MIN_RELAY_TX_FEE;
+        dMaxFeeRateRemoved = max(dMaxFeeRateRemoved, dFeeRate);
+        TrackPackageRemoved(dFeeRate);
+
+        TxMap::iterator it = mapTx.find(key.hash);
+        nRemoved += it->second.GetCountWithDescendants();
+        CTransaction tx = it->second.GetTx();
+        remove(tx, true);
+    }
+    nEvicted += nRemoved;
+
+    if (nRemoved > 0)
+        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %d\n", nRemoved, (int64_t)dMaxFeeRateRemoved);
+    return nRemoved;
+}
+
+unsigned int CTxMemPool::Expire(int64_t nTime)
+{
+    LOCK(cs);
+    vector<uint256> vExpired;
+    for (set<pair<int64_t, uint256> >::const_iterator it = setByEntryTime.begin(); it != setByEntryTime.end() && it->first < nTime; ++it)
+        vExpired.push_back(it->second);
+
+    unsigned int nRemoved = 0;
+    BOOST_FOREACH(const uint256& hash, vExpired)
+    {
+        // May already be gone as a descendant of an earlier one
+        TxMap::iterator it = mapTx.find(hash);
+        if (it == mapTx.end())
+            continue;
+        nRemoved += it->second.GetCountWithDescendants();
+        CTransaction tx = it->second.GetTx();
+        remove(tx, true);
+    }
+    nExpired += nRemoved;
+    return nRemoved;
+}
+
+int64_t CTxMemPool::GetRollingMinFee(size_t nSizeLimit) const
+{
+    LOCK(cs);
+    if (dRollingMinimumFeeRate == 0)
+        return 0;
+
+    int64_t nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate + 10)
+    {
+        double dHalflife = ROLLING_FEE_HALFLIFE;
+        size_t nUsage = DynamicUsage();
+        if (nUsage < nSizeLimit / 4)
+            dHalflife /= 4;
+        else if (nUsage < nSizeLimit / 2)
+            dHalflife /= 2;
+
+        dRollingMinimumFeeRate = dRollingMinimumFeeRate / pow(2.0, (nNow - nLastRollingFeeUpdate) / dHalflife);
+        nLastRollingFeeUpdate = nNow;
+
+        if (dRollingMinimumFeeRate < MIN_RELAY_TX_FEE / 2)
+        {
+            dRollingMinimumFeeRate = 0;
+            return 0;
+        }
+    }
+    return max((int64_t)ceil(dRollingMinimumFeeRate), MIN_RELAY_TX_FEE);
+}
+
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    std::map<uint256, CTransaction>::const_iterator i = mapTx.find(hash);
+    TxMap::const_iterator i = mapTx.find(hash);
+    if (i == mapTx.end()) return false;
+    result = i->second.GetTx();
+    return true;
+}
+
+bool CTxMemPool::lookupEntry(uint256 hash, CTxMemPoolEntry& result) const
+{
+    LOCK(cs);
+    TxMap::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
     result = i->second;
     return true;
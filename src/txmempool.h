@@ -5,7 +5,87 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
-#include "core.h"
+#include "main.h"
+#include "memusage.h"
+
+#include <set>
+
+/*
+ * CTxMemPool stores these:
+ *
+ * Besides the transaction and the values computed once on entry, each
+ * entry carries the totals of its in-pool ancestors and descendants
+ * (including itself), which CTxMemPool keeps current as transactions
+ * enter and leave the pool.
+ */
+class CTxMemPoolEntry
+{
+private:
+    CTransaction tx;
+    int64_t nFee; // Cached to avoid expensive parent-transaction lookups
+    unsigned int nTxSize; // ... and avoid recomputing tx size
+    unsigned int nSigOps; // ... and legacy + P2SH sigop count
+    double dPriority; // Priority when entering the memory pool
+    int64_t nValueInChain; // Input value that was confirmed when entering the memory pool
+    int64_t nTime; // Local time when entering the memory pool
+    unsigned int nHeight; // Chain height when entering the memory pool
+    size_t nUsageSize; // Heap memory held by tx's vectors and scripts
+
+    // Package totals, including this transaction
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    int64_t nFeesWithDescendants;
+
+public:
+    CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee, unsigned int _nSigOps,
+                    double _dPriority, int64_t _nValueInChain, int64_t _nTime, unsigned int _nHeight);
+    CTxMemPoolEntry();
+
+    const CTransaction& GetTx() const { return this->tx; }
+    double GetPriority(unsigned int currentHeight) const;
+    int64_t GetFee() const { return nFee; }
+    unsigned int GetTxSize() const { return nTxSize; }
+    unsigned int GetSigOpCount() const { return nSigOps; }
+    int64_t GetTime() const { return nTime; }
+    unsigned int GetHeight() const { return nHeight; }
+    size_t GetDynamicMemoryUsage() const { return nUsageSize; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    int64_t GetFeesWithAncestors() const { return nFeesWithAncestors; }
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    int64_t GetFeesWithDescendants() const { return nFeesWithDescendants; }
+
+    void UpdateAncestorState(int64_t modifySize, int64_t modifyFee, int64_t modifyCount);
+    void UpdateDescendantState(int64_t modifySize, int64_t modifyFee, int64_t modifyCount);
+};
+
+/*
+ * Key of the fee-rate indexes: fee and size of a transaction or package,
+ * ordered by fee per byte (lowest first), ties broken by txid.
+ */
+class CMemPoolFeeKey
+{
+public:
+    int64_t nFee;
+    uint64_t nSize;
+    uint256 hash;
+
+    CMemPoolFeeKey(int64_t nFeeIn, uint64_t nSizeIn, const uint256& hashIn) : nFee(nFeeIn), nSize(nSizeIn), hash(hashIn) { }
+
+    friend bool operator<(const CMemPoolFeeKey& a, const CMemPoolFeeKey& b)
+    {
+        double f1 = (double)a.nFee * b.nSize;
+        double f2 = (double)b.nFee * a.nSize;
+        if (f1 != f2)
+            return f1 < f2;
+        return a.hash < b.hash;
+    }
+};
 
 /*
  * CTxMemPool stores valid-according-to-the-current-best-chain
@@ -19,17 +99,50 @@
  */
 class CTxMemPool
 {
+public:
+    typedef boost::unordered_map<uint256, CTxMemPoolEntry, SaltedUint256Hasher> TxMap;
+    typedef boost::unordered_map<COutPoint, CInPoint, SaltedOutpointHasher> NextTxMap;
+
 private:
     unsigned int nTransactionsUpdated;
 
+    struct TxLinks {
+        std::set<uint256> setParents;
+        std::set<uint256> setChildren;
+    };
+    typedef boost::unordered_map<uint256, TxLinks, SaltedUint256Hasher> LinksMap;
+    LinksMap mapLinks;
+    uint64_t nLinks; // parent/child relations, each held in two sets
+
+    uint64_t nTotalTxSize; // sum of entries' serialized sizes
+    uint64_t cachedInnerUsage; // sum of entries' dynamic memory usage
+    uint64_t nEvicted; // transactions removed by TrimToSize
+    uint64_t nExpired; // transactions removed by Expire
+
+    // Fee rate (per 1000 bytes) a transaction must pay once the pool has
+    // had to evict; decays towards zero
+    mutable double dRollingMinimumFeeRate;
+    mutable int64_t nLastRollingFeeUpdate;
+
+    void UpdateAncestorState(TxMap::iterator it, int64_t modifySize, int64_t modifyFee, int64_t modifyCount);
+    void UpdateDescendantState(TxMap::iterator it, int64_t modifySize, int64_t modifyFee, int64_t modifyCount);
+    void RecalculatePackageState(const std::set<uint256>& setAffected);
+    void TrackPackageRemoved(double dFeeRate);
+
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
-    std::map<COutPoint, CInPoint> mapNextTx;
+    TxMap mapTx;
+    NextTxMap mapNextTx;
+
+    // Secondary indexes over mapTx, iterate in reverse for best first
+    std::set<CMemPoolFeeKey> setByFeeRate;          // transaction's own fee rate
+    std::set<CMemPoolFeeKey> setByAncestorFeeRate;  // fee rate of the transaction and all in-pool ancestors
+    std::set<CMemPoolFeeKey> setByDescendantFeeRate; // fee rate of the transaction and all in-pool descendants
+    std::set<std::pair<int64_t, uint256> > setByEntryTime;
 
     CTxMemPool();
 
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
@@ -37,6 +150,27 @@ public:
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
+    // In-pool dependencies; callers must hold cs
+    const std::set<uint256>& GetMemPoolParents(const uint256& hash) const;
+    const std::set<uint256>& GetMemPoolChildren(const uint256& hash) const;
+    void CalculateMemPoolAncestors(const uint256& hash, std::set<uint256>& setAncestors) const;
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+
+    /** Estimated heap memory held by the pool, in bytes */
+    size_t DynamicUsage() const;
+    /** Evict the lowest fee rate packages until the pool fits in nSizeLimit
+     *  bytes. Returns the number of transactions removed. */
+    unsigned int TrimToSize(size_t nSizeLimit);
+    /** Remove transactions (and their descendants) that entered before nTime.
+     *  Returns the number of transactions removed. */
+    unsigned int Expire(int64_t nTime);
+    /** Minimum fee per 1000 bytes for new transactions, 0 unless the pool has
+     *  recently been full. Decays faster while the pool is well under nSizeLimit. */
+    int64_t GetRollingMinFee(size_t nSizeLimit) const;
+    uint64_t GetEvictedCount() const { LOCK(cs); return nEvicted; }
+    uint64_t GetExpiredCount() const { LOCK(cs); return nExpired; }
+    uint64_t GetTotalTxSize() const { LOCK(cs); return nTotalTxSize; }
+
     unsigned long size() const
     {
         LOCK(cs);
@@ -50,6 +184,7 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+    bool lookupEntry(uint256 hash, CTxMemPoolEntry& result) const;
 };
 
 #endif /* BITCOIN_TXMEMPOOL_H */
@@ -0,0 +1,120 @@
+// Copyright (c) 2016 The BiosCrypto developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txverify.h"
+#include "txdb.h"
+#include "txmempool.h"
+
+using namespace std;
+
+CTxVerifyQueue txVerifyQueue;
+
+boost::shared_ptr<CTxVerifyJob> CTxVerifyQueue::Push(const CTransaction& tx)
+{
+    boost::shared_ptr<CTxVerifyJob> job(new CTxVerifyJob(tx));
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        queue.push_back(job);
+    }
+    condWorker.notify_one();
+    return job;
+}
+
+bool CTxVerifyQueue::IsDone(const CTxVerifyJob& job)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return job.fDone;
+}
+
+size_t CTxVerifyQueue::size()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return queue.size();
+}
+
+void CTxVerifyQueue::Verify(CTxVerifyJob& job)
+{
+    const CTransaction& tx = *job.ptx;
+
+    if (!tx.CheckTransaction())
+    {
+        job.fCheckFailed = true;
+        return;
+    }
+    if (tx.IsCoinBase() || tx.IsCoinStake())
+        return;
+
+    // Leave already known transactions and orphans to AcceptToMemoryPool,
+    // which decides on them without touching signatures
+    if (mempool.exists(tx.GetHash()))
+        return;
+    CTxDB txdb("r");
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (!mempool.exists(txin.prevout.hash) && !txdb.ContainsTx(txin.prevout.hash))
+            return;
+
+    // FetchInputs charges tx.nDoS for bad inputs, and AcceptToMemoryPool
+    // finds and charges the same again, so only its verdict is kept
+    MapPrevTx mapInputs;
+    TxIndexMap mapUnused;
+    bool fInvalid = false;
+    bool fFetched = tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid);
+    tx.nDoS = 0;
+    if (!fFetched)
+        return;
+
+    // Spentness is not looked at: that and everything else depending on
+    // the chain is decided by AcceptToMemoryPool under cs_main
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        const CTransaction& txPrev = mapInputs[tx.vin[i].prevout.hash].second;
+        if (!VerifySignature(txPrev, tx, i, STANDARD_SCRIPT_VERIFY_FLAGS, 0))
+            break;
+    }
+}
+
+void CTxVerifyQueue::Thread()
+{
+    while (true)
+    {
+        boost::shared_ptr<CTxVerifyJob> job;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (queue.empty())
+                condWorker.wait(lock);
+            job = queue.front();
+            queue.pop_front();
+        }
+
+        try
+        {
+            Verify(*job);
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "CTxVerifyQueue::Thread()");
+        }
+
+        bool fIdle;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            job->fDone = true;
+            fIdle = queue.empty();
+        }
+        // Let the message handler pick up the results once a burst is done
+        if (fIdle)
+            RequestMessageHandlerRound();
+    }
+}
+
+static void ThreadTxVerify()
+{
+    txVerifyQueue.Thread();
+}
+
+void CTxVerifyQueue::Start(boost::thread_group& threadGroup, int nThreadsIn)
+{
+    nThreads = nThreadsIn;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "txverify", &ThreadTxVerify));
+}
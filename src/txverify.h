@@ -0,0 +1,67 @@
+// Copyright (c) 2016 The BiosCrypto developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_TXVERIFY_H
+#define BITCOIN_TXVERIFY_H
+
+#include "main.h"
+
+#include <deque>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+/** Maximum number of transaction verification threads */
+static const int MAX_TX_VERIFY_THREADS = 16;
+/** Relayed transactions a peer may have awaiting verification before its
+ *  further messages wait */
+static const unsigned int MAX_PEER_TX_VERIFY = 1000;
+
+/** A relayed transaction on its way through the verification threads */
+class CTxVerifyJob
+{
+public:
+    boost::shared_ptr<const CTransaction> ptx;
+    bool fDone;  // guarded by the queue's mutex
+    bool fCheckFailed; // failed the context-free checks, ptx->nDoS is set
+
+    CTxVerifyJob(const CTransaction& tx) : ptx(new CTransaction(tx)), fDone(false), fCheckFailed(false) { }
+};
+
+/**
+ * Work queue for the transaction verification threads.
+ *
+ * The threads run a transaction's context-free checks and verify its input
+ * scripts against the inputs as they are at that moment, without cs_main.
+ * Valid signatures are kept in the signature cache, so AcceptToMemoryPool,
+ * run afterwards by the message handler, re-checks the inputs under cs_main
+ * but finds every signature already verified.
+ */
+class CTxVerifyQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    std::deque<boost::shared_ptr<CTxVerifyJob> > queue;
+    int nThreads;
+
+    void Verify(CTxVerifyJob& job);
+
+public:
+    CTxVerifyQueue() : nThreads(0) { }
+
+    /** Queue tx for verification; the job is done once IsDone returns true */
+    boost::shared_ptr<CTxVerifyJob> Push(const CTransaction& tx);
+    bool IsDone(const CTxVerifyJob& job);
+    size_t size();
+
+    /** Number of verification threads, 0 if transactions are checked inline */
+    int GetThreadCount() const { return nThreads; }
+
+    void Start(boost::thread_group& threadGroup, int nThreadsIn);
+    void Thread();
+};
+
+extern CTxVerifyQueue txVerifyQueue;
+
+#endif
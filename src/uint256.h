@@ -786,6 +786,30 @@ inline const uint512 operator-(const uint512& a, const uint512& b)      { return
 
 
 
+/** SipHash-2-4 of a uint256, optionally followed by a 32-bit value;
+ *  defined in hash.cpp */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+uint64_t SipHashUint256Extra(uint64_t k0, uint64_t k1, const uint256& val, uint32_t extra);
+/** Random SipHash key, chosen once per process */
+void GetSaltedHashKey(uint64_t& k0, uint64_t& k1);
+
+/** Hasher for hash tables keyed by uint256. Transaction and block hashes
+ *  can be ground by an attacker to collide in an unsalted table, so the
+ *  hash is keyed with a per-process secret. */
+class SaltedUint256Hasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    SaltedUint256Hasher() { GetSaltedHashKey(k0, k1); }
+
+    size_t operator()(const uint256& hash) const
+    {
+        return SipHashUint256(k0, k1, hash);
+    }
+};
+
 #ifdef TEST_UINT256
 
 inline int Testuint256AdHoc(std::vector<std::string> vArg)